@@ -0,0 +1,278 @@
+//
+//  AirportIOCTL.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Request number indexed ioctl table shared by apple80211Request and
+//  apple80211VirtualRequest.
+//
+
+#include "BCMWLANFirmware_Hashstore.hpp"
+
+#define kItlIoctlTableSize  kItlIoctlCount
+
+#define kIoctlSta           0x1     /* served on the station interface */
+#define kIoctlVirtual       0x2     /* served on AWDL/P2P interfaces */
+#define kIoctlVirtualGet    0x4     /* AWDL/P2P interfaces may only read it */
+#define kIoctlInterrupt     0x8     /* get handler never blocks, fine at interrupt context */
+#define kIoctlAsync         0x10    /* set handler may block on the HAL, run it from the command queue */
+#define kIoctlCoalesce      0x20    /* a queued set only matters until the next one of its kind */
+
+typedef IOReturn (*ItlIoctlHandler)(BCMWLANFirmware_Hashstore *that, OSObject *object, void *data);
+
+struct ItlIoctlEntry {
+    ItlIoctlHandler get;
+    ItlIoctlHandler set;
+    uint32_t size;
+    uint32_t flags;
+    int done;               /* APPLE80211_M_* posted when a queued set succeeded, 0 for none */
+    const char *name;       /* request name without APPLE80211_IOC_, as in IOCTL_NAMES */
+};
+
+struct ItlIoctlTable {
+    struct ItlIoctlEntry entries[kItlIoctlTableSize];
+};
+
+template <typename T, IOReturn (BCMWLANFirmware_Hashstore::*F)(OSObject *, T *)>
+static IOReturn ioctlThunk(BCMWLANFirmware_Hashstore *that, OSObject *object, void *data)
+{
+    return (that->*F)(object, (T *)data);
+}
+
+static IOReturn disassociateThunk(BCMWLANFirmware_Hashstore *that, OSObject *object, void *data)
+{
+    return that->setDISASSOCIATE(object);
+}
+
+#define IOCTL_HANDLER(DIR, REQ, DATA_TYPE) \
+ioctlThunk<struct DATA_TYPE, &BCMWLANFirmware_Hashstore::DIR##REQ>
+
+#define IOCTL_ENTRY(REQ, DATA_TYPE, FLAGS) \
+{ IOCTL_HANDLER(get, REQ, DATA_TYPE), IOCTL_HANDLER(set, REQ, DATA_TYPE), sizeof(struct DATA_TYPE), FLAGS }
+#define IOCTL_ENTRY_GET(REQ, DATA_TYPE, FLAGS) \
+{ IOCTL_HANDLER(get, REQ, DATA_TYPE), NULL, sizeof(struct DATA_TYPE), FLAGS }
+#define IOCTL_ENTRY_SET(REQ, DATA_TYPE, FLAGS) \
+{ NULL, IOCTL_HANDLER(set, REQ, DATA_TYPE), sizeof(struct DATA_TYPE), FLAGS }
+
+static constexpr void
+setIoctlEntry(struct ItlIoctlTable &t, int request, const char *name, struct ItlIoctlEntry entry)
+{
+    entry.name = name;
+    t.entries[request] = entry;
+}
+
+#define IOCTL(REQ, ENTRY) setIoctlEntry(t, APPLE80211_IOC_##REQ, #REQ, ENTRY)
+
+static constexpr struct ItlIoctlTable
+buildIoctlTable()
+{
+    struct ItlIoctlTable t = {};
+
+    //AirportSTAIOCTL
+    IOCTL(SSID, IOCTL_ENTRY(SSID, apple80211_ssid_data, kIoctlSta | kIoctlVirtual | kIoctlInterrupt));
+    IOCTL(AUTH_TYPE, IOCTL_ENTRY(AUTH_TYPE, apple80211_authtype_data, kIoctlSta | kIoctlVirtual));
+    IOCTL(CHANNEL, IOCTL_ENTRY(CHANNEL, apple80211_channel_data, kIoctlSta | kIoctlVirtual | kIoctlInterrupt));
+    IOCTL(PROTMODE, IOCTL_ENTRY(PROTMODE, apple80211_protmode_data, kIoctlSta));
+    IOCTL(TXPOWER, IOCTL_ENTRY_GET(TXPOWER, apple80211_txpower_data, kIoctlSta | kIoctlInterrupt));
+    IOCTL(RATE, IOCTL_ENTRY_GET(RATE, apple80211_rate_data, kIoctlSta | kIoctlVirtual | kIoctlInterrupt));
+    IOCTL(BSSID, IOCTL_ENTRY(BSSID, apple80211_bssid_data, kIoctlSta | kIoctlVirtual | kIoctlInterrupt));
+    IOCTL(SCAN_REQ, IOCTL_ENTRY_SET(SCAN_REQ, apple80211_scan_data, kIoctlSta));
+    IOCTL(SCAN_REQ_MULTIPLE, IOCTL_ENTRY_SET(SCAN_REQ_MULTIPLE, apple80211_scan_multiple_data, kIoctlSta));
+    IOCTL(SCAN_RESULT, IOCTL_ENTRY_GET(SCAN_RESULT, apple80211_scan_result*, kIoctlSta));
+    IOCTL(CARD_CAPABILITIES, IOCTL_ENTRY_GET(CARD_CAPABILITIES, apple80211_capability_data, kIoctlSta | kIoctlVirtual | kIoctlInterrupt));
+    IOCTL(STATE, IOCTL_ENTRY_GET(STATE, apple80211_state_data, kIoctlSta | kIoctlVirtual | kIoctlInterrupt));
+    IOCTL(PHY_MODE, IOCTL_ENTRY_GET(PHY_MODE, apple80211_phymode_data, kIoctlSta | kIoctlVirtual | kIoctlInterrupt));
+    IOCTL(OP_MODE, IOCTL_ENTRY_GET(OP_MODE, apple80211_opmode_data, kIoctlSta | kIoctlVirtual | kIoctlInterrupt));
+    IOCTL(RSSI, IOCTL_ENTRY_GET(RSSI, apple80211_rssi_data, kIoctlSta | kIoctlVirtual | kIoctlInterrupt));
+    IOCTL(NOISE, IOCTL_ENTRY_GET(NOISE, apple80211_noise_data, kIoctlSta));
+    IOCTL(INT_MIT, IOCTL_ENTRY(INT_MIT, apple80211_intmit_data, kIoctlSta));
+    IOCTL(POWER, IOCTL_ENTRY(POWER, apple80211_power_data, kIoctlSta | kIoctlVirtualGet));
+    IOCTL(ASSOCIATE, IOCTL_ENTRY_SET(ASSOCIATE, apple80211_assoc_data, kIoctlSta));
+    IOCTL(ASSOCIATE_RESULT, IOCTL_ENTRY_GET(ASSOCIATE_RESULT, apple80211_assoc_result_data, kIoctlSta));
+    IOCTL(DISASSOCIATE, (ItlIoctlEntry{ NULL, disassociateThunk, 0, kIoctlSta }));
+    IOCTL(RATE_SET, IOCTL_ENTRY_GET(RATE_SET, apple80211_rate_set_data, kIoctlSta));
+    IOCTL(MCS_INDEX_SET, IOCTL_ENTRY_GET(MCS_INDEX_SET, apple80211_mcs_index_set_data, kIoctlSta));
+    IOCTL(VHT_MCS_INDEX_SET, IOCTL_ENTRY_GET(VHT_MCS_INDEX_SET, apple80211_vht_mcs_index_set_data, kIoctlSta));
+    IOCTL(MCS_VHT, IOCTL_ENTRY(MCS_VHT, apple80211_mcs_vht_data, kIoctlSta));
+    IOCTL(SUPPORTED_CHANNELS, IOCTL_ENTRY_GET(SUPPORTED_CHANNELS, apple80211_sup_channel_data, kIoctlSta | kIoctlVirtual));
+    IOCTL(HW_SUPPORTED_CHANNELS, IOCTL_ENTRY_GET(SUPPORTED_CHANNELS, apple80211_sup_channel_data, kIoctlSta));
+    IOCTL(LOCALE, IOCTL_ENTRY_GET(LOCALE, apple80211_locale_data, kIoctlSta));
+    IOCTL(DEAUTH, IOCTL_ENTRY(DEAUTH, apple80211_deauth_data, kIoctlSta));
+    IOCTL(TX_ANTENNA, IOCTL_ENTRY_GET(TX_ANTENNA, apple80211_antenna_data, kIoctlSta));
+    IOCTL(ANTENNA_DIVERSITY, IOCTL_ENTRY_GET(ANTENNA_DIVERSITY, apple80211_antenna_data, kIoctlSta));
+    IOCTL(DRIVER_VERSION, IOCTL_ENTRY_GET(DRIVER_VERSION, apple80211_version_data, kIoctlSta | kIoctlVirtual));
+    IOCTL(HARDWARE_VERSION, IOCTL_ENTRY_GET(HARDWARE_VERSION, apple80211_version_data, kIoctlSta));
+    IOCTL(RSN_IE, IOCTL_ENTRY(RSN_IE, apple80211_rsn_ie_data, kIoctlSta));
+    IOCTL(AP_IE_LIST, IOCTL_ENTRY_GET(AP_IE_LIST, apple80211_ap_ie_data, kIoctlSta));
+    IOCTL(ASSOCIATION_STATUS, IOCTL_ENTRY_GET(ASSOCIATION_STATUS, apple80211_assoc_status_data, kIoctlSta | kIoctlInterrupt));
+    IOCTL(COUNTRY_CODE, IOCTL_ENTRY_GET(COUNTRY_CODE, apple80211_country_code_data, kIoctlSta));
+    IOCTL(RADIO_INFO, IOCTL_ENTRY_GET(RADIO_INFO, apple80211_radio_info_data, kIoctlSta));
+    IOCTL(MCS, IOCTL_ENTRY_GET(MCS, apple80211_mcs_data, kIoctlSta));
+    IOCTL(VIRTUAL_IF_CREATE, IOCTL_ENTRY_SET(VIRTUAL_IF_CREATE, apple80211_virt_if_create_data, kIoctlSta));
+    IOCTL(VIRTUAL_IF_DELETE, IOCTL_ENTRY_SET(VIRTUAL_IF_DELETE, apple80211_virt_if_delete_data, kIoctlSta));
+    IOCTL(ROAM_THRESH, IOCTL_ENTRY_GET(ROAM_THRESH, apple80211_roam_threshold_data, kIoctlSta));
+    IOCTL(LINK_CHANGED_EVENT_DATA, IOCTL_ENTRY_GET(LINK_CHANGED_EVENT_DATA, apple80211_link_changed_event_data, kIoctlSta | kIoctlInterrupt));
+    IOCTL(POWERSAVE, IOCTL_ENTRY(POWERSAVE, apple80211_powersave_data, kIoctlSta));
+    IOCTL(CIPHER_KEY, IOCTL_ENTRY_SET(CIPHER_KEY, apple80211_key, kIoctlSta));
+    // the handler never reads its payload, so none is required
+    IOCTL(SCANCACHE_CLEAR, (ItlIoctlEntry{ NULL, IOCTL_HANDLER(set, SCANCACHE_CLEAR, apple80211req), 0, kIoctlSta }));
+    IOCTL(TX_NSS, IOCTL_ENTRY(TX_NSS, apple80211_tx_nss_data, kIoctlSta));
+    IOCTL(NSS, IOCTL_ENTRY_GET(NSS, apple80211_nss_data, kIoctlSta));
+    IOCTL(ROAM, IOCTL_ENTRY_SET(ROAM, apple80211_sta_roam_data, kIoctlSta));
+    IOCTL(ROAM_PROFILE, IOCTL_ENTRY(ROAM_PROFILE, apple80211_roam_profile_band_data, kIoctlSta | kIoctlVirtual));
+    IOCTL(WOW_PARAMETERS, IOCTL_ENTRY(WOW_PARAMETERS, apple80211_wow_parameter_data, kIoctlSta));
+    IOCTL(IE, IOCTL_ENTRY(IE, apple80211_ie_data, kIoctlSta | kIoctlVirtual));
+    IOCTL(P2P_LISTEN, IOCTL_ENTRY_SET(P2P_LISTEN, apple80211_p2p_listen_data, kIoctlSta | kIoctlVirtual));
+    IOCTL(P2P_SCAN, IOCTL_ENTRY_SET(P2P_SCAN, apple80211_scan_data, kIoctlSta | kIoctlVirtual));
+    IOCTL(P2P_GO_CONF, IOCTL_ENTRY_SET(P2P_GO_CONF, apple80211_p2p_go_conf_data, kIoctlSta | kIoctlVirtual));
+
+    //AirportVirtualIOCTL
+    IOCTL(AWDL_PEER_TRAFFIC_REGISTRATION, IOCTL_ENTRY(AWDL_PEER_TRAFFIC_REGISTRATION, apple80211_awdl_peer_traffic_registration, kIoctlVirtual));
+    IOCTL(AWDL_SYNC_ENABLED, IOCTL_ENTRY(SYNC_ENABLED, apple80211_awdl_sync_enabled, kIoctlVirtual));
+    IOCTL(AWDL_SYNC_FRAME_TEMPLATE, IOCTL_ENTRY(SYNC_FRAME_TEMPLATE, apple80211_awdl_sync_frame_template, kIoctlVirtual));
+    IOCTL(HT_CAPABILITY, IOCTL_ENTRY_GET(AWDL_HT_CAPABILITY, apple80211_ht_capability, kIoctlVirtual));
+    IOCTL(VHT_CAPABILITY, IOCTL_ENTRY_GET(AWDL_VHT_CAPABILITY, apple80211_vht_capability, kIoctlVirtual));
+    IOCTL(AWDL_ELECTION_METRIC, IOCTL_ENTRY(AWDL_ELECTION_METRIC, apple80211_awdl_election_metric, kIoctlVirtual));
+    IOCTL(AWDL_BSSID, IOCTL_ENTRY(AWDL_BSSID, apple80211_awdl_bssid, kIoctlVirtual));
+    IOCTL(PEER_CACHE_MAXIMUM_SIZE, IOCTL_ENTRY(PEER_CACHE_MAXIMUM_SIZE, apple80211_peer_cache_maximum_size, kIoctlVirtual));
+    IOCTL(AWDL_ELECTION_ID, IOCTL_ENTRY(AWDL_ELECTION_ID, apple80211_awdl_election_id, kIoctlVirtual));
+    IOCTL(AWDL_MASTER_CHANNEL, IOCTL_ENTRY(AWDL_MASTER_CHANNEL, apple80211_awdl_master_channel, kIoctlVirtual));
+    IOCTL(AWDL_SECONDARY_MASTER_CHANNEL, IOCTL_ENTRY(AWDL_SECONDARY_MASTER_CHANNEL, apple80211_awdl_secondary_master_channel, kIoctlVirtual));
+    IOCTL(AWDL_MIN_RATE, IOCTL_ENTRY(AWDL_MIN_RATE, apple80211_awdl_min_rate, kIoctlVirtual));
+    IOCTL(AWDL_ELECTION_RSSI_THRESHOLDS, IOCTL_ENTRY(AWDL_ELECTION_RSSI_THRESHOLDS, apple80211_awdl_election_rssi_thresholds, kIoctlVirtual));
+    IOCTL(AWDL_SYNCHRONIZATION_CHANNEL_SEQUENCE, IOCTL_ENTRY(AWDL_SYNCHRONIZATION_CHANNEL_SEQUENCE, apple80211_awdl_sync_channel_sequence, kIoctlVirtual));
+    IOCTL(AWDL_PRESENCE_MODE, IOCTL_ENTRY(AWDL_PRESENCE_MODE, apple80211_awdl_presence_mode, kIoctlVirtual));
+    IOCTL(AWDL_EXTENSION_STATE_MACHINE_PARAMETERS, IOCTL_ENTRY(AWDL_EXTENSION_STATE_MACHINE_PARAMETERS, apple80211_awdl_extension_state_machine_parameter, kIoctlVirtual));
+    IOCTL(AWDL_SYNC_STATE, IOCTL_ENTRY(AWDL_SYNC_STATE, apple80211_awdl_sync_state, kIoctlVirtual));
+    IOCTL(AWDL_SYNC_PARAMS, IOCTL_ENTRY(AWDL_SYNC_PARAMS, apple80211_awdl_sync_params, kIoctlVirtual));
+    IOCTL(AWDL_CAPABILITIES, IOCTL_ENTRY_GET(AWDL_CAPABILITIES, apple80211_awdl_cap, kIoctlVirtual));
+    IOCTL(AWDL_AF_TX_MODE, IOCTL_ENTRY(AWDL_AF_TX_MODE, apple80211_awdl_af_tx_mode, kIoctlVirtual));
+    IOCTL(AWDL_OOB_AUTO_REQUEST, IOCTL_ENTRY_SET(AWDL_OOB_AUTO_REQUEST, apple80211_awdl_oob_request, kIoctlVirtual));
+
+    // firmware bring-up; every power change has to run, an off/on cycle resets the firmware
+    t.entries[APPLE80211_IOC_POWER].flags |= kIoctlAsync;
+    t.entries[APPLE80211_IOC_POWER].done = APPLE80211_M_POWER_CHANGED;
+    // state machine kicks; association reports through ASSOC_DONE itself
+    t.entries[APPLE80211_IOC_ASSOCIATE].flags |= kIoctlAsync | kIoctlCoalesce;
+    t.entries[APPLE80211_IOC_CHANNEL].flags |= kIoctlAsync | kIoctlCoalesce;
+
+    return t;
+}
+
+static constexpr struct ItlIoctlTable ioctlTable = buildIoctlTable();
+
+static_assert(sizeof(IOCTL_NAMES) / sizeof(IOCTL_NAMES[0]) <= kItlIoctlTableSize,
+              "the ioctl table must have a slot for every request IOCTL_NAMES knows");
+
+static constexpr bool
+ioctlNameEqual(const char *a, const char *b)
+{
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+/*
+ * Every handled request that IOCTL_NAMES knows has to sit in the slot
+ * IOCTL_NAMES names it for, so a wrong APPLE80211_IOC_* number in the table
+ * or in apple80211_ioctl.h fails the build. Requests past the end of
+ * IOCTL_NAMES (AWDL_CAPABILITIES, NSS) are not checked.
+ */
+static constexpr bool
+ioctlTableMatchesNames()
+{
+    for (size_t i = 0; i < kItlIoctlTableSize; i++) {
+        const struct ItlIoctlEntry &entry = ioctlTable.entries[i];
+        if (entry.get == NULL && entry.set == NULL) {
+            continue;
+        }
+        if (entry.name == NULL) {
+            return false;
+        }
+        if (i < sizeof(IOCTL_NAMES) / sizeof(IOCTL_NAMES[0]) && !ioctlNameEqual(IOCTL_NAMES[i], entry.name)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(ioctlTableMatchesNames(), "an ioctl table entry is not in the slot IOCTL_NAMES gives its request");
+
+/*
+ * Nothing that may block runs at interrupt context: setters and getters
+ * without kIoctlInterrupt return kIOReturnNotPermitted there instead of
+ * running a handler that might sleep.
+ */
+SInt32 BCMWLANFirmware_Hashstore::
+dispatchIoctl(unsigned int request_type, int request_number, OSObject *interface, void *data, bool isVirtual)
+{
+    const struct ItlIoctlEntry *entry = NULL;
+    ItlIoctlHandler handler;
+    bool isGet = request_type == SIOCGA80211;
+    uint64_t start;
+    IOReturn ret;
+
+    if (request_type != SIOCGA80211 && request_type != SIOCSA80211) {
+        return kIOReturnError;
+    }
+    if (request_number >= 0 && request_number < kItlIoctlTableSize) {
+        entry = &ioctlTable.entries[request_number];
+    }
+    if (entry == NULL || !(entry->flags & (isVirtual ? (kIoctlVirtual | kIoctlVirtualGet) : kIoctlSta))) {
+        if (!ml_at_interrupt_context()) {
+            XYLog("%s Unhandled IOCTL %s (%d) %s\n", __FUNCTION__, IOCTL_NAMES[(request_number < 0 || request_number >= ARRAY_SIZE(IOCTL_NAMES)) ? 0 : request_number],
+                  request_number, isGet ? "get" : "set");
+        }
+        fIoctlStats.recordUnhandled(request_number);
+        return kIOReturnError;
+    }
+    handler = isGet ? entry->get : entry->set;
+    if (handler == NULL || (isVirtual && !isGet && !(entry->flags & kIoctlVirtual))) {
+        fIoctlStats.recordUnhandled(request_number);
+        return kIOReturnError;
+    }
+    if (ml_at_interrupt_context() && !(isGet && (entry->flags & kIoctlInterrupt))) {
+        return kIOReturnNotPermitted;
+    }
+    // the apple80211 entry points carry no length, a sized request needs at least a payload
+    if (data == NULL && entry->size != 0) {
+        fIoctlStats.record(request_number, isGet, kIOReturnBadArgument, 0);
+        return kIOReturnBadArgument;
+    }
+    if (!isGet && (entry->flags & kIoctlAsync) && commandSource &&
+        fCommands.enqueue(request_number, interface, data, entry->size, entry->flags & kIoctlCoalesce)) {
+        // getPOWER answers with the requested state while the change waits in the queue
+        if (request_number == APPLE80211_IOC_POWER && ((struct apple80211_power_data *)data)->num_radios > 0) {
+            power_state = ((struct apple80211_power_data *)data)->power_state[0];
+        }
+        commandSource->interruptOccurred(NULL, NULL, 0);
+        return kIOReturnSuccess;
+    }
+    start = mach_absolute_time();
+    ret = handler(this, interface, data);
+    fIoctlStats.record(request_number, isGet, ret, mach_absolute_time() - start);
+    return ret;
+}
+
+void BCMWLANFirmware_Hashstore::
+commandAction(IOInterruptEventSource *sender, int count)
+{
+    const struct ItlIoctlEntry *entry;
+    struct ItlCommand *cmd;
+    uint64_t start;
+    IOReturn ret;
+
+    while ((cmd = fCommands.dequeue()) != NULL) {
+        entry = &ioctlTable.entries[cmd->request];
+        start = mach_absolute_time();
+        ret = entry->set(this, cmd->object, cmd->data);
+        fIoctlStats.record(cmd->request, false, ret, mach_absolute_time() - start);
+        if (ret != kIOReturnSuccess) {
+            XYLog("%s queued IOCTL %s (%d) failed, ret=%d\n", __FUNCTION__, entry->name, cmd->request, ret);
+        } else if (entry->done) {
+            queueMessage(entry->done);
+        }
+        ItlCommandQueue::release(cmd);
+    }
+}
@@ -7,197 +7,18 @@
 //
 
 #include "BCMWLANFirmware_Hashstore.hpp"
+#include "HAL/ItlPhyRate.hpp"
 #include <sys/_netstat.h>
 
 extern IOCommandGate *_fCommandGate;
 
-const char* hexdump(uint8_t *buf, size_t len);
 
 SInt32 BCMWLANFirmware_Hashstore::apple80211Request(unsigned int request_type,
                                        int request_number,
                                        IO80211Interface *interface,
                                        void *data)
 {
-    if (request_type != SIOCGA80211 && request_type != SIOCSA80211) {
-        return kIOReturnError;
-    }
-    IOReturn ret = kIOReturnError;
-    
-    switch (request_number) {
-        case APPLE80211_IOC_SSID:  // 1
-            IOCTL(request_type, SSID, apple80211_ssid_data);
-            break;
-        case APPLE80211_IOC_AUTH_TYPE:  // 2
-            IOCTL(request_type, AUTH_TYPE, apple80211_authtype_data);
-            break;
-        case APPLE80211_IOC_CHANNEL:  // 4
-            IOCTL(request_type, CHANNEL, apple80211_channel_data);
-            break;
-        case APPLE80211_IOC_PROTMODE:
-            IOCTL(request_type, PROTMODE, apple80211_protmode_data);
-            break;
-        case APPLE80211_IOC_TXPOWER:  // 7
-            IOCTL_GET(request_type, TXPOWER, apple80211_txpower_data);
-            break;
-        case APPLE80211_IOC_RATE:  // 8
-            IOCTL_GET(request_type, RATE, apple80211_rate_data);
-            break;
-        case APPLE80211_IOC_BSSID:  // 9
-            IOCTL(request_type, BSSID, apple80211_bssid_data);
-            break;
-        case APPLE80211_IOC_SCAN_REQ:  // 10
-            IOCTL_SET(request_type, SCAN_REQ, apple80211_scan_data);
-            break;
-        case APPLE80211_IOC_SCAN_REQ_MULTIPLE:
-            IOCTL_SET(request_type, SCAN_REQ_MULTIPLE, apple80211_scan_multiple_data);
-            break;
-        case APPLE80211_IOC_SCAN_RESULT:  // 11
-            IOCTL_GET(request_type, SCAN_RESULT, apple80211_scan_result*);
-            break;
-        case APPLE80211_IOC_CARD_CAPABILITIES:  // 12
-            IOCTL_GET(request_type, CARD_CAPABILITIES, apple80211_capability_data);
-            break;
-        case APPLE80211_IOC_STATE:  // 13
-            IOCTL_GET(request_type, STATE, apple80211_state_data);
-            break;
-        case APPLE80211_IOC_PHY_MODE:  // 14
-            IOCTL_GET(request_type, PHY_MODE, apple80211_phymode_data);
-            break;
-        case APPLE80211_IOC_OP_MODE:  // 15
-            IOCTL_GET(request_type, OP_MODE, apple80211_opmode_data);
-            break;
-        case APPLE80211_IOC_RSSI:  // 16
-            IOCTL_GET(request_type, RSSI, apple80211_rssi_data);
-            break;
-        case APPLE80211_IOC_NOISE:  // 17
-            IOCTL_GET(request_type, NOISE, apple80211_noise_data);
-            break;
-        case APPLE80211_IOC_INT_MIT:  // 18
-            IOCTL_GET(request_type, INT_MIT, apple80211_intmit_data);
-            break;
-        case APPLE80211_IOC_POWER:  // 19
-            IOCTL(request_type, POWER, apple80211_power_data);
-            break;
-        case APPLE80211_IOC_ASSOCIATE:  // 20
-            IOCTL_SET(request_type, ASSOCIATE, apple80211_assoc_data);
-            break;
-        case APPLE80211_IOC_ASSOCIATE_RESULT: // 21
-            IOCTL_GET(request_type, ASSOCIATE_RESULT, apple80211_assoc_result_data);
-            break;
-        case APPLE80211_IOC_DISASSOCIATE: // 22
-            if (request_type == SIOCSA80211)
-                setDISASSOCIATE(interface);
-            break;
-        case APPLE80211_IOC_RATE_SET:
-            IOCTL_GET(request_type, RATE_SET, apple80211_rate_set_data);
-            break;
-        case APPLE80211_IOC_MCS_INDEX_SET:
-            IOCTL_GET(request_type, MCS_INDEX_SET, apple80211_mcs_index_set_data);
-            break;
-        case APPLE80211_IOC_VHT_MCS_INDEX_SET:
-            IOCTL_GET(request_type, VHT_MCS_INDEX_SET, apple80211_vht_mcs_index_set_data);
-            break;
-        case APPLE80211_IOC_MCS_VHT:
-            IOCTL(request_type, MCS_VHT, apple80211_mcs_vht_data);
-            break;
-        case APPLE80211_IOC_SUPPORTED_CHANNELS:  // 27
-        case APPLE80211_IOC_HW_SUPPORTED_CHANNELS:
-            IOCTL_GET(request_type, SUPPORTED_CHANNELS, apple80211_sup_channel_data);
-            break;
-        case APPLE80211_IOC_LOCALE:  // 28
-            IOCTL_GET(request_type, LOCALE, apple80211_locale_data);
-            break;
-        case APPLE80211_IOC_DEAUTH:
-            IOCTL(request_type, DEAUTH, apple80211_deauth_data);
-            break;
-        case APPLE80211_IOC_TX_ANTENNA:  // 37
-            IOCTL_GET(request_type, TX_ANTENNA, apple80211_antenna_data);
-            break;
-        case APPLE80211_IOC_ANTENNA_DIVERSITY:  // 39
-            IOCTL_GET(request_type, ANTENNA_DIVERSITY, apple80211_antenna_data);
-            break;
-        case APPLE80211_IOC_DRIVER_VERSION:  // 43
-            IOCTL_GET(request_type, DRIVER_VERSION, apple80211_version_data);
-            break;
-        case APPLE80211_IOC_HARDWARE_VERSION:  // 44
-            IOCTL_GET(request_type, HARDWARE_VERSION, apple80211_version_data);
-            break;
-        case APPLE80211_IOC_RSN_IE: // 46
-            IOCTL(request_type, RSN_IE, apple80211_rsn_ie_data);
-            break;
-        case APPLE80211_IOC_AP_IE_LIST: // 48
-            IOCTL_GET(request_type, AP_IE_LIST, apple80211_ap_ie_data);
-            break;
-        case APPLE80211_IOC_ASSOCIATION_STATUS:  // 50
-            IOCTL_GET(request_type, ASSOCIATION_STATUS, apple80211_assoc_status_data);
-            break;
-        case APPLE80211_IOC_COUNTRY_CODE:  // 51
-            IOCTL_GET(request_type, COUNTRY_CODE, apple80211_country_code_data);
-            break;
-        case APPLE80211_IOC_RADIO_INFO:
-            IOCTL_GET(request_type, RADIO_INFO, apple80211_radio_info_data);
-            break;
-        case APPLE80211_IOC_MCS:  // 57
-            IOCTL_GET(request_type, MCS, apple80211_mcs_data);
-            break;
-        case APPLE80211_IOC_VIRTUAL_IF_CREATE: // 94
-            IOCTL_SET(request_type, VIRTUAL_IF_CREATE, apple80211_virt_if_create_data);
-            break;
-        case APPLE80211_IOC_VIRTUAL_IF_DELETE:
-            IOCTL_SET(request_type, VIRTUAL_IF_DELETE, apple80211_virt_if_delete_data);
-            break;
-        case APPLE80211_IOC_ROAM_THRESH:
-            IOCTL_GET(request_type, ROAM_THRESH, apple80211_roam_threshold_data);
-            break;
-        case APPLE80211_IOC_LINK_CHANGED_EVENT_DATA:
-            IOCTL_GET(request_type, LINK_CHANGED_EVENT_DATA, apple80211_link_changed_event_data);
-            break;
-        case APPLE80211_IOC_POWERSAVE:
-            IOCTL_GET(request_type, POWERSAVE, apple80211_powersave_data);
-            break;
-        case APPLE80211_IOC_CIPHER_KEY:
-            IOCTL_SET(request_type, CIPHER_KEY, apple80211_key);
-            break;
-        case APPLE80211_IOC_SCANCACHE_CLEAR:
-            IOCTL_SET(request_type, SCANCACHE_CLEAR, apple80211req);
-            break;
-        case APPLE80211_IOC_TX_NSS:
-            IOCTL(request_type, TX_NSS, apple80211_tx_nss_data);
-            break;
-        case APPLE80211_IOC_NSS:
-            IOCTL_GET(request_type, NSS, apple80211_nss_data);
-            break;
-        case APPLE80211_IOC_ROAM:
-            IOCTL_SET(request_type, ROAM, apple80211_sta_roam_data);
-            break;
-        case APPLE80211_IOC_ROAM_PROFILE:
-            IOCTL(request_type, ROAM_PROFILE, apple80211_roam_profile_band_data);
-            break;
-        case APPLE80211_IOC_WOW_PARAMETERS:
-            IOCTL(request_type, WOW_PARAMETERS, apple80211_wow_parameter_data);
-            break;
-        case APPLE80211_IOC_IE:
-            IOCTL(request_type, IE, apple80211_ie_data);
-            break;
-        case APPLE80211_IOC_P2P_LISTEN:
-            IOCTL_SET(request_type, P2P_LISTEN, apple80211_p2p_listen_data);
-            break;
-        case APPLE80211_IOC_P2P_SCAN:
-            IOCTL_SET(request_type, P2P_SCAN, apple80211_scan_data);
-            break;
-        case APPLE80211_IOC_P2P_GO_CONF:
-            IOCTL_SET(request_type, P2P_GO_CONF, apple80211_p2p_go_conf_data);
-            break;
-        default:
-        unhandled:
-            if (!ml_at_interrupt_context()) {
-                XYLog("%s Unhandled IOCTL %s (%d) %s\n", __FUNCTION__, IOCTL_NAMES[request_number >= ARRAY_SIZE(IOCTL_NAMES) ? 0: request_number],
-                      request_number, request_type == SIOCGA80211 ? "get" : (request_type == SIOCSA80211 ? "set" : "other"));
-            }
-            break;
-    }
-    
-    return ret;
+    return dispatchIoctl(request_type, request_number, interface, data, false);
 }
 
 IOReturn BCMWLANFirmware_Hashstore::
@@ -238,30 +59,69 @@ setAUTH_TYPE(OSObject *object, struct apple80211_authtype_data *ad)
     return kIOReturnSuccess;
 }
 
+/*
+ * PMK carries the PMK of a finished 802.1X authentication, PMKSA the PMKID
+ * the supplicant caches for key_ea; an empty PMKSA drops the entry, or
+ * all of them when no BSSID is given.
+ */
+void BCMWLANFirmware_Hashstore::
+setPMKSA(struct apple80211_key *key)
+{
+    struct ieee80211com *ic = fHalService->get80211Controller();
+    static const uint8_t zero[APPLE80211_ADDR_LEN] = {};
+    const uint8_t *bssid = key->key_ea.octet;
+    const uint8_t *essid = NULL;
+    uint8_t esslen = 0;
+
+    if (memcmp(bssid, zero, APPLE80211_ADDR_LEN) == 0) {
+        bssid = ic->ic_bss ? ic->ic_bss->ni_bssid : NULL;
+    }
+    if (ic->ic_bss && ic->ic_bss->ni_esslen) {
+        essid = ic->ic_bss->ni_essid;
+        esslen = ic->ic_bss->ni_esslen;
+    } else {
+        essid = ic->ic_des_essid;
+        esslen = ic->ic_des_esslen;
+    }
+    if (key->key_cipher_type == APPLE80211_CIPHER_PMKSA && key->key_len == 0) {
+        if (memcmp(key->key_ea.octet, zero, APPLE80211_ADDR_LEN) == 0) {
+            fPmksa.flush();
+        } else {
+            fPmksa.remove(key->key_ea.octet);
+        }
+        return;
+    }
+    if (bssid == NULL) {
+        XYLog("%s no BSSID for the PMK, dropped\n", __FUNCTION__);
+        return;
+    }
+    if (key->key_cipher_type == APPLE80211_CIPHER_PMK) {
+        fPmksa.addPmk(bssid, essid, esslen, key->key, min(key->key_len, APPLE80211_KEY_BUFF_LEN), nowMS());
+    } else if (key->key_len == kItlPmkidLen) {
+        fPmksa.addPmkid(bssid, essid, esslen, key->key, nowMS());
+    } else {
+        XYLog("%s unexpected PMKID length %d\n", __FUNCTION__, key->key_len);
+    }
+}
+
 IOReturn BCMWLANFirmware_Hashstore::
 setCIPHER_KEY(OSObject *object, struct apple80211_key *key)
 {
-    XYLog("%s", __FUNCTION__);
-    const char* keydump = hexdump(key->key, key->key_len);
-    const char* rscdump = hexdump(key->key_rsc, key->key_rsc_len);
-    const char* eadump = hexdump(key->key_ea.octet, APPLE80211_ADDR_LEN);
     static_assert(__offsetof(struct apple80211_key, key_ea) == 92, "struct corrupted");
     static_assert(__offsetof(struct apple80211_key, key_rsc_len) == 80, "struct corrupted");
     static_assert(__offsetof(struct apple80211_key, wowl_kck_len) == 100, "struct corrupted");
     static_assert(__offsetof(struct apple80211_key, wowl_kek_len) == 120, "struct corrupted");
     static_assert(__offsetof(struct apple80211_key, wowl_kck_key) == 104, "struct corrupted");
-    if (keydump && rscdump && eadump)
-        XYLog("Set key request: len=%d cipher_type=%d flags=%d index=%d key=%s rsc_len=%d rsc=%s ea=%s\n",
-              key->key_len, key->key_cipher_type, key->key_flags, key->key_index, keydump, key->key_rsc_len, rscdump, eadump);
-    else
-        XYLog("Set key request, but failed to allocate memory for hexdump\n");
-    
-    if (keydump)
-        IOFree((void*)keydump, 3 * key->key_len + 1);
-    if (rscdump)
-        IOFree((void*)rscdump, 3 * key->key_rsc_len + 1);
-    if (eadump)
-        IOFree((void*)eadump, 3 * APPLE80211_ADDR_LEN + 1);
+    if (itlwm_debug_flags & APPLE80211_DEBUG_FLAG_RSN) {
+        char rscdump[APPLE80211_RSC_LEN * 3 + 4];
+        char eadump[APPLE80211_ADDR_LEN * 3 + 4];
+        XYLog("%s\n", __FUNCTION__);
+        // never the key itself, the log outlives the association
+        XYLog("Set key request: len=%d cipher_type=%d flags=%d index=%d rsc_len=%d rsc=%s ea=%s\n",
+              key->key_len, key->key_cipher_type, key->key_flags, key->key_index, key->key_rsc_len,
+              hexdump(rscdump, sizeof(rscdump), key->key_rsc, min(key->key_rsc_len, APPLE80211_RSC_LEN)),
+              hexdump(eadump, sizeof(eadump), key->key_ea.octet, APPLE80211_ADDR_LEN));
+    }
     
     switch (key->key_cipher_type) {
         case APPLE80211_CIPHER_NONE:
@@ -278,6 +138,8 @@ setCIPHER_KEY(OSObject *object, struct apple80211_key *key)
             switch (key->key_flags) {
                 case 4: // PTK
                     setPTK(key->key, key->key_len);
+                    // GTK rekey offload while suspended, see armWowlan()
+                    fWowlan.setRekeyKeys(key->wowl_kck_key, key->wowl_kck_len, key->wowl_kek_key, key->wowl_kek_len);
                     getNetworkInterface()->postMessage(APPLE80211_M_RSN_HANDSHAKE_DONE);
                     break;
                 case 0: // GTK
@@ -287,10 +149,8 @@ setCIPHER_KEY(OSObject *object, struct apple80211_key *key)
             }
             break;
         case APPLE80211_CIPHER_PMK:
-            XYLog("Setting WPA PMK is not supported\n");
-            break;
         case APPLE80211_CIPHER_PMKSA:
-            XYLog("Setting WPA PMKSA is not supported\n");
+            setPMKSA(key);
             break;
     }
     //fInterface->postMessage(APPLE80211_M_CIPHER_KEY_CHANGED);
@@ -356,13 +216,13 @@ IOReturn BCMWLANFirmware_Hashstore::
 getCHANNEL(OSObject *object,
                            struct apple80211_channel_data *cd)
 {
-    struct ieee80211com * ic = fHalService->get80211Controller();
-    if (ic->ic_state == IEEE80211_S_RUN) {
+    struct ItlStaInfo info;
+    if (fHalService->getStaInfo(&info)) {
         memset(cd, 0, sizeof(apple80211_channel_data));
         cd->version = APPLE80211_VERSION;
         cd->channel.version = APPLE80211_VERSION;
-        cd->channel.channel = ieee80211_chan2ieee(ic, ic->ic_bss->ni_chan);
-        cd->channel.flags = ieeeChanFlag2apple(ic->ic_bss->ni_chan->ic_flags, ic->ic_bss->ni_chw);
+        cd->channel.channel = info.channel;
+        cd->channel.flags = ieeeChanFlag2apple(info.chanFlags, info.chw);
         return kIOReturnSuccess;
     }
     return kIOReturnError;
@@ -445,69 +305,209 @@ setTX_NSS(OSObject *object, struct apple80211_tx_nss_data *data)
     return kIOReturnError;
 }
 
+/*
+ * Reassociate straight to a node of the scan cache. The cached node already
+ * has everything the join needs, so the scan is skipped; the PSK derived
+ * PMK stays in ic_psk and only the 4-way handshake runs again.
+ */
+void BCMWLANFirmware_Hashstore::
+roamTo(struct ieee80211_node *ni)
+{
+    roamStats.attempts++;
+    roamStart = mach_absolute_time();
+    fRoam.roamed();
+    applyPmksa(ni);
+    ieee80211_node_join_bss(fHalService->get80211Controller(), ni);
+}
+
+/*
+ * True while a roam started less than kItlRoamTimeoutMS ago, with the time
+ * since it started. An older one got no link up and failed; it is counted
+ * and forgotten so it neither blocks roamTick() nor claims the next,
+ * unrelated association.
+ */
+bool BCMWLANFirmware_Hashstore::
+roamPending(uint64_t *elapsedMS)
+{
+    uint64_t ns;
+    
+    *elapsedMS = 0;
+    if (roamStart == 0) {
+        return false;
+    }
+    absolutetime_to_nanoseconds(mach_absolute_time() - roamStart, &ns);
+    *elapsedMS = ns / 1000000;
+    if (*elapsedMS < kItlRoamTimeoutMS) {
+        return true;
+    }
+    XYLog("%s no link up %llu ms after the roam, giving up\n", __FUNCTION__, *elapsedMS);
+    roamStart = 0;
+    roamStats.failures++;
+    return false;
+}
+
+/*
+ * Put the PMKID of the target into the RSN IE of the reassociation request
+ * so an 802.1X network resumes the cached PMKSA instead of running EAP
+ * again. Without an entry for the BSSID, a PMK of the same ESS gives the
+ * PMKID the target derives under opportunistic key caching.
+ */
+void BCMWLANFirmware_Hashstore::
+applyPmksa(struct ieee80211_node *ni)
+{
+#ifdef USE_APPLE_SUPPLICANT
+    struct ieee80211com *ic = fHalService->get80211Controller();
+    const struct ItlPmksa *e;
+    const uint8_t *pmkid = NULL;
+    uint8_t derived[kItlPmkidLen];
+    uint8_t pmk[kItlPmkMaxLen];
+    uint32_t pmkLen;
+    uint64_t now = nowMS();
+
+    if (ic->ic_rsn_ie_override[1] == 0) {
+        return;
+    }
+    if ((e = fPmksa.lookup(ni->ni_bssid, now)) != NULL) {
+        pmkid = e->pmkid;
+    } else if ((ni->ni_rsnakms & (IEEE80211_AKM_8021X | IEEE80211_AKM_SHA256_8021X)) &&
+               (e = fPmksa.lookupEss(ni->ni_essid, ni->ni_esslen, now)) != NULL) {
+        // the entry may be the one recycled for the target, copy it first
+        pmkLen = e->pmkLen;
+        memcpy(pmk, e->pmk, pmkLen);
+        ieee80211_derive_pmkid((ni->ni_rsnakms & IEEE80211_AKM_SHA256_8021X) ? IEEE80211_AKM_SHA256_8021X : IEEE80211_AKM_8021X,
+                               pmk, ni->ni_bssid, ic->ic_myaddr, derived);
+        fPmksa.addPmk(ni->ni_bssid, ni->ni_essid, ni->ni_esslen, pmk, pmkLen, now);
+        fPmksa.addPmkid(ni->ni_bssid, ni->ni_essid, ni->ni_esslen, derived, now);
+        fPmksa.countDerived();
+        bzero(pmk, sizeof(pmk));
+        pmkid = derived;
+    }
+    // a PMKID of the previous AP must not go out either
+    if (!ItlPmksaCache::setRsnPmkid(ic->ic_rsn_ie_override, sizeof(ic->ic_rsn_ie_override), pmkid)) {
+        XYLog("%s can not rewrite the RSN IE for %s\n", __FUNCTION__, ether_sprintf(ni->ni_bssid));
+    }
+#endif
+}
+
+static bool
+isSameEss(struct ieee80211_node *a, struct ieee80211_node *b)
+{
+    return a->ni_esslen == b->ni_esslen && memcmp(a->ni_essid, b->ni_essid, a->ni_esslen) == 0;
+}
+
+/*
+ * Neighbour RSSI only changes when a scan hears the BSS again, so the
+ * neighbours are sampled once per scan rather than every tick. A node
+ * whose rx stamp and RSSI did not move was not heard by this scan and
+ * keeps its old sample; roamTick() leaves it out of the candidates.
+ */
+void BCMWLANFirmware_Hashstore::
+roamScanDone()
+{
+    struct ieee80211com *ic = fHalService->get80211Controller();
+    struct ieee80211_node *bss = ic->ic_bss;
+    struct ieee80211_node *ni;
+    uint64_t now;
+    
+    if (ic->ic_state != IEEE80211_S_RUN || bss == NULL) {
+        return;
+    }
+    now = nowMS();
+    fRoam.scanDone(now);
+    RB_FOREACH(ni, ieee80211_tree, &ic->ic_tree) {
+        if (ni == bss || ni->ni_chan == NULL || IEEE80211_ADDR_EQ(ni->ni_macaddr, bss->ni_macaddr) || !isSameEss(ni, bss)) {
+            continue;
+        }
+        fRoam.sampleScan(ni->ni_macaddr, IWM_MIN_DBM + ni->ni_rssi, ni->ni_rstamp ^ ((uint32_t)ni->ni_rssi << 24), now);
+    }
+}
+
+/*
+ * Runs every housekeeping roam tick behind the command gate. Keeps the smoothed
+ * RSSI of the current BSS up to date, scans in the background while it is
+ * under the profile trigger and moves over once a neighbour heard in the
+ * last scan is better by the profile delta.
+ */
+void BCMWLANFirmware_Hashstore::
+roamTick()
+{
+    struct ieee80211com *ic = fHalService->get80211Controller();
+    struct ieee80211_node *bss = ic->ic_bss;
+    struct ieee80211_node *ni;
+    struct ieee80211_node *best = NULL;
+    uint64_t roamMS;
+    uint64_t now;
+    bool scan;
+    int current;
+    int rssi;
+    int score;
+    int bestScore = INT_MIN;
+    
+    if (ic->ic_state != IEEE80211_S_RUN || bss == NULL || roamPending(&roamMS)) {
+        return;
+    }
+    now = nowMS();
+    current = fRoam.sample(bss->ni_macaddr, IWM_MIN_DBM + bss->ni_rssi, now);
+    scan = fRoam.scanDue(current, now);
+    RB_FOREACH(ni, ieee80211_tree, &ic->ic_tree) {
+        if (ni == bss || ni->ni_chan == NULL || IEEE80211_ADDR_EQ(ni->ni_macaddr, bss->ni_macaddr) || !isSameEss(ni, bss)) {
+            continue;
+        }
+        if (!fRoam.candidate(ni->ni_macaddr, &rssi)) {
+            continue;
+        }
+        score = fRoam.score(rssi, IEEE80211_IS_CHAN_5GHZ(ni->ni_chan));
+        if (score > bestScore) {
+            bestScore = score;
+            best = ni;
+        }
+    }
+    if (best && fRoam.shouldRoam(current, bestScore)) {
+        XYLog("%s %s at %d dBm, roaming to %s (score %d)\n", __FUNCTION__, ether_sprintf(bss->ni_bssid), current, ether_sprintf(best->ni_bssid), bestScore);
+        roamTo(best);
+        return;
+    }
+    if (scan && !(ic->ic_flags & (IEEE80211_F_BGSCAN | IEEE80211_F_ASCAN))) {
+        roamStats.scans++;
+        ieee80211_begin_cache_bgscan(&ic->ic_ac.ac_if);
+    }
+}
+
 IOReturn BCMWLANFirmware_Hashstore::
 setROAM(OSObject *object, struct apple80211_sta_roam_data *data)
 {
+    struct ieee80211com *ic = fHalService->get80211Controller();
+    struct ieee80211_node *ni;
+    
     XYLog("%s rcc_channels=%d unk=%d target_channel=%d target_bssid=%s\n", __FUNCTION__, data->rcc_channels, data->unk1, data->taget_channel, ether_sprintf(data->target_bssid));
-    return kIOReturnError;
+    if (ic->ic_state != IEEE80211_S_RUN || ic->ic_bss == NULL) {
+        return kIOReturnNotReady;
+    }
+    if (IEEE80211_ADDR_EQ(ic->ic_bss->ni_bssid, data->target_bssid)) {
+        return kIOReturnSuccess;
+    }
+    ni = ieee80211_find_node(ic, data->target_bssid);
+    if (ni == NULL || ni->ni_chan == NULL ||
+        (data->taget_channel != 0 && ieee80211_chan2ieee(ic, ni->ni_chan) != data->taget_channel) ||
+        !isSameEss(ni, ic->ic_bss)) {
+        // the regular disassociate/scan/associate path still gets there
+        XYLog("%s target %s is not in the scan cache\n", __FUNCTION__, ether_sprintf(data->target_bssid));
+        roamStats.misses++;
+        return kIOReturnError;
+    }
+    roamTo(ni);
+    return kIOReturnSuccess;
 }
 
 IOReturn BCMWLANFirmware_Hashstore::
 getRATE(OSObject *object, struct apple80211_rate_data *rd)
 {
-    struct ieee80211com *ic = fHalService->get80211Controller();
-    if (ic->ic_bss == NULL) {
-        return kIOReturnError;
-    }
-    int nss;
-    int sgi;
-    int index = 0;
-    if (ic->ic_state == IEEE80211_S_RUN) {
+    struct ItlStaInfo info;
+    if (fHalService->getStaInfo(&info)) {
         memset(rd, 0, sizeof(*rd));
         rd->version = APPLE80211_VERSION;
         rd->num_radios = 1;
-        if (ic->ic_curmode == IEEE80211_MODE_11AC) {
-            sgi = (ieee80211_node_supports_vht_sgi80(ic->ic_bss) || ieee80211_node_supports_vht_sgi160(ic->ic_bss));
-            if (sgi) {
-                index += 1;
-            }
-            nss = fHalService->getDriverInfo()->getTxNSS();
-            switch (ic->ic_bss->ni_chw) {
-                case IEEE80211_CHAN_WIDTH_40:
-                    index += 4;
-                    break;
-                case IEEE80211_CHAN_WIDTH_80:
-                    index += 8;
-                    break;
-                case IEEE80211_CHAN_WIDTH_80P80:
-                case IEEE80211_CHAN_WIDTH_160:
-                    index += 12;
-                    break;
-
-                case IEEE80211_CHAN_WIDTH_20_NOHT:
-                case IEEE80211_CHAN_WIDTH_20:    
-                default:
-                    break;
-            }
-            index += 2 * (nss - 1);
-            const struct ieee80211_vht_rateset *rs = &ieee80211_std_ratesets_11ac[index];
-            rd->rate[0] = rs->rates[ic->ic_bss->ni_txmcs % rs->nrates] / 2;
-        } else if (ic->ic_curmode == IEEE80211_MODE_11N) {
-            int is_40mhz = ic->ic_bss->ni_chw == IEEE80211_CHAN_WIDTH_40;
-            sgi = ((!is_40mhz && ieee80211_node_supports_ht_sgi20(ic->ic_bss)) || (is_40mhz && ieee80211_node_supports_ht_sgi40(ic->ic_bss)));
-            if (sgi) {
-                index += 1;
-            }
-            if (is_40mhz) {
-                index += (IEEE80211_HT_RATESET_MIMO4_SGI + 1);
-            }
-            index += (ic->ic_bss->ni_txmcs / 16);
-            nss = ic->ic_bss->ni_txmcs / 8 + 1;
-            index += 2 * (nss - 1);
-            rd->rate[0] = ieee80211_std_ratesets_11n[index].rates[ic->ic_bss->ni_txmcs % 8] / 2;
-        } else {
-            rd->rate[0] = ic->ic_bss->ni_rates.rs_rates[ic->ic_bss->ni_txrate];
-        }
+        rd->rate[0] = itlPhyRateMbps(info.txRate);
         return kIOReturnSuccess;
     }
     return kIOReturnError;
@@ -516,11 +516,10 @@ getRATE(OSObject *object, struct apple80211_rate_data *rd)
 IOReturn BCMWLANFirmware_Hashstore::
 getROAM_PROFILE(OSObject *object, struct apple80211_roam_profile_band_data *data)
 {
-    if (roamProfile == NULL) {
+    if (!fRoam.getProfile(data)) {
         XYLog("%s no roam profile, return error\n", __FUNCTION__);
         return kIOReturnError;
     }
-    memcpy(data, roamProfile, sizeof(struct apple80211_roam_profile_band_data));
     return kIOReturnSuccess;
 }
 
@@ -528,24 +527,23 @@ IOReturn BCMWLANFirmware_Hashstore::
 setROAM_PROFILE(OSObject *object, struct apple80211_roam_profile_band_data *data)
 {
     XYLog("%s cnt=%d flags=%d\n", __FUNCTION__, data->profile_cnt, data->flags);
-    if (roamProfile != NULL) {
-        IOFree(roamProfile, sizeof(struct apple80211_roam_profile_band_data));
-    }
-    roamProfile = (uint8_t *)IOMalloc(sizeof(struct apple80211_roam_profile_band_data));
+    fRoam.setProfile(data);
     return kIOReturnSuccess;
 }
 
 IOReturn BCMWLANFirmware_Hashstore::
 getWOW_PARAMETERS(OSObject *object, struct apple80211_wow_parameter_data *data)
 {
-    return kIOReturnError;
+    data->version = APPLE80211_VERSION;
+    fWowlan.getParameters(data);
+    return kIOReturnSuccess;
 }
 
 IOReturn BCMWLANFirmware_Hashstore::
 setWOW_PARAMETERS(OSObject *object, struct apple80211_wow_parameter_data *data)
 {
-    XYLog("%s pattern_count=%d\n", __FUNCTION__, data->pattern_count);
-    return kIOReturnError;
+    XYLog("%s pattern_count=%d beacon_loss_time=%d\n", __FUNCTION__, data->pattern_count, data->beacon_loss_time);
+    return fWowlan.setParameters(data);
 }
 
 IOReturn BCMWLANFirmware_Hashstore::
@@ -656,31 +654,16 @@ getVHT_MCS_INDEX_SET(OSObject *object, struct apple80211_vht_mcs_index_set_data
 IOReturn BCMWLANFirmware_Hashstore::
 getMCS_VHT(OSObject *object, struct apple80211_mcs_vht_data *data)
 {
-    struct ieee80211com *ic = fHalService->get80211Controller();
-    if (ic->ic_bss == NULL || ic->ic_curmode < IEEE80211_MODE_11AC) {
+    struct ItlStaInfo info;
+    if (!fHalService->getStaInfo(&info) || info.mode < IEEE80211_MODE_11AC) {
         return kIOReturnError;
     }
     memset(data, 0, sizeof(struct apple80211_mcs_vht_data));
     data->version = APPLE80211_VERSION;
-    data->guard_interval = (ieee80211_node_supports_vht_sgi80(ic->ic_bss) || ieee80211_node_supports_vht_sgi160(ic->ic_bss)) ? 400 : 800;
-    data->index = ic->ic_bss->ni_txmcs;
-    data->nss = fHalService->getDriverInfo()->getTxNSS();
-    switch (ic->ic_bss->ni_chw) {
-        case IEEE80211_CHAN_WIDTH_40:
-            data->bw = 40;
-            break;
-        case IEEE80211_CHAN_WIDTH_80:
-            data->bw = 80;
-            break;
-        case IEEE80211_CHAN_WIDTH_80P80:
-        case IEEE80211_CHAN_WIDTH_160:
-            data->bw = 160;
-            break;
-            
-        default:
-            data->bw = 20;
-            break;
-    }
+    data->guard_interval = info.sgi ? 400 : 800;
+    data->index = info.mcs;
+    data->nss = info.nss;
+    data->bw = info.bandwidth;
     return kIOReturnSuccess;
 }
 
@@ -775,15 +758,15 @@ IOReturn BCMWLANFirmware_Hashstore::
 getRSSI(OSObject *object,
                         struct apple80211_rssi_data *rd)
 {
-    struct ieee80211com *ic = fHalService->get80211Controller();
-    if (ic->ic_state == IEEE80211_S_RUN) {
+    struct ItlStaInfo info;
+    if (fHalService->getStaInfo(&info)) {
         memset(rd, 0, sizeof(*rd));
         rd->num_radios = 1;
         rd->rssi_unit = APPLE80211_UNIT_DBM;
         rd->rssi[0] = rd->aggregate_rssi
         = rd->rssi_ext[0]
         = rd->aggregate_rssi_ext
-        = -(0 - IWM_MIN_DBM - ic->ic_bss->ni_rssi);
+        = info.rssi;
         return kIOReturnSuccess;
     }
     return kIOReturnError;
@@ -864,8 +847,42 @@ getNOISE(OSObject *object,
 IOReturn BCMWLANFirmware_Hashstore::
 getINT_MIT(OSObject *object, struct apple80211_intmit_data *imd)
 {
+    struct ItlIntrModParams params;
+    
+    fHalService->getInterruptModeration(&params);
     imd->version = APPLE80211_VERSION;
-    imd->int_mit = APPLE80211_INT_MIT_AUTO;
+    imd->int_mit = params.mode == kItlIntrModOff ? APPLE80211_INT_MIT_OFF : APPLE80211_INT_MIT_AUTO;
+    return kIOReturnSuccess;
+}
+
+/* AUTO keeps the thresholds tuned through IOCTL_80211_INT_MODERATION. */
+IOReturn BCMWLANFirmware_Hashstore::
+setINT_MIT(OSObject *object, struct apple80211_intmit_data *imd)
+{
+    struct ItlIntrModParams params;
+    uint32_t mode;
+    
+    switch (imd->int_mit) {
+        case APPLE80211_INT_MIT_OFF:
+            mode = kItlIntrModOff;
+            break;
+        case APPLE80211_INT_MIT_AUTO:
+            mode = kItlIntrModAdaptive;
+            break;
+            
+        default:
+            return kIOReturnBadArgument;
+    }
+    if (!fHalService->getDriverInfo()->supportsInterruptModeration()) {
+        return kIOReturnUnsupported;
+    }
+    fHalService->getInterruptModeration(&params);
+    if (params.mode == mode) {
+        return kIOReturnSuccess;
+    }
+    params.mode = mode;
+    fHalService->setInterruptModeration(&params);
+    queueMessage(APPLE80211_M_INT_MIT_CHANGED);
     return kIOReturnSuccess;
 }
 
@@ -883,7 +900,21 @@ IOReturn BCMWLANFirmware_Hashstore::
 getPOWERSAVE(OSObject *object, struct apple80211_powersave_data *pd)
 {
     pd->version = APPLE80211_VERSION;
-    pd->powersave_level = APPLE80211_POWERSAVE_MODE_DISABLED;
+    pd->powersave_level = fPowerSave.getMode();
+    return kIOReturnSuccess;
+}
+
+IOReturn BCMWLANFirmware_Hashstore::
+setPOWERSAVE(OSObject *object, struct apple80211_powersave_data *pd)
+{
+    XYLog("%s powersave_level=%d\n", __FUNCTION__, pd->powersave_level);
+    if (!fPowerSave.setMode(pd->powersave_level)) {
+        return kIOReturnUnsupported;
+    }
+    // the housekeeping wheel talks to the firmware, not the ioctl path
+    if (currentStatus & kIONetworkLinkActive) {
+        getCommandGate()->runAction(kickPowerSaveGated);
+    }
     return kIOReturnSuccess;
 }
 
@@ -1067,10 +1098,11 @@ void BCMWLANFirmware_Hashstore::
 eventHandler(struct ieee80211com *ic, int msgCode, void *data)
 {
 #define INTERFACE_POST_MESSAGE(code) \
-    if (interface) { \
-        interface->postMessage(code); \
+    if (that) { \
+        that->queueMessage(code); \
     }
     IO80211Interface *interface = OSDynamicCast(IO80211Interface, ic->ic_ac.ac_if.iface);
+    BCMWLANFirmware_Hashstore *that = interface ? OSDynamicCast(BCMWLANFirmware_Hashstore, interface->getController()) : NULL;
     switch (msgCode) {
         case IEEE80211_EVT_COUNTRY_CODE_UPDATE:
             INTERFACE_POST_MESSAGE(APPLE80211_M_COUNTRY_CODE_CHANGED)
@@ -1081,11 +1113,14 @@ eventHandler(struct ieee80211com *ic, int msgCode, void *data)
         case IEEE80211_EVT_STA_DEAUTH:
             INTERFACE_POST_MESSAGE(APPLE80211_M_DEAUTH_RECEIVED)
             break;
-#if 0
         case IEEE80211_EVT_SCAN_DONE:
+            if (that) {
+                that->getCommandGate()->runAction(roamScanDoneGated);
+            }
+#if 0
             INTERFACE_POST_MESSAGE(APPLE80211_M_SCAN_DONE)
-            break;
 #endif
+            break;
         default:
             break;
     }
@@ -1161,8 +1196,9 @@ getMCS(OSObject *object, struct apple80211_mcs_data* md)
 IOReturn BCMWLANFirmware_Hashstore::
 getROAM_THRESH(OSObject *object, struct apple80211_roam_threshold_data* md)
 {
-    md->threshold = 100;
-    md->count = 0;
+    // trigger in dBm as a two's complement value
+    md->threshold = (u_int32_t)fRoam.getTrigger();
+    md->count = fRoam.getTriggerCount();
     return kIOReturnSuccess;
 }
 
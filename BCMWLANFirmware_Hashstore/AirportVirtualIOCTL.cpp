@@ -12,142 +12,7 @@
 SInt32 BCMWLANFirmware_Hashstore::
 apple80211VirtualRequest(UInt request_type, int request_number, IO80211VirtualInterface *interface, void *data)
 {
-    if (request_type != SIOCGA80211 && request_type != SIOCSA80211) {
-        return kIOReturnError;
-    }
-    IOReturn ret = kIOReturnError;
-    
-    switch (request_number) {
-        case APPLE80211_IOC_CARD_CAPABILITIES:
-            IOCTL_GET(request_type, CARD_CAPABILITIES, apple80211_capability_data);
-            break;
-        case APPLE80211_IOC_POWER:
-            IOCTL_GET(request_type, POWER, apple80211_power_data);
-            break;
-        case APPLE80211_IOC_SUPPORTED_CHANNELS:
-            IOCTL_GET(request_type, SUPPORTED_CHANNELS, apple80211_sup_channel_data);
-            break;
-        case APPLE80211_IOC_DRIVER_VERSION:
-            IOCTL_GET(request_type, DRIVER_VERSION, apple80211_version_data);
-            break;
-        case APPLE80211_IOC_OP_MODE:
-            IOCTL_GET(request_type, OP_MODE, apple80211_opmode_data);
-            break;
-        case APPLE80211_IOC_PHY_MODE:
-            IOCTL_GET(request_type, PHY_MODE, apple80211_phymode_data);
-            break;
-        case APPLE80211_IOC_RSSI:
-            IOCTL_GET(request_type, RSSI, apple80211_rssi_data);
-            break;
-        case APPLE80211_IOC_STATE:
-            IOCTL_GET(request_type, STATE, apple80211_state_data);
-            break;
-        case APPLE80211_IOC_BSSID:
-            IOCTL(request_type, BSSID, apple80211_bssid_data);
-            break;
-        case APPLE80211_IOC_RATE:
-            IOCTL_GET(request_type, RATE, apple80211_rate_data);
-            break;
-        case APPLE80211_IOC_CHANNEL:
-            IOCTL(request_type, CHANNEL, apple80211_channel_data);
-            break;
-        case APPLE80211_IOC_AUTH_TYPE:
-            IOCTL(request_type, AUTH_TYPE, apple80211_authtype_data);
-            break;
-        case APPLE80211_IOC_ROAM_PROFILE:
-            IOCTL(request_type, ROAM_PROFILE, apple80211_roam_profile_band_data);
-            break;
-        case APPLE80211_IOC_SSID:
-            IOCTL(request_type, SSID, apple80211_ssid_data);
-            break;
-        case APPLE80211_IOC_AWDL_PEER_TRAFFIC_REGISTRATION:
-            IOCTL(request_type, AWDL_PEER_TRAFFIC_REGISTRATION, apple80211_awdl_peer_traffic_registration);
-            break;
-        case APPLE80211_IOC_AWDL_SYNC_ENABLED:
-            IOCTL(request_type, SYNC_ENABLED, apple80211_awdl_sync_enabled);
-            break;
-        case APPLE80211_IOC_AWDL_SYNC_FRAME_TEMPLATE:
-            IOCTL(request_type, SYNC_FRAME_TEMPLATE, apple80211_awdl_sync_frame_template);
-            break;
-        case APPLE80211_IOC_HT_CAPABILITY:
-            IOCTL_GET(request_type, AWDL_HT_CAPABILITY, apple80211_ht_capability);
-            break;
-        case APPLE80211_IOC_VHT_CAPABILITY:
-            IOCTL_GET(request_type, AWDL_VHT_CAPABILITY, apple80211_vht_capability);
-            break;
-        case APPLE80211_IOC_AWDL_ELECTION_METRIC:
-            IOCTL(request_type, AWDL_ELECTION_METRIC, apple80211_awdl_election_metric);
-            break;
-        case APPLE80211_IOC_AWDL_BSSID:
-            IOCTL(request_type, AWDL_BSSID, apple80211_awdl_bssid);
-            break;
-//        case APPLE80211_IOC_CHANNELS_INFO:
-//            IOCTL_GET(request_type, CHANNELS_INFO, apple80211_channels_info);
-//            break;
-        case APPLE80211_IOC_PEER_CACHE_MAXIMUM_SIZE:
-            IOCTL(request_type, PEER_CACHE_MAXIMUM_SIZE, apple80211_peer_cache_maximum_size);
-            break;
-        case APPLE80211_IOC_AWDL_ELECTION_ID:
-            IOCTL(request_type, AWDL_ELECTION_ID, apple80211_awdl_election_id);            
-            break;
-        case APPLE80211_IOC_AWDL_MASTER_CHANNEL:
-            IOCTL(request_type, AWDL_MASTER_CHANNEL, apple80211_awdl_master_channel);
-            break;
-        case APPLE80211_IOC_AWDL_SECONDARY_MASTER_CHANNEL:
-            IOCTL(request_type, AWDL_SECONDARY_MASTER_CHANNEL, apple80211_awdl_secondary_master_channel);
-            break;
-        case APPLE80211_IOC_AWDL_MIN_RATE:
-            IOCTL(request_type, AWDL_MIN_RATE, apple80211_awdl_min_rate);
-            break;
-        case APPLE80211_IOC_AWDL_ELECTION_RSSI_THRESHOLDS:
-            IOCTL(request_type, AWDL_ELECTION_RSSI_THRESHOLDS, apple80211_awdl_election_rssi_thresholds);
-            break;
-        case APPLE80211_IOC_AWDL_SYNCHRONIZATION_CHANNEL_SEQUENCE:
-            IOCTL(request_type, AWDL_SYNCHRONIZATION_CHANNEL_SEQUENCE, apple80211_awdl_sync_channel_sequence);
-            break;
-        case APPLE80211_IOC_AWDL_PRESENCE_MODE:
-            IOCTL(request_type, AWDL_PRESENCE_MODE, apple80211_awdl_presence_mode);
-            break;
-        case APPLE80211_IOC_AWDL_EXTENSION_STATE_MACHINE_PARAMETERS:
-            IOCTL(request_type, AWDL_EXTENSION_STATE_MACHINE_PARAMETERS, apple80211_awdl_extension_state_machine_parameter);
-            break;
-        case APPLE80211_IOC_AWDL_SYNC_STATE:
-            IOCTL(request_type, AWDL_SYNC_STATE, apple80211_awdl_sync_state);
-            break;
-        case APPLE80211_IOC_AWDL_SYNC_PARAMS:
-            IOCTL(request_type, AWDL_SYNC_PARAMS, apple80211_awdl_sync_params);
-            break;
-        case APPLE80211_IOC_AWDL_CAPABILITIES:
-            IOCTL_GET(request_type, AWDL_CAPABILITIES, apple80211_awdl_cap);
-            break;
-        case APPLE80211_IOC_AWDL_AF_TX_MODE:
-            IOCTL(request_type, AWDL_AF_TX_MODE, apple80211_awdl_af_tx_mode);
-            break;
-        case APPLE80211_IOC_AWDL_OOB_AUTO_REQUEST:
-            IOCTL_SET(request_type, AWDL_OOB_AUTO_REQUEST, apple80211_awdl_oob_request);
-            break;
-        case APPLE80211_IOC_IE:
-            IOCTL(request_type, IE, apple80211_ie_data);
-            break;
-        case APPLE80211_IOC_P2P_LISTEN:
-            IOCTL_SET(request_type, P2P_LISTEN, apple80211_p2p_listen_data);
-            break;
-        case APPLE80211_IOC_P2P_SCAN:
-            IOCTL_SET(request_type, P2P_SCAN, apple80211_scan_data);
-            break;
-        case APPLE80211_IOC_P2P_GO_CONF:
-            IOCTL_SET(request_type, P2P_GO_CONF, apple80211_p2p_go_conf_data);
-            break;
-        default:
-        unhandled:
-            if (!ml_at_interrupt_context()) {
-                XYLog("%s Unhandled IOCTL %s (%d) %s\n", __FUNCTION__, IOCTL_NAMES[request_number >= ARRAY_SIZE(IOCTL_NAMES) ? 0: request_number],
-                      request_number, request_type == SIOCGA80211 ? "get" : (request_type == SIOCSA80211 ? "set" : "other"));
-            }
-            break;
-    }
-    
-    return ret;
+    return dispatchIoctl(request_type, request_number, interface, data, true);
 }
 
 IOReturn BCMWLANFirmware_Hashstore::
@@ -12,6 +12,9 @@
 * GNU General Public License for more details.
 */
 #include "BCMWLANFirmware_Hashstore.hpp"
+#include "HAL/ItlPciMsi.hpp"
+#include "HAL/ItlPhyRate.hpp"
+#include <IOKit/IOUserClient.h>
 
 #include <crypto/sha1.h>
 #include <net80211/ieee80211_priv.h>
@@ -29,37 +32,16 @@ bool BCMWLANFirmware_Hashstore::init(OSDictionary *properties)
     bool ret = super::init(properties);
     awdlSyncEnable = true;
     power_state = 0;
+    fIoctlStats.init();
+    fEvents.init();
+    fRoam.init();
+    uint32_t pmksaLifetimeS = kItlPmksaDefaultLifetimeS;
+    PE_parse_boot_argn("itlwm_pmksa_s", &pmksaLifetimeS, sizeof(pmksaLifetimeS));
+    fPmksa.init(pmksaLifetimeS);
+    fWowlan.init();
     return ret;
 }
 
-#define  PCI_MSI_FLAGS        2    /* Message Control */
-#define  PCI_CAP_ID_MSI        0x05    /* Message Signalled Interrupts */
-#define  PCI_MSIX_FLAGS        2    /* Message Control */
-#define  PCI_CAP_ID_MSIX    0x11    /* MSI-X */
-#define  PCI_MSIX_FLAGS_ENABLE    0x8000    /* MSI-X enable */
-#define  PCI_MSI_FLAGS_ENABLE    0x0001    /* MSI feature enabled */
-
-static void pciMsiSetEnable(IOPCIDevice *device, UInt8 msiCap, int enable)
-{
-    u16 control;
-    
-    control = device->configRead16(msiCap + PCI_MSI_FLAGS);
-    control &= ~PCI_MSI_FLAGS_ENABLE;
-    if (enable)
-        control |= PCI_MSI_FLAGS_ENABLE;
-    device->configWrite16(msiCap + PCI_MSI_FLAGS, control);
-}
-
-static void pciMsiXClearAndSet(IOPCIDevice *device, UInt8 msixCap, UInt16 clear, UInt16 set)
-{
-    u16 ctrl;
-    
-    ctrl = device->configRead16(msixCap + PCI_MSIX_FLAGS);
-    ctrl &= ~clear;
-    ctrl |= set;
-    device->configWrite16(msixCap + PCI_MSIX_FLAGS, ctrl);
-}
-
 IOService* BCMWLANFirmware_Hashstore::probe(IOService *provider, SInt32 *score)
 {
     bool isMatch = false;
@@ -84,10 +66,14 @@ IOService* BCMWLANFirmware_Hashstore::probe(IOService *provider, SInt32 *score)
     }
     if (isMatch) {
         device->findPCICapability(PCI_CAP_ID_MSIX, &msixCap);
+        device->findPCICapability(PCI_CAP_ID_MSI, &msiCap);
+        // IOPCIFamily enables MSI-X itself for drivers that steer vectors, see ItlHalService::attachMsixInterrupts()
+        if (msixCap && fHalService->getDriverInfo()->supportsMsix()) {
+            return this;
+        }
         if (msixCap) {
             pciMsiXClearAndSet(device, msixCap, PCI_MSIX_FLAGS_ENABLE, 0);
         }
-        device->findPCICapability(PCI_CAP_ID_MSI, &msiCap);
         if (msiCap) {
             pciMsiSetEnable(device, msiCap, 1);
         }
@@ -131,7 +117,7 @@ IONetworkInterface *BCMWLANFirmware_Hashstore::createInterface()
     if (!netif) {
         return NULL;
     }
-    if (!netif->init(this, fHalService)) {
+    if (!netif->init(this, fHalService, rxLro)) {
         netif->release();
         return NULL;
     }
@@ -313,22 +299,72 @@ void BCMWLANFirmware_Hashstore::setGTK(const u_int8_t *gtk, size_t key_len, u_in
 }
 
 
+static void
+mediumNameForRate(char *name, size_t len, uint32_t rate)
+{
+    snprintf(name, len, "IEEE80211 %u.%u Mb/s", rate / 2, (rate & 1) * 5);
+}
+
+static void
+addRateMedium(OSDictionary *mediumDict, uint32_t rate)
+{
+    IONetworkMedium *medium;
+    char name[32];
+    
+    mediumNameForRate(name, sizeof(name), rate);
+    medium = IONetworkMedium::medium(0x80, (UInt64)rate * 500000, 0, 0, name);
+    if (medium) {
+        IONetworkMedium::addMedium(mediumDict, medium);
+        medium->release();
+    }
+}
+
+/*
+ * One medium per distinct PHY rate (500 kb/s units, like the net80211
+ * rate tables) so the link speed can follow the rate control.
+ */
 bool BCMWLANFirmware_Hashstore::
 createMediumTables(const IONetworkMedium **primary)
 {
-    IONetworkMedium    *medium;
+    static const uint8_t legacyRates[] = { 2, 4, 11, 22, 12, 18, 24, 36, 48, 72, 96, 108 };
+    char name[32];
     
-    OSDictionary *mediumDict = OSDictionary::withCapacity(1);
+    OSDictionary *mediumDict = OSDictionary::withCapacity(64);
     if (mediumDict == NULL) {
         XYLog("Cannot allocate OSDictionary\n");
         return false;
     }
     
-    medium = IONetworkMedium::medium(0x80, 11000000);
-    IONetworkMedium::addMedium(mediumDict, medium);
-    medium->release();
+    for (int i = 0; i < ARRAY_SIZE(legacyRates); i++) {
+        addRateMedium(mediumDict, legacyRates[i]);
+    }
+    for (int i = 0; i < IEEE80211_HT_NUM_RATESETS; i++) {
+        const struct ieee80211_ht_rateset *rs = &ieee80211_std_ratesets_11n[i];
+        for (int j = 0; j < rs->nrates; j++) {
+            addRateMedium(mediumDict, rs->rates[j]);
+        }
+    }
+    for (int i = 0; i < IEEE80211_VHT_NUM_RATESETS; i++) {
+        const struct ieee80211_vht_rateset *rs = &ieee80211_std_ratesets_11ac[i];
+        for (int j = 0; j < rs->nrates; j++) {
+            addRateMedium(mediumDict, rs->rates[j]);
+        }
+    }
+    // net80211 has no HE rate sets, take them from the PHY rate table
+    for (int width = 0; width < kItlPhyWidthCount; width++) {
+        for (int guard = 0; guard < kItlPhyGuardCount; guard++) {
+            for (int nss = 1; nss <= kItlPhyMaxNss; nss++) {
+                for (int mcs = 0; mcs < kItlPhyMaxMcs; mcs++) {
+                    addRateMedium(mediumDict, itlPhyRate(kItlPhyModeHE, width, guard, nss, mcs));
+                }
+            }
+        }
+    }
+    
+    // 11 Mb/s stays the primary medium until we associate
+    mediumNameForRate(name, sizeof(name), 22);
     if (primary) {
-        *primary = medium;
+        *primary = OSDynamicCast(IONetworkMedium, mediumDict->getObject(name));
     }
     
     bool result = publishMediumDictionary(mediumDict);
@@ -340,6 +376,88 @@ createMediumTables(const IONetworkMedium **primary)
     return result;
 }
 
+const IONetworkMedium *BCMWLANFirmware_Hashstore::
+mediumForRate(uint32_t rate)
+{
+    const OSDictionary *mediumDict = getMediumDictionary();
+    char name[32];
+    
+    if (mediumDict == NULL || rate == 0) {
+        return NULL;
+    }
+    mediumNameForRate(name, sizeof(name), rate);
+    return OSDynamicCast(IONetworkMedium, mediumDict->getObject(name));
+}
+
+/*
+ * Current Tx PHY rate of the BSS in 500 kb/s units, 0 when not associated.
+ */
+uint32_t BCMWLANFirmware_Hashstore::
+currentTxRate()
+{
+    struct ItlStaInfo info;
+    
+    return fHalService->getStaInfo(&info) ? info.txRate : 0;
+}
+
+void BCMWLANFirmware_Hashstore::
+updateLinkSpeed()
+{
+    if (!(currentStatus & kIONetworkLinkActive)) {
+        return;
+    }
+    getCommandGate()->runAction(updateLinkSpeedGated);
+}
+
+void BCMWLANFirmware_Hashstore::
+roamHousekeeping()
+{
+    uint64_t ns;
+    
+    if (resumeStart) {
+        absolutetime_to_nanoseconds(mach_absolute_time() - resumeStart, &ns);
+        if (ns / 1000000 > kItlResumeJoinTimeoutMS) {
+            XYLog("%s no link %d ms after resume\n", __FUNCTION__, kItlResumeJoinTimeoutMS);
+            unpinResumeTarget();
+            resumeStart = 0;
+        }
+    }
+    // only armed without a link to time out the resume join
+    if (!(currentStatus & kIONetworkLinkActive)) {
+        if (resumeStart == 0) {
+            fHousekeeping.disarm(kItlHkRoam);
+        }
+        return;
+    }
+    roamTick();
+}
+
+IOReturn BCMWLANFirmware_Hashstore::
+roamScanDoneGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    BCMWLANFirmware_Hashstore *that = OSDynamicCast(BCMWLANFirmware_Hashstore, target);
+    that->roamScanDone();
+    return kIOReturnSuccess;
+}
+
+IOReturn BCMWLANFirmware_Hashstore::
+updateLinkSpeedGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    BCMWLANFirmware_Hashstore *that = OSDynamicCast(BCMWLANFirmware_Hashstore, target);
+    // an active status without speed picks up the current rate
+    that->setLinkStatus(that->currentStatus);
+    return kIOReturnSuccess;
+}
+
+/* Awake time in ms, the clock of the housekeeping wheel and the policies on it. */
+uint64_t BCMWLANFirmware_Hashstore::nowMS()
+{
+    uint64_t ns;
+    
+    absolutetime_to_nanoseconds(mach_absolute_time(), &ns);
+    return ns / 1000000;
+}
+
 bool BCMWLANFirmware_Hashstore::start(IOService *provider)
 {
     if (!super::start(provider)) {
@@ -390,7 +508,14 @@ bool BCMWLANFirmware_Hashstore::start(IOService *provider)
         releaseAll();
         return false;
     }
+    // before attach, which loads the firmware the first time
+    uint32_t fwCacheS = kFwCacheDefaultLifetimeS;
+    PE_parse_boot_argn("itlwm_fw_cache_s", &fwCacheS, sizeof(fwCacheS));
+    fwCacheInit(fwCacheS);
     fHalService->initWithController(this, _fWorkloop, _fCommandGate);
+    uint32_t rxBudget = kItlRxPollDefaultBudget;
+    PE_parse_boot_argn("itlwm_rx_budget", &rxBudget, sizeof(rxBudget));
+    fHalService->setRxPollBudget(rxBudget);
     fHalService->get80211Controller()->ic_event_handler = eventHandler;
     if (!fHalService->attach(pciNub)) {
         XYLog("attach fail\n");
@@ -398,33 +523,79 @@ bool BCMWLANFirmware_Hashstore::start(IOService *provider)
         releaseAll();
         return false;
     }
+    // both fall back on their own, to the driver's MSI handler and to Rx in that handler
+    fHalService->attachMsixInterrupts(pciNub);
+    fHalService->attachRxPoll();
+    // LRO verifies checksums itself when the firmware does not, on by default
+    uint32_t lro = 1;
+    PE_parse_boot_argn("itlwm_lro", &lro, sizeof(lro));
+    rxLro = lro != 0;
     if (!attachInterface((IONetworkInterface **)&fNetIf, true)) {
         XYLog("attach to interface fail\n");
-        fHalService->detach(pciNub);
-        super::stop(pciNub);
-        releaseAll();
-        return false;
-    }
-    fWatchdogWorkLoop = IOWorkLoop::workLoop();
-    if (fWatchdogWorkLoop == NULL) {
-        XYLog("init watchdog workloop fail\n");
-        fHalService->detach(pciNub);
+        detachHal();
         super::stop(pciNub);
         releaseAll();
         return false;
     }
-    watchdogTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &BCMWLANFirmware_Hashstore::watchdogAction));
-    if (!watchdogTimer) {
+    fHousekeeping.init();
+    fHousekeeping.setPeriod(kItlHkWatchdog, kWatchDogTimerPeriod);
+    fHousekeeping.setPeriod(kItlHkStaInfo, kWatchDogTimerPeriod);
+    fHousekeeping.setPeriod(kItlHkRoam, kWatchDogTimerPeriod);
+    fHousekeeping.setPeriod(kItlHkLinkSpeed, kLinkSpeedUpdateIntervalMS);
+    fHousekeeping.setPeriod(kItlHkIntrMod, kWatchDogTimerPeriod);
+    uint32_t psIdleMS = kItlPsDefaultIdleMS;
+    PE_parse_boot_argn("itlwm_ps_idle_ms", &psIdleMS, sizeof(psIdleMS));
+    fPowerSave.init(psIdleMS, fHalService->getDriverInfo()->getPowerSaveSupport());
+    fHousekeeping.setPeriod(kItlHkPowerSave, fPowerSave.samplePeriodMS());
+    housekeepingTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &BCMWLANFirmware_Hashstore::housekeepingAction));
+    if (!housekeepingTimer) {
         XYLog("init watchdog fail\n");
-        fHalService->detach(pciNub);
+        detachHal();
         super::stop(pciNub);
         releaseAll();
         return false;
     }
-    fWatchdogWorkLoop->addEventSource(watchdogTimer);
+    _fWorkloop->addEventSource(housekeepingTimer);
     scanSource = IOTimerEventSource::timerEventSource(this, &fakeScanDone);
     _fWorkloop->addEventSource(scanSource);
     scanSource->enable();
+    PE_parse_boot_argn("itlwm_debug", &itlwm_debug_flags, sizeof(itlwm_debug_flags));
+    setProperty("DebugFlags", itlwm_debug_flags, 32);
+    uint32_t amsduMaxLength = kItlAmsduDefaultMaxLength;
+    uint32_t amsduSmallFrame = kItlAmsduDefaultSmallFrame;
+    uint32_t amsduBudgetUS = kItlAmsduDefaultBudgetUS;
+    PE_parse_boot_argn("itlwm_amsdu_len", &amsduMaxLength, sizeof(amsduMaxLength));
+    PE_parse_boot_argn("itlwm_amsdu_small", &amsduSmallFrame, sizeof(amsduSmallFrame));
+    PE_parse_boot_argn("itlwm_amsdu_us", &amsduBudgetUS, sizeof(amsduBudgetUS));
+    if (amsduMaxLength && fAmsdu.init(amsduMaxLength, amsduSmallFrame, amsduBudgetUS)) {
+        amsduTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &BCMWLANFirmware_Hashstore::amsduFlushAction));
+        if (amsduTimer) {
+            _fWorkloop->addEventSource(amsduTimer);
+            amsduTimer->enable();
+        } else {
+            fAmsdu.free();
+        }
+    }
+    if (!amsduTimer) {
+        XYLog("Tx A-MSDU aggregation disabled\n");
+    }
+    // without the queue long set requests simply run in the caller's context
+    if (fCommands.init()) {
+        commandSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &BCMWLANFirmware_Hashstore::commandAction));
+        if (commandSource) {
+            _fWorkloop->addEventSource(commandSource);
+            commandSource->enable();
+        }
+    }
+    eventWindowMS = kItlEventDefaultWindowMS;
+    PE_parse_boot_argn("itlwm_event_ms", &eventWindowMS, sizeof(eventWindowMS));
+    if (eventWindowMS) {
+        eventTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &BCMWLANFirmware_Hashstore::eventFlushAction));
+        if (eventTimer) {
+            _fWorkloop->addEventSource(eventTimer);
+            eventTimer->enable();
+        }
+    }
     setLinkStatus(kIONetworkLinkValid);
     if (TAILQ_EMPTY(&fHalService->get80211Controller()->ic_ess)) {
         fHalService->get80211Controller()->ic_flags |= IEEE80211_F_AUTO_JOIN;
@@ -434,11 +605,258 @@ bool BCMWLANFirmware_Hashstore::start(IOService *provider)
     return true;
 }
 
-void BCMWLANFirmware_Hashstore::watchdogAction(IOTimerEventSource *timer)
+/*
+ * Watchdog, station info, roaming and link speed share this timer on the
+ * main workloop instead of waking a thread of their own, see
+ * ItlHousekeeping for how the deadlines are coalesced. Timer actions run
+ * with the workloop gate held, so the tasks are called directly.
+ */
+void BCMWLANFirmware_Hashstore::housekeepingAction(IOTimerEventSource *timer)
 {
     struct _ifnet *ifp = &fHalService->get80211Controller()->ic_ac.ac_if;
+    uint32_t tasks;
+    
+    tasks = fHousekeeping.due(nowMS());
+    if (tasks & (1 << kItlHkWatchdog)) {
+        watchdogTick();
+    }
+    // RSSI and noise drift, rate changes come through checkStaInfo() on Tx
+    if (tasks & (1 << kItlHkStaInfo)) {
+        fHalService->updateStaInfo();
+    }
+    if (tasks & (1 << kItlHkRoam)) {
+        roamHousekeeping();
+    }
+    if (tasks & (1 << kItlHkLinkSpeed)) {
+        updateLinkSpeed();
+    }
+    if ((tasks & (1 << kItlHkIntrMod)) && fHalService->sampleInterruptModeration()) {
+        struct ItlIntrModStats im;
+        fHalService->getInterruptModerationStats(&im);
+        XYLog("%s interrupt delay %u us at %u interrupts/s\n", __FUNCTION__, im.delayUS, im.intrPerSec);
+    }
+    if (tasks & (1 << kItlHkPowerSave)) {
+        powerSaveTick();
+    }
+    // management frames net80211 sent on its own never went through outputPacket
+    kickWatchdog();
+    armHousekeeping();
+}
+
+/*
+ * The watchdog only runs while the driver has frames outstanding
+ * (if_timer, set when it fills the ring) or net80211 waits for a
+ * management response (ic_mgt_timer); both are cleared again once
+ * drained, which disarms it until the next frame.
+ */
+void BCMWLANFirmware_Hashstore::kickWatchdog()
+{
+    struct ieee80211com *ic = fHalService->get80211Controller();
+    struct _ifnet *ifp = &ic->ic_ac.ac_if;
+    
+    if (fHousekeeping.isArmed(kItlHkWatchdog) || (ifp->if_timer == 0 && ic->ic_mgt_timer == 0)) {
+        return;
+    }
+    if (fHousekeeping.arm(kItlHkWatchdog, nowMS())) {
+        watchdogArmed = true;
+        watchdogOutput = ifp->netStat->outputPackets;
+        watchdogStats.arms++;
+        armHousekeeping();
+    }
+}
+
+IOReturn BCMWLANFirmware_Hashstore::
+interruptModerationGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    BCMWLANFirmware_Hashstore *that = OSDynamicCast(BCMWLANFirmware_Hashstore, target);
+    struct ioctl_int_moderation *im = (struct ioctl_int_moderation *)arg0;
+    struct ItlIntrModParams params;
+    struct ItlIntrModStats stats;
+    
+    if (!that->fHalService->getDriverInfo()->supportsInterruptModeration()) {
+        return kIOReturnUnsupported;
+    }
+    if (arg1) {
+        if (im->mode > ITL_INT_MODERATION_FIXED || im->low_pps > im->high_pps) {
+            return kIOReturnBadArgument;
+        }
+        params.mode = im->mode;
+        params.lowDelayUS = im->low_delay_us;
+        params.highDelayUS = im->high_delay_us;
+        params.lowPps = im->low_pps;
+        params.highPps = im->high_pps;
+        that->fHalService->setInterruptModeration(&params);
+        return kIOReturnSuccess;
+    }
+    that->fHalService->getInterruptModeration(&params);
+    that->fHalService->getInterruptModerationStats(&stats);
+    im->version = IOCTL_VERSION;
+    im->mode = params.mode;
+    im->low_delay_us = params.lowDelayUS;
+    im->high_delay_us = params.highDelayUS;
+    im->low_pps = params.lowPps;
+    im->high_pps = params.highPps;
+    im->delay_us = stats.delayUS;
+    im->intr_per_sec = stats.intrPerSec;
+    im->pkts_per_intr = stats.pktsPerIntr;
+    im->switches = stats.switches;
+    im->interrupts = stats.interrupts;
+    im->packets = stats.packets;
+    return kIOReturnSuccess;
+}
+
+IOReturn BCMWLANFirmware_Hashstore::
+kickWatchdogGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    BCMWLANFirmware_Hashstore *that = OSDynamicCast(BCMWLANFirmware_Hashstore, target);
+    that->kickWatchdog();
+    return kIOReturnSuccess;
+}
+
+void BCMWLANFirmware_Hashstore::watchdogTick()
+{
+    struct ieee80211com *ic = fHalService->get80211Controller();
+    struct _ifnet *ifp = &ic->ic_ac.ac_if;
+    
+    watchdogStats.fires++;
+    if (ifp->if_timer) {
+        watchdogStats.txFires++;
+        if (ifp->netStat->outputPackets == watchdogOutput) {
+            watchdogStats.txStalls++;
+        }
+    }
+    if (ic->ic_mgt_timer) {
+        watchdogStats.mgmtFires++;
+    }
+    if (ifp->if_timer == 0 && ic->ic_mgt_timer == 0) {
+        watchdogStats.idleFires++;
+    }
+    watchdogOutput = ifp->netStat->outputPackets;
     (*ifp->if_watchdog)(ifp);
-    watchdogTimer->setTimeoutMS(kWatchDogTimerPeriod);
+    if (ifp->if_timer == 0 && ic->ic_mgt_timer == 0) {
+        fHousekeeping.disarm(kItlHkWatchdog);
+        watchdogArmed = false;
+        watchdogStats.disarms++;
+    }
+}
+
+void BCMWLANFirmware_Hashstore::armHousekeeping()
+{
+    uint32_t delayMS;
+    uint32_t leewayMS;
+    AbsoluteTime interval;
+    AbsoluteTime leeway;
+    
+    if (!fHousekeeping.next(nowMS(), &delayMS, &leewayMS)) {
+        housekeepingTimer->cancelTimeout();
+        return;
+    }
+    nanoseconds_to_absolutetime((uint64_t)delayMS * 1000000, &interval);
+    nanoseconds_to_absolutetime((uint64_t)leewayMS * 1000000, &leeway);
+    housekeepingTimer->setTimeout(kIOTimeOptionsWithLeeway, interval, leeway);
+}
+
+/* kItlHkLinkTasks, less interrupt moderation when the firmware cannot coalesce. */
+uint32_t BCMWLANFirmware_Hashstore::linkTasks()
+{
+    if (!fHalService->getDriverInfo()->supportsInterruptModeration()) {
+        return kItlHkLinkTasks & ~(1 << kItlHkIntrMod);
+    }
+    return kItlHkLinkTasks;
+}
+
+/*
+ * The link tasks have nothing to do without a BSS, so an idle or
+ * unassociated interface keeps only the watchdog on the wheel.
+ */
+void BCMWLANFirmware_Hashstore::armLinkTasks(bool linkUp)
+{
+    uint64_t now = nowMS();
+    uint32_t tasks = linkTasks();
+    
+    for (int i = 0; i < kItlHkTaskCount; i++) {
+        if (!(tasks & (1 << i))) {
+            continue;
+        }
+        if (linkUp) {
+            fHousekeeping.arm(i, now);
+        } else {
+            fHousekeeping.disarm(i);
+        }
+    }
+    armHousekeeping();
+}
+
+/*
+ * Picks the firmware power save level while associated. Static modes are
+ * applied once, the dynamic one stays on the housekeeping wheel and samples
+ * the packet counters every half idle window so a burst wakes the radio
+ * within one sample.
+ */
+void BCMWLANFirmware_Hashstore::powerSaveTick()
+{
+    struct ieee80211com *ic = fHalService->get80211Controller();
+    struct _ifnet *ifp = &ic->ic_ac.ac_if;
+    int level;
+    
+    if (ic->ic_state != IEEE80211_S_RUN) {
+        fHousekeeping.disarm(kItlHkPowerSave);
+        fHalService->resetPowerSave();
+        return;
+    }
+    level = fPowerSave.sample(ifp->netStat->inputPackets + ifp->netStat->outputPackets, nowMS());
+    if (fHalService->setPowerSave(level, fPowerSave.listenInterval()) != kIOReturnSuccess) {
+        XYLog("%s firmware refused power save level %d\n", __FUNCTION__, level);
+    }
+    if (!fPowerSave.isDynamic()) {
+        fHousekeeping.disarm(kItlHkPowerSave);
+    }
+}
+
+/* Apply the power save mode at the next housekeeping wakeup, which is right away. */
+void BCMWLANFirmware_Hashstore::kickPowerSave()
+{
+    fHousekeeping.kick(kItlHkPowerSave, nowMS());
+    armHousekeeping();
+}
+
+IOReturn BCMWLANFirmware_Hashstore::
+kickPowerSaveGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    BCMWLANFirmware_Hashstore *that = OSDynamicCast(BCMWLANFirmware_Hashstore, target);
+    that->kickPowerSave();
+    return kIOReturnSuccess;
+}
+
+void BCMWLANFirmware_Hashstore::amsduFlushAction(IOTimerEventSource *timer)
+{
+    struct _ifnet *ifp = &fHalService->get80211Controller()->ic_ac.ac_if;
+    mbuf_t m = fAmsdu.flushExpired(mach_absolute_time());
+    if (m == NULL) {
+        // a newer aggregate took the pending slot, wait for what is left of its budget
+        if (fAmsdu.getDeadline()) {
+            amsduTimer->wakeAtTime(fAmsdu.getDeadline());
+        }
+        return;
+    }
+    enqueueTxPackets(ifp, m);
+    (*ifp->if_start)(ifp);
+    kickWatchdog();
+}
+
+void BCMWLANFirmware_Hashstore::updateAmsduPeer()
+{
+    struct ieee80211com *ic = fHalService->get80211Controller();
+    struct ieee80211_node *ni = ic->ic_bss;
+    uint32_t halMaxLength = fHalService->getDriverInfo()->getTxAmsduMaxLength();
+    uint32_t peerMaxLength;
+    
+    if (ni == NULL || halMaxLength == 0 || ic->ic_state != IEEE80211_S_RUN || !(ni->ni_flags & IEEE80211_NODE_HT)) {
+        fAmsdu.setPeer(NULL, 0);
+        return;
+    }
+    peerMaxLength = (ni->ni_htcaps & IEEE80211_HTCAP_AMSDU7935) ? 7935 : 3839;
+    fAmsdu.setPeer(ni->ni_macaddr, min(halMaxLength, peerMaxLength));
 }
 
 void BCMWLANFirmware_Hashstore::fakeScanDone(OSObject *owner, IOTimerEventSource *sender)
@@ -470,6 +888,7 @@ bool BCMWLANFirmware_Hashstore::initPCIPowerManagment(IOPCIDevice *provider)
     reg16 &= ~kIOPCICommandIOSpace;  // disable I/O space
 
     provider->configWrite16( kIOPCIConfigCommand, reg16 );
+    pmPCICommand = reg16;
     provider->findPCICapability(kIOPCIPowerManagementCapability,
                                 &pmPCICapPtr);
     if (pmPCICapPtr) {
@@ -489,6 +908,14 @@ IOReturn BCMWLANFirmware_Hashstore::selectMedium(const IONetworkMedium *medium)
     return kIOReturnSuccess;
 }
 
+/* The vectors and the poll thread go before the driver powers the device down. */
+void BCMWLANFirmware_Hashstore::detachHal()
+{
+    fHalService->detachRxPoll();
+    fHalService->detachMsixInterrupts();
+    fHalService->detach(pciNub);
+}
+
 void BCMWLANFirmware_Hashstore::stop(IOService *provider)
 {
     XYLog("%s\n", __FUNCTION__);
@@ -496,7 +923,7 @@ void BCMWLANFirmware_Hashstore::stop(IOService *provider)
     super::stop(provider);
     disableAdapter(fNetIf);
     setLinkStatus(kIONetworkLinkValid);
-    fHalService->detach(pciNub);
+    detachHal();
     detachInterface(fNetIf, true);
     OSSafeReleaseNULL(fNetIf);
     ifp->iface = NULL;
@@ -507,28 +934,77 @@ bool BCMWLANFirmware_Hashstore::
 setLinkStatus(UInt32 status, const IONetworkMedium * activeMedium, UInt64 speed, OSData * data)
 {
     struct _ifnet *ifq = &fHalService->get80211Controller()->ic_ac.ac_if;
-    if (status == currentStatus) {
+    if (status != currentStatus) {
+        fHalService->updateStaInfo();
+    }
+    if ((status & kIONetworkLinkActive) && speed == 0) {
+        uint32_t rate = currentTxRate();
+        // no rate for this combination: keep the last speed, or 11 Mb/s right after association
+        if (rate == 0) {
+            rate = currentSpeed ? (uint32_t)(currentSpeed / 500000) : 22;
+        }
+        speed = (UInt64)rate * 500000;
+        if (activeMedium == NULL) {
+            activeMedium = mediumForRate(rate);
+        }
+    }
+    if (status == currentStatus && speed == currentSpeed) {
         return true;
     }
     bool ret = super::setLinkStatus(status, activeMedium, speed, data);
+    bool statusChanged = status != currentStatus;
     currentStatus = status;
-    if (fNetIf) {
+    currentSpeed = speed;
+    if (fNetIf && statusChanged) {
         if (status & kIONetworkLinkActive) {
 #ifdef __PRIVATE_SPI__
             fNetIf->startOutputThread();
 #endif
             ifq_set_oactive(&ifq->if_snd);
-            getCommandGate()->runAction(setLinkStateGated, (void *)kIO80211NetworkLinkUp, (void *)0);
+            updateAmsduPeer();
+            uint64_t roamMS;
+            if (roamPending(&roamMS)) {
+                roamStart = 0;
+                roamStats.lastMS = (uint32_t)roamMS;
+                roamStats.maxMS = max(roamStats.maxMS, roamStats.lastMS);
+                roamStats.totalMS += roamStats.lastMS;
+                roamStats.completed++;
+                XYLog("%s roamed to %s in %u ms\n", __FUNCTION__, ether_sprintf(fHalService->get80211Controller()->ic_bss->ni_bssid), roamStats.lastMS);
+                queueMessage(APPLE80211_M_ROAMED);
+            }
+            if (resumeStart) {
+                uint64_t ns;
+                absolutetime_to_nanoseconds(mach_absolute_time() - resumeStart, &ns);
+                resumeStart = 0;
+                resumeStats.linkMS = (uint32_t)(ns / 1000000);
+                resumeStats.maxLinkMS = max(resumeStats.maxLinkMS, resumeStats.linkMS);
+                XYLog("%s link up %u ms after resume\n", __FUNCTION__, resumeStats.linkMS);
+                unpinResumeTarget();
+            }
+            fPowerSave.reset(ifq->netStat->inputPackets + ifq->netStat->outputPackets, nowMS());
+            kickPowerSave();
+            armLinkTasks(true);
+            queueLinkState(kIO80211NetworkLinkUp, 0);
             fNetIf->setLinkQualityMetric(100);
         } else if (!(status & kIONetworkLinkNoNetworkChange)) {
 #ifdef __PRIVATE_SPI__
             fNetIf->stopOutputThread();
             fNetIf->flushOutputQueue();
 #endif
+            fAmsdu.setPeer(NULL, 0);
+            fAmsdu.drop();
+            fRoam.reset();
+            // the roam itself takes the link down, only a stale one ends here
+            uint64_t roamMS;
+            roamPending(&roamMS);
+            fHousekeeping.disarm(kItlHkPowerSave);
+            fHalService->resetPowerSave();
+            fWowlan.clearRekeyKeys();
             ifq->if_snd->lockFlush();
             mq_purge(&fHalService->get80211Controller()->ic_mgtq);
             ifq_clr_oactive(&ifq->if_snd);
-            getCommandGate()->runAction(setLinkStateGated, (void *)kIO80211NetworkLinkDown, (void *)fHalService->get80211Controller()->ic_deauth_reason);
+            armLinkTasks(false);
+            queueLinkState(kIO80211NetworkLinkDown, fHalService->get80211Controller()->ic_deauth_reason);
         }
     }
     return ret;
@@ -545,6 +1021,73 @@ setLinkStateGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *ar
     return ret;
 }
 
+/*
+ * Link state changes and messages are held for eventWindowMS so a roam or a
+ * flapping link wakes userspace once instead of once per step.
+ */
+void BCMWLANFirmware_Hashstore::
+queueLinkState(IO80211LinkState state, unsigned int reason)
+{
+    getCommandGate()->runAction(queueEventGated, (void *)true, (void *)(uintptr_t)state, (void *)(uintptr_t)reason);
+}
+
+void BCMWLANFirmware_Hashstore::
+queueMessage(int code)
+{
+    getCommandGate()->runAction(queueEventGated, (void *)false, (void *)(intptr_t)code);
+}
+
+IOReturn BCMWLANFirmware_Hashstore::
+queueEventGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    BCMWLANFirmware_Hashstore *that = OSDynamicCast(BCMWLANFirmware_Hashstore, target);
+    bool armed = that->fEvents.hasPending();
+    bool posted = arg0 ? that->fEvents.postLinkState((uint32_t)(uintptr_t)arg1, (uint32_t)(uintptr_t)arg2) :
+                         that->fEvents.postMessage((int)(intptr_t)arg1);
+    
+    if (!posted) {
+        // queue full, nothing may be dropped
+        that->deliverEvents();
+        if (arg0) {
+            that->fEvents.postLinkState((uint32_t)(uintptr_t)arg1, (uint32_t)(uintptr_t)arg2);
+        } else {
+            that->fEvents.postMessage((int)(intptr_t)arg1);
+        }
+        armed = false;
+    }
+    if (that->eventTimer == NULL) {
+        that->deliverEvents();
+    } else if (!armed) {
+        that->eventTimer->setTimeoutMS(that->eventWindowMS);
+    }
+    return kIOReturnSuccess;
+}
+
+void BCMWLANFirmware_Hashstore::
+deliverEvents()
+{
+    IO80211Interface *interface = getNetworkInterface();
+    struct ItlEvent events[kItlEventMaxPending];
+    int n;
+    
+    if (eventTimer) {
+        eventTimer->cancelTimeout();
+    }
+    n = fEvents.take(events, kItlEventMaxPending);
+    for (int i = 0; i < n; i++) {
+        if (events[i].code == kItlEventLinkState) {
+            setLinkStateGated(this, (void *)(uintptr_t)events[i].state, (void *)(uintptr_t)events[i].reason, NULL, NULL);
+        } else if (interface) {
+            interface->postMessage(events[i].code);
+        }
+    }
+}
+
+void BCMWLANFirmware_Hashstore::eventFlushAction(IOTimerEventSource *timer)
+{
+    deliverEvents();
+}
+
 void BCMWLANFirmware_Hashstore::releaseAll()
 {
     if (fHalService) {
@@ -565,17 +1108,38 @@ void BCMWLANFirmware_Hashstore::releaseAll()
             scanSource->release();
             scanSource = NULL;
         }
-        if (fWatchdogWorkLoop && watchdogTimer) {
-            watchdogTimer->cancelTimeout();
-            fWatchdogWorkLoop->removeEventSource(watchdogTimer);
-            watchdogTimer->release();
-            watchdogTimer = NULL;
-            fWatchdogWorkLoop->release();
-            fWatchdogWorkLoop = NULL;
+        if (amsduTimer) {
+            amsduTimer->cancelTimeout();
+            amsduTimer->disable();
+            _fWorkloop->removeEventSource(amsduTimer);
+            amsduTimer->release();
+            amsduTimer = NULL;
+        }
+        if (eventTimer) {
+            eventTimer->cancelTimeout();
+            eventTimer->disable();
+            _fWorkloop->removeEventSource(eventTimer);
+            eventTimer->release();
+            eventTimer = NULL;
+        }
+        if (commandSource) {
+            commandSource->disable();
+            _fWorkloop->removeEventSource(commandSource);
+            commandSource->release();
+            commandSource = NULL;
+        }
+        fCommands.free();
+        if (housekeepingTimer) {
+            housekeepingTimer->cancelTimeout();
+            housekeepingTimer->disable();
+            _fWorkloop->removeEventSource(housekeepingTimer);
+            housekeepingTimer->release();
+            housekeepingTimer = NULL;
         }
 //        _fWorkloop->release();
         _fWorkloop = NULL;
     }
+    fAmsdu.free();
     unregistPM();
 }
 
@@ -586,15 +1150,12 @@ void BCMWLANFirmware_Hashstore::free()
         fHalService->release();
         fHalService = NULL;
     }
+    fwCacheFree();
     if (syncFrameTemplate != NULL && syncFrameTemplateLength > 0) {
         IOFree(syncFrameTemplate, syncFrameTemplateLength);
         syncFrameTemplateLength = 0;
         syncFrameTemplate = NULL;
     }
-    if (roamProfile != NULL) {
-        IOFree(roamProfile, sizeof(struct apple80211_roam_profile_band_data));
-        roamProfile = NULL;
-    }
     super::free();
 }
 
@@ -619,16 +1180,25 @@ IOReturn BCMWLANFirmware_Hashstore::disable(IONetworkInterface *netif)
 
 IOReturn BCMWLANFirmware_Hashstore::enableAdapter(IONetworkInterface *netif)
 {
+    uint32_t tasks = (currentStatus & kIONetworkLinkActive) ? (linkTasks() | (1 << kItlHkPowerSave)) : 0;
+    
     fHalService->enable(netif);
-    watchdogTimer->setTimeoutMS(kWatchDogTimerPeriod);
-    watchdogTimer->enable();
+    // roamHousekeeping() also times out the join after resume
+    if (resumeStart) {
+        tasks |= 1 << kItlHkRoam;
+    }
+    // the watchdog waits for the first frame, see kickWatchdog(), the rest for link up
+    fHousekeeping.start(nowMS(), tasks);
+    watchdogArmed = false;
+    housekeepingTimer->enable();
+    armHousekeeping();
     return kIOReturnSuccess;
 }
 
 void BCMWLANFirmware_Hashstore::disableAdapter(IONetworkInterface *netif)
 {
-    watchdogTimer->cancelTimeout();
-    watchdogTimer->disable();
+    housekeepingTimer->cancelTimeout();
+    housekeepingTimer->disable();
     fHalService->disable(netif);
 }
 
@@ -694,17 +1264,333 @@ UInt32 BCMWLANFirmware_Hashstore::outputPacket(mbuf_t m, void *param)
         ifp->netStat->outputErrors++;
         ret = kIOReturnOutputDropped;
     }
-    if (!ifp->if_snd->lockEnqueue(m)) {
-        freePacket(m);
+    if (ret == kIOReturnOutputSuccess && fAmsdu.isEnabled()) {
+        uint64_t deadline = fAmsdu.getDeadline();
+        m = fAmsdu.enqueue(m, ieee80211_classify(fHalService->get80211Controller(), m));
+        if (fAmsdu.getDeadline() != 0 && fAmsdu.getDeadline() != deadline) {
+            amsduTimer->wakeAtTime(fAmsdu.getDeadline());
+        }
+        if (m == NULL) {
+            return ret;
+        }
+    }
+    if (!enqueueTxPackets(ifp, m)) {
         ret = kIOReturnOutputDropped;
     }
     (*ifp->if_start)(ifp);
+    // rate control reacts to Tx, so this is where a new rate shows up
+    fHalService->checkStaInfo();
+    if (!watchdogArmed && ifp->if_timer) {
+        getCommandGate()->runAction(kickWatchdogGated);
+    }
+    return ret;
+}
+
+bool BCMWLANFirmware_Hashstore::
+enqueueTxPackets(struct _ifnet *ifp, mbuf_t m)
+{
+    bool ret = true;
+    mbuf_t next;
+    
+    for (; m != NULL; m = next) {
+        next = mbuf_nextpkt(m);
+        mbuf_setnextpkt(m, NULL);
+        if (!ifp->if_snd->lockEnqueue(m)) {
+            freePacket(m);
+            ret = false;
+        }
+    }
     return ret;
 }
 
 UInt32 BCMWLANFirmware_Hashstore::getFeatures() const
 {
-    return fHalService->getDriverInfo()->supportedFeatures();
+    UInt32 features = fHalService->getDriverInfo()->supportedFeatures();
+    
+    // the stack skips its own coalescing for LRO interfaces
+    if (rxLro) {
+        features |= kIONetworkFeatureLRO;
+    }
+    return features;
+}
+
+IOReturn BCMWLANFirmware_Hashstore::getChecksumSupport(UInt32 *checksumMask, UInt32 checksumFamily, bool isOutput)
+{
+    if (checksumFamily != kChecksumFamilyTCPIP) {
+        return kIOReturnUnsupported;
+    }
+    // receive only, nothing on the transmit path can fill in checksums
+    *checksumMask = isOutput ? 0 : fHalService->getDriverInfo()->getRxChecksumSupport();
+    // segments LRO merges carry verified IP and TCP checksums either way
+    if (!isOutput && rxLro) {
+        *checksumMask |= kChecksumIP | kChecksumTCP;
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn BCMWLANFirmware_Hashstore::setProperties(OSObject *properties)
+{
+    OSDictionary *dict = OSDynamicCast(OSDictionary, properties);
+    OSNumber *flags;
+    
+    if (dict && (flags = OSDynamicCast(OSNumber, dict->getObject("DebugFlags")))) {
+        // the RSN flag dumps EAPOL frames, only root may turn it on
+        if (IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator) != kIOReturnSuccess) {
+            return kIOReturnNotPrivileged;
+        }
+        itlwm_debug_flags = flags->unsigned32BitValue();
+        setProperty("DebugFlags", itlwm_debug_flags, 32);
+        return kIOReturnSuccess;
+    }
+    return super::setProperties(properties);
+}
+
+static void setNumberProperty(OSDictionary *dict, const char *key, uint64_t value)
+{
+    OSNumber *num = OSNumber::withNumber(value, 64);
+    
+    if (num) {
+        dict->setObject(key, num);
+        num->release();
+    }
+}
+
+/* The counters are only turned into registry objects when somebody reads them. */
+bool BCMWLANFirmware_Hashstore::serializeProperties(OSSerialize *serialize) const
+{
+    BCMWLANFirmware_Hashstore *that = const_cast<BCMWLANFirmware_Hashstore *>(this);
+    OSDictionary *stats = that->fIoctlStats.copyDictionary();
+    
+    OSDictionary *events = OSDictionary::withCapacity(3);
+    struct ItlEventStats eventStats;
+    
+    if (stats) {
+        that->setProperty(kItlIoctlStatsKey, stats);
+        stats->release();
+    }
+    OSDictionary *roam = OSDictionary::withCapacity(9);
+    
+    if (roam) {
+        setNumberProperty(roam, "Attempts", roamStats.attempts);
+        setNumberProperty(roam, "Completed", roamStats.completed);
+        setNumberProperty(roam, "Failures", roamStats.failures);
+        setNumberProperty(roam, "Misses", roamStats.misses);
+        setNumberProperty(roam, "Scans", roamStats.scans);
+        setNumberProperty(roam, "Triggers", fRoam.getTriggerCount());
+        setNumberProperty(roam, "LastMS", roamStats.lastMS);
+        setNumberProperty(roam, "MaxMS", roamStats.maxMS);
+        setNumberProperty(roam, "TotalMS", roamStats.totalMS);
+        that->setProperty("RoamStats", roam);
+        roam->release();
+    }
+    OSDictionary *ps = fHalService ? OSDictionary::withCapacity(9) : NULL;
+    struct ItlPowerSaveStats psStats;
+    struct ItlPowerSavePolicyStats psPolicy;
+    
+    if (ps) {
+        fHalService->getPowerSaveStats(&psStats);
+        fPowerSave.getStats(&psPolicy);
+        setNumberProperty(ps, "Mode", fPowerSave.getMode());
+        setNumberProperty(ps, "Level", psStats.level);
+        setNumberProperty(ps, "CAMMS", psStats.ms[kItlPowerSaveCAM]);
+        setNumberProperty(ps, "PSPollMS", psStats.ms[kItlPowerSavePSPoll]);
+        setNumberProperty(ps, "UAPSDMS", psStats.ms[kItlPowerSaveUapsd]);
+        setNumberProperty(ps, "Transitions", psStats.transitions);
+        setNumberProperty(ps, "Failures", psStats.failures);
+        setNumberProperty(ps, "LoadWakes", psPolicy.loadWakes);
+        setNumberProperty(ps, "IdleDozes", psPolicy.idleDozes);
+        that->setProperty("PowerSaveStats", ps);
+        ps->release();
+    }
+    OSDictionary *resume = OSDictionary::withCapacity(8);
+    
+    if (resume) {
+        setNumberProperty(resume, "Resumes", resumeStats.resumes);
+        setNumberProperty(resume, "PCIUS", resumeStats.pciUS);
+        setNumberProperty(resume, "FirmwareUS", resumeStats.firmwareUS);
+        setNumberProperty(resume, "FirmwareWaitUS", resumeStats.firmwareWaitUS);
+        setNumberProperty(resume, "EnableUS", resumeStats.enableUS);
+        setNumberProperty(resume, "AckUS", resumeStats.ackUS);
+        setNumberProperty(resume, "LinkMS", resumeStats.linkMS);
+        setNumberProperty(resume, "MaxLinkMS", resumeStats.maxLinkMS);
+        that->setProperty("ResumeStats", resume);
+        resume->release();
+    }
+    OSDictionary *fwCache = OSDictionary::withCapacity(6);
+    struct FwCacheStats fwCacheStats;
+    
+    if (fwCache) {
+        fwCacheGetStats(&fwCacheStats);
+        setNumberProperty(fwCache, "Hits", fwCacheStats.hits);
+        setNumberProperty(fwCache, "Misses", fwCacheStats.misses);
+        setNumberProperty(fwCache, "Expired", fwCacheStats.expired);
+        setNumberProperty(fwCache, "PressureDrops", fwCacheStats.pressureDrops);
+        setNumberProperty(fwCache, "Images", fwCacheStats.images);
+        setNumberProperty(fwCache, "Bytes", fwCacheStats.bytes);
+        that->setProperty("FirmwareCacheStats", fwCache);
+        fwCache->release();
+    }
+    OSDictionary *watchdog = OSDictionary::withCapacity(7);
+    
+    if (watchdog) {
+        setNumberProperty(watchdog, "Arms", watchdogStats.arms);
+        setNumberProperty(watchdog, "Disarms", watchdogStats.disarms);
+        setNumberProperty(watchdog, "Fires", watchdogStats.fires);
+        setNumberProperty(watchdog, "TxFires", watchdogStats.txFires);
+        setNumberProperty(watchdog, "TxStalls", watchdogStats.txStalls);
+        setNumberProperty(watchdog, "MgmtFires", watchdogStats.mgmtFires);
+        setNumberProperty(watchdog, "IdleFires", watchdogStats.idleFires);
+        that->setProperty("WatchdogStats", watchdog);
+        watchdog->release();
+    }
+    OSDictionary *im = fHalService && fHalService->getDriverInfo()->supportsInterruptModeration() ? OSDictionary::withCapacity(7) : NULL;
+    struct ItlIntrModStats imStats;
+    
+    if (im) {
+        fHalService->getInterruptModerationStats(&imStats);
+        setNumberProperty(im, "DelayUS", imStats.delayUS);
+        setNumberProperty(im, "InterruptsPerSec", imStats.intrPerSec);
+        setNumberProperty(im, "PacketsPerInterrupt100", imStats.pktsPerIntr);
+        setNumberProperty(im, "Switches", imStats.switches);
+        setNumberProperty(im, "Failures", imStats.failures);
+        setNumberProperty(im, "Interrupts", imStats.interrupts);
+        setNumberProperty(im, "Packets", imStats.packets);
+        that->setProperty("InterruptModerationStats", im);
+        im->release();
+    }
+    OSDictionary *vectors = fHalService && fHalService->isMsix() ? OSDictionary::withCapacity(kItlIntrQueueCount) : NULL;
+    uint64_t vectorCount[kItlIntrQueueCount];
+    
+    if (vectors) {
+        fHalService->getMsixStats(vectorCount);
+        setNumberProperty(vectors, "Rx", vectorCount[kItlIntrQueueRx]);
+        setNumberProperty(vectors, "Tx", vectorCount[kItlIntrQueueTx]);
+        setNumberProperty(vectors, "Cmd", vectorCount[kItlIntrQueueCmd]);
+        that->setProperty("InterruptVectorStats", vectors);
+        vectors->release();
+    }
+    OSDictionary *rxPoll = fHalService && fHalService->isRxPoll() ? OSDictionary::withCapacity(5) : NULL;
+    struct ItlRxPollStats rxPollStats;
+    
+    if (rxPoll) {
+        fHalService->getRxPollStats(&rxPollStats);
+        setNumberProperty(rxPoll, "Budget", rxPollStats.budget);
+        setNumberProperty(rxPoll, "Schedules", rxPollStats.schedules);
+        setNumberProperty(rxPoll, "Passes", rxPollStats.passes);
+        setNumberProperty(rxPoll, "Exhausted", rxPollStats.exhausted);
+        setNumberProperty(rxPoll, "Frames", rxPollStats.frames);
+        that->setProperty("RxPollStats", rxPoll);
+        rxPoll->release();
+    }
+    OSDictionary *wait = fHalService ? OSDictionary::withCapacity(4) : NULL;
+    struct ItlWaitStats waitStats;
+    
+    if (wait) {
+        fHalService->getWaitStats(&waitStats);
+        setNumberProperty(wait, "Sleepers", waitStats.sleepers);
+        setNumberProperty(wait, "Sleeps", waitStats.sleeps);
+        setNumberProperty(wait, "Wakeups", waitStats.wakeups);
+        setNumberProperty(wait, "IdleWakeups", waitStats.idleWakeups);
+        that->setProperty("WaitChannelStats", wait);
+        wait->release();
+    }
+    OSDictionary *housekeeping = OSDictionary::withCapacity(3);
+    struct ItlHousekeepingStats hkStats;
+    
+    if (housekeeping) {
+        fHousekeeping.getStats(&hkStats);
+        setNumberProperty(housekeeping, "Fires", hkStats.fires);
+        setNumberProperty(housekeeping, "Runs", hkStats.runs);
+        setNumberProperty(housekeeping, "Coalesced", hkStats.coalesced);
+        that->setProperty("HousekeepingStats", housekeeping);
+        housekeeping->release();
+    }
+    OSDictionary *wowlan = OSDictionary::withCapacity(10);
+    struct ItlWowlanStats wowlanStats;
+    
+    if (wowlan) {
+        fWowlan.getStats(&wowlanStats);
+        setNumberProperty(wowlan, "Armed", wowlanStats.armed);
+        setNumberProperty(wowlan, "ArmFailures", wowlanStats.armFailures);
+        setNumberProperty(wowlan, "DroppedPatterns", wowlanStats.droppedPatterns);
+        setNumberProperty(wowlan, "MagicWakes", wowlanStats.wakes[kItlWakeReasonMagic]);
+        setNumberProperty(wowlan, "PatternWakes", wowlanStats.wakes[kItlWakeReasonPattern]);
+        setNumberProperty(wowlan, "DisconnectWakes", wowlanStats.wakes[kItlWakeReasonDisconnect]);
+        setNumberProperty(wowlan, "BeaconLossWakes", wowlanStats.wakes[kItlWakeReasonBeaconLoss]);
+        setNumberProperty(wowlan, "RekeyFailureWakes", wowlanStats.wakes[kItlWakeReasonGtkRekeyFailure]);
+        setNumberProperty(wowlan, "OtherWakes", wowlanStats.wakes[kItlWakeReasonNone] + wowlanStats.wakes[kItlWakeReasonOther]);
+        setNumberProperty(wowlan, "LastWakeReason", wowlanStats.lastReason);
+        that->setProperty("WoWLANStats", wowlan);
+        wowlan->release();
+    }
+    OSDictionary *pmksa = OSDictionary::withCapacity(6);
+    struct ItlPmksaStats pmksaStats;
+    
+    if (pmksa) {
+        fPmksa.getStats(&pmksaStats);
+        setNumberProperty(pmksa, "Entries", fPmksa.getCount());
+        setNumberProperty(pmksa, "Hits", pmksaStats.hits);
+        setNumberProperty(pmksa, "Misses", pmksaStats.misses);
+        setNumberProperty(pmksa, "Derived", pmksaStats.derived);
+        setNumberProperty(pmksa, "Evictions", pmksaStats.evictions);
+        setNumberProperty(pmksa, "Expired", pmksaStats.expired);
+        that->setProperty("PmksaStats", pmksa);
+        pmksa->release();
+    }
+    OSDictionary *amsdu = OSDictionary::withCapacity(5);
+    struct ItlAmsduStats amsduStats;
+    
+    if (amsdu) {
+        fAmsdu.getStats(&amsduStats);
+        setNumberProperty(amsdu, "Aggregates", amsduStats.aggregates);
+        setNumberProperty(amsdu, "Subframes", amsduStats.subframes);
+        setNumberProperty(amsdu, "Bypassed", amsduStats.bypassed);
+        setNumberProperty(amsdu, "TimerFlushes", amsduStats.timerFlushes);
+        setNumberProperty(amsdu, "AllocFailures", amsduStats.allocFailures);
+        that->setProperty("AmsduStats", amsdu);
+        amsdu->release();
+    }
+    OSDictionary *lro = fNetIf ? OSDictionary::withCapacity(4) : NULL;
+    struct ItlLroStats lroStats;
+    
+    if (lro) {
+        fNetIf->getLroStats(&lroStats);
+        setNumberProperty(lro, "Aggregates", lroStats.aggregates);
+        setNumberProperty(lro, "Merged", lroStats.merged);
+        setNumberProperty(lro, "Bypassed", lroStats.bypassed);
+        setNumberProperty(lro, "SoftwareChecksums", lroStats.swChecksums);
+        that->setProperty("LroStats", lro);
+        lro->release();
+    }
+    if (events) {
+        fEvents.getStats(&eventStats);
+        setNumberProperty(events, "Posted", eventStats.posted);
+        setNumberProperty(events, "Delivered", eventStats.delivered);
+        setNumberProperty(events, "Suppressed", eventStats.suppressed);
+        that->setProperty("EventStats", events);
+        events->release();
+    }
+    return super::serializeProperties(serialize);
+}
+
+IOReturn BCMWLANFirmware_Hashstore::
+callPlatformFunction(const OSSymbol *functionName, bool waitForFunction,
+                     void *param1, void *param2, void *param3, void *param4)
+{
+    if (functionName->isEqualTo(ITL_IOCTL_STATS_FUNCTION)) {
+        if (param1 == NULL) {
+            return kIOReturnBadArgument;
+        }
+        fIoctlStats.snapshot((struct ioctl_apple80211_stats *)param1);
+        return kIOReturnSuccess;
+    }
+    if (functionName->isEqualTo(ITL_INT_MODERATION_FUNCTION)) {
+        if (param1 == NULL) {
+            return kIOReturnBadArgument;
+        }
+        return getCommandGate()->runAction(interruptModerationGated, param1, param2);
+    }
+    return super::callPlatformFunction(functionName, waitForFunction, param1, param2, param3, param4);
 }
 
 IOReturn BCMWLANFirmware_Hashstore::setPromiscuousMode(IOEnetPromiscuousMode mode)
@@ -758,19 +1644,15 @@ tsleepHandler(OSObject* owner, void* arg0, void* arg1, void* arg2, void* arg3)
     if (dev == 0)
         return kIOReturnError;
     
-    if (arg1 == 0) {
-        if (_fCommandGate->commandSleep(arg0, THREAD_INTERRUPTIBLE) == THREAD_AWAKENED)
-            return kIOReturnSuccess;
-        else
-            return kIOReturnTimeout;
-    } else {
-        AbsoluteTime deadline;
-        clock_interval_to_deadline((*(int*)arg1), kNanosecondScale, reinterpret_cast<uint64_t*> (&deadline));
-        if (_fCommandGate->commandSleep(arg0, deadline, THREAD_INTERRUPTIBLE) == THREAD_AWAKENED)
-            return kIOReturnSuccess;
-        else
-            return kIOReturnTimeout;
-    }
+    // arg1 points to an int timeout in nanoseconds, arg2 to an absolute uint64_t deadline;
+    // as everywhere else a zero timeout only polls, see itlDeadline()
+    uint64_t deadline = kItlWaitForever;
+    if (arg2) {
+        deadline = *(uint64_t *)arg2;
+    } else if (arg1) {
+        deadline = itlDeadlineAfterNS((uint32_t)*(int *)arg1);
+    }
+    return dev->fHalService->commandSleepDeadline(arg0, deadline);
 }
 
 static IOPMPowerState powerStateArray[kPowerStateCount] =
@@ -789,6 +1671,15 @@ void BCMWLANFirmware_Hashstore::unregistPM()
         thread_call_free(powerOnThreadCall);
         powerOnThreadCall = NULL;
     }
+    if (resumePrepareThreadCall) {
+        thread_call_cancel_wait(resumePrepareThreadCall);
+        thread_call_free(resumePrepareThreadCall);
+        resumePrepareThreadCall = NULL;
+    }
+    if (resumeLock) {
+        IOLockFree(resumeLock);
+        resumeLock = NULL;
+    }
 }
 
 IOReturn BCMWLANFirmware_Hashstore::setPowerState(unsigned long powerStateOrdinal, IOService *policyMaker)
@@ -809,6 +1700,16 @@ IOReturn BCMWLANFirmware_Hashstore::setPowerState(unsigned long powerStateOrdina
             }
             break;
         case kPowerStateOn:
+            // the firmware gets ready while the gate is still being waited for
+            if (resumePrepareThreadCall && resumeLock) {
+                IOLockLock(resumeLock);
+                resumePreparing = true;
+                IOLockUnlock(resumeLock);
+                retain();
+                if (thread_call_enter(resumePrepareThreadCall)) {
+                    release();
+                }
+            }
             if (powerOnThreadCall) {
                 retain();
                 if (thread_call_enter(powerOnThreadCall)) {
@@ -827,6 +1728,7 @@ IOReturn BCMWLANFirmware_Hashstore::setPowerState(unsigned long powerStateOrdina
 IOReturn BCMWLANFirmware_Hashstore::setWakeOnMagicPacket(bool active)
 {
     magicPacketEnabled = active;
+    fWowlan.setMagicPacket(active);
     return kIOReturnSuccess;
 }
 
@@ -866,6 +1768,15 @@ static void handleSetPowerStateOn(thread_call_param_t param0,
     }
 }
 
+static void handleResumePrepare(thread_call_param_t param0,
+                                thread_call_param_t param1)
+{
+    BCMWLANFirmware_Hashstore *self = (BCMWLANFirmware_Hashstore *) param0;
+
+    self->resumePrepare();
+    self->release();
+}
+
 IOReturn BCMWLANFirmware_Hashstore::registerWithPolicyMaker(IOService *policyMaker)
 {
     IOReturn ret;
@@ -879,25 +1790,201 @@ IOReturn BCMWLANFirmware_Hashstore::registerWithPolicyMaker(IOService *policyMak
     powerOnThreadCall  = thread_call_allocate(
                                             (thread_call_func_t)handleSetPowerStateOn,
                                               (thread_call_param_t)this);
+    resumePrepareThreadCall = thread_call_allocate(
+                                            (thread_call_func_t)handleResumePrepare,
+                                            (thread_call_param_t)this);
+    resumeLock = IOLockAlloc();
     ret = pmPolicyMaker->registerPowerDriver(this,
                                              powerStateArray,
                                              kPowerStateCount);
     return ret;
 }
 
+static uint32_t elapsedUS(uint64_t since, uint64_t now)
+{
+    uint64_t ns;
+    
+    absolutetime_to_nanoseconds(now - since, &ns);
+    return (uint32_t)min(ns / 1000, (uint64_t)UINT32_MAX);
+}
+
 void BCMWLANFirmware_Hashstore::setPowerStateOff()
 {
+    struct ieee80211com *ic = fHalService->get80211Controller();
+    
     XYLog("%s\n", __FUNCTION__);
     pmPowerState = kPowerStateOff;
+    // net80211 drops the node cache with the adapter, remember where we were
+    bzero(&resumeTarget, sizeof(resumeTarget));
+    if (ic->ic_state == IEEE80211_S_RUN && ic->ic_bss != NULL) {
+        resumeTarget.valid = true;
+        IEEE80211_ADDR_COPY(resumeTarget.bssid, ic->ic_bss->ni_bssid);
+        resumeTarget.esslen = ic->ic_bss->ni_esslen;
+        memcpy(resumeTarget.essid, ic->ic_bss->ni_essid, resumeTarget.esslen);
+    }
+    unpinResumeTarget();
+    resumeStart = 0;
+    armWowlan();
     disableAdapter(fNetIf);
     pmPolicyMaker->acknowledgeSetPowerState();
 }
 
+/*
+ * Only for an associated sleep: without a BSS there is nothing to receive
+ * a magic packet or a deauth from. PME is enabled in the PCI PM control
+ * register so the wake reaches the host; restorePCIState() clears it.
+ */
+void BCMWLANFirmware_Hashstore::armWowlan()
+{
+    struct ieee80211com *ic = fHalService->get80211Controller();
+    struct ItlWowConfig *config;
+    IOReturn ret;
+    
+    if (!magicPacketSupported || ic->ic_state != IEEE80211_S_RUN || ic->ic_bss == NULL) {
+        return;
+    }
+    config = (struct ItlWowConfig *)IOMalloc(sizeof(*config));
+    if (config == NULL) {
+        return;
+    }
+    if (fWowlan.buildConfig(config, fHalService->getDriverInfo()->getWoWLANSupport(), ic->ic_bss->ni_replaycnt)) {
+        ret = fHalService->getDriverController()->setWoWLAN(config);
+        fWowlan.armed(ret == kIOReturnSuccess);
+        if (ret == kIOReturnSuccess) {
+            pciNub->configWrite16(pmPCICapPtr + 4, 0x0100);
+            XYLog("%s triggers=0x%x patterns=%u rekey=%d\n", __FUNCTION__, config->triggers, config->patternCount, config->rekey);
+        } else {
+            XYLog("%s failed 0x%x, powering off\n", __FUNCTION__, ret);
+        }
+    }
+    // the KCK/KEK copy is not needed anymore
+    bzero(config, sizeof(*config));
+    IOFree(config, sizeof(*config));
+}
+
+void BCMWLANFirmware_Hashstore::reportWake()
+{
+    int reason;
+    
+    if (!fWowlan.wasArmed()) {
+        return;
+    }
+    reason = fHalService->getDriverController()->getWakeReason();
+    fHalService->getDriverController()->setWoWLAN(NULL);
+    fWowlan.recordWake(reason);
+    XYLog("%s wake reason: %s (%d)\n", __FUNCTION__, ItlWowlan::reasonName(reason), reason);
+}
+
+/*
+ * Runs without the gate, see ItlDriverController::prepareFirmware(). The
+ * image is pulled into the firmware cache here, so the upload in enable()
+ * finds it inflated even when the cache lifetime ran out during sleep.
+ */
+void BCMWLANFirmware_Hashstore::resumePrepare()
+{
+    uint64_t start = mach_absolute_time();
+    const char *name = fHalService->getDriverInfo()->getFirmwareName();
+    OSData *fw = name ? getFWCached(name) : NULL;
+    
+    OSSafeReleaseNULL(fw);
+    fHalService->getDriverController()->prepareFirmware();
+    resumeStats.firmwareUS = elapsedUS(start, mach_absolute_time());
+    IOLockLock(resumeLock);
+    resumePreparing = false;
+    IOLockWakeup(resumeLock, &resumePreparing, false);
+    IOLockUnlock(resumeLock);
+}
+
+void BCMWLANFirmware_Hashstore::restorePCIState()
+{
+    if (pmPCICapPtr) {
+        // D0, PME status cleared as in initPCIPowerManagment
+        pciNub->configWrite16(pmPCICapPtr + 4, 0x8000);
+    }
+    pciNub->configWrite16(kIOPCIConfigCommand, pmPCICommand);
+    pciNub->configWrite8(0x41, 0);
+}
+
+/*
+ * Point the auto join at the BSS we slept on, so the first scan after wake
+ * goes straight to it instead of ranking candidates. Only done when that
+ * ESS is still the selected one and nobody asked for a BSSID already.
+ */
+void BCMWLANFirmware_Hashstore::pinResumeTarget()
+{
+    struct ieee80211com *ic = fHalService->get80211Controller();
+    
+    if (!resumeTarget.valid || (ic->ic_flags & IEEE80211_F_DESBSSID) ||
+        ic->ic_des_esslen != resumeTarget.esslen ||
+        memcmp(ic->ic_des_essid, resumeTarget.essid, resumeTarget.esslen) != 0) {
+        return;
+    }
+    IEEE80211_ADDR_COPY(ic->ic_des_bssid, resumeTarget.bssid);
+    ic->ic_flags |= IEEE80211_F_DESBSSID;
+    resumeTarget.pinned = true;
+}
+
+void BCMWLANFirmware_Hashstore::unpinResumeTarget()
+{
+    struct ieee80211com *ic = fHalService->get80211Controller();
+    
+    if (!resumeTarget.pinned) {
+        return;
+    }
+    resumeTarget.pinned = false;
+    // an association request may have picked its own BSSID meanwhile
+    if ((ic->ic_flags & IEEE80211_F_DESBSSID) && IEEE80211_ADDR_EQ(ic->ic_des_bssid, resumeTarget.bssid)) {
+        memset(ic->ic_des_bssid, 0, IEEE80211_ADDR_LEN);
+        ic->ic_flags &= ~IEEE80211_F_DESBSSID;
+    }
+}
+
+/*
+ * PCI restore, firmware preparation (started from setPowerState on its
+ * own thread), firmware upload and calibration, then reassociation to the
+ * last BSS. The ack goes out as soon as the device is back in D0 and the
+ * image is ready; the upload may take longer than the 5 s power change
+ * window, so it runs after the ack, still behind the gate. Link up is
+ * timed separately from the watchdog and setLinkStatus.
+ */
 void BCMWLANFirmware_Hashstore::setPowerStateOn()
 {
+    uint64_t start = mach_absolute_time();
+    uint64_t stage = start;
+    uint64_t now;
+    
     XYLog("%s\n", __FUNCTION__);
     pmPowerState = kPowerStateOn;
+    resumeStats.resumes++;
+    restorePCIState();
+    now = mach_absolute_time();
+    resumeStats.pciUS = elapsedUS(stage, now);
+    stage = now;
+    if (resumeLock) {
+        IOLockLock(resumeLock);
+        while (resumePreparing) {
+            IOLockSleep(resumeLock, &resumePreparing, THREAD_UNINT);
+        }
+        IOLockUnlock(resumeLock);
+    }
+    now = mach_absolute_time();
+    resumeStats.firmwareWaitUS = elapsedUS(stage, now);
+    stage = now;
+    reportWake();
+    resumeStats.ackUS = elapsedUS(start, mach_absolute_time());
     pmPolicyMaker->acknowledgeSetPowerState();
+    stage = mach_absolute_time();
+    resumeStats.linkMS = 0;
+    if (power_state && fNetIf) {
+        pinResumeTarget();
+        resumeStart = resumeTarget.valid ? start : 0;
+        enableAdapter(fNetIf);
+        resumeStats.enableUS = elapsedUS(stage, mach_absolute_time());
+    } else {
+        resumeStats.enableUS = 0;
+    }
+    XYLog("%s pci=%uus firmware=%uus (waited %uus) ack=%uus enable=%uus\n", __FUNCTION__,
+          resumeStats.pciUS, resumeStats.firmwareUS, resumeStats.firmwareWaitUS, resumeStats.ackUS, resumeStats.enableUS);
 }
 
 #if __IO80211_TARGET >= __MAC_10_11
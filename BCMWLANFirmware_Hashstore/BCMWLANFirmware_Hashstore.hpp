@@ -26,6 +26,16 @@
 #include "ItlIwn.hpp"
 
 #include "BCMWLANFirmware_HashstoreInterface.hpp"
+#include "ItlAmsdu.hpp"
+#include "ItlIoctlStats.hpp"
+#include "ItlEventCoalescer.hpp"
+#include "ItlCommandQueue.hpp"
+#include "ItlRoamEngine.hpp"
+#include "ItlPmksaCache.hpp"
+#include "ItlPowerSave.hpp"
+#include "ItlWowlan.hpp"
+#include "ItlHousekeeping.hpp"
+#include "FwData.h"
 
 enum
 {
@@ -35,24 +45,55 @@ enum
 };
 
 #define kWatchDogTimerPeriod 1000
+#define kItlResumeJoinTimeoutMS 10000
+#define kItlRoamTimeoutMS 10000
+#define kLinkSpeedUpdateIntervalMS 5000
+
+struct ItlRoamStats {
+    uint32_t attempts;      /* reassociations started by setROAM */
+    uint32_t completed;
+    uint32_t failures;      /* no link up within kItlRoamTimeoutMS */
+    uint32_t misses;        /* target not in the scan cache, left to a full scan */
+    uint32_t scans;         /* background scans started by the roam engine */
+    uint32_t lastMS;        /* setROAM to link up */
+    uint32_t maxMS;
+    uint64_t totalMS;
+};
+
+/* Why the on demand watchdog ran, see BCMWLANFirmware_Hashstore::watchdogTick(). */
+struct ItlWatchdogStats {
+    uint32_t arms;          /* armed by a frame or a management timer */
+    uint32_t disarms;       /* Tx drained and no management timer left */
+    uint32_t fires;
+    uint32_t txFires;       /* frames were outstanding */
+    uint32_t txStalls;      /* ... and nothing completed since the last fire */
+    uint32_t mgmtFires;     /* a net80211 management timer was running */
+    uint32_t idleFires;     /* everything drained since it was armed */
+};
+
+/* Stages of setPowerStateOn, in microseconds unless noted. */
+struct ItlResumeStats {
+    uint32_t resumes;
+    uint32_t pciUS;             /* PCI config space restore */
+    uint32_t firmwareUS;        /* prepareFirmware, overlaps the PCI stage */
+    uint32_t firmwareWaitUS;    /* left of it after the PCI stage */
+    uint32_t ackUS;             /* up to the power ack */
+    uint32_t enableUS;          /* firmware upload and calibration in the driver, after the ack */
+    uint32_t linkMS;            /* up to link up, 0 when it did not reassociate */
+    uint32_t maxLinkMS;
+};
+
+/* BSS to go back to after wake, kept across the adapter reset. */
+struct ItlResumeTarget {
+    bool valid;
+    bool pinned;                /* we set IEEE80211_F_DESBSSID for it */
+    uint8_t bssid[IEEE80211_ADDR_LEN];
+    uint8_t essid[IEEE80211_NWID_LEN];
+    uint8_t esslen;
+};
 
 class BCMWLANFirmware_Hashstore : public IO80211Controller {
     OSDeclareDefaultStructors(BCMWLANFirmware_Hashstore)
-#define IOCTL(REQ_TYPE, REQ, DATA_TYPE) \
-if (REQ_TYPE == SIOCGA80211) { \
-ret = get##REQ(interface, (struct DATA_TYPE* )data); \
-} else { \
-ret = set##REQ(interface, (struct DATA_TYPE* )data); \
-}
-    
-#define IOCTL_GET(REQ_TYPE, REQ, DATA_TYPE) \
-if (REQ_TYPE == SIOCGA80211) { \
-ret = get##REQ(interface, (struct DATA_TYPE* )data); \
-}
-#define IOCTL_SET(REQ_TYPE, REQ, DATA_TYPE) \
-if (REQ_TYPE == SIOCSA80211) { \
-ret = set##REQ(interface, (struct DATA_TYPE* )data); \
-}
 #define FUNC_IOCTL(REQ, DATA_TYPE) \
 FUNC_IOCTL_GET(REQ, DATA_TYPE) \
 FUNC_IOCTL_SET(REQ, DATA_TYPE)
@@ -87,16 +128,49 @@ public:
                                OSData *                data         = 0) override;
     
     static IOReturn setLinkStateGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+    static IOReturn queueEventGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+    static IOReturn roamScanDoneGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+    static IOReturn updateLinkSpeedGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+    static IOReturn interruptModerationGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+    static IOReturn kickWatchdogGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+    static IOReturn kickPowerSaveGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
     
 #ifdef __PRIVATE_SPI__
     virtual IOReturn outputStart(IONetworkInterface *interface, IOOptionBits options) override;
 #endif
     
     void releaseAll();
+    void detachHal();
     void associateSSID(uint8_t *ssid, uint32_t ssid_len, const struct ether_addr &bssid, uint32_t authtype_lower, uint32_t authtype_upper, uint8_t *key, uint32_t key_len, int key_index);
     void setPTK(const u_int8_t *key, size_t key_len);
     void setGTK(const u_int8_t *key, size_t key_len, u_int8_t kid, u_int8_t *rsc);
-    void watchdogAction(IOTimerEventSource *timer);
+    static uint64_t nowMS();
+    void housekeepingAction(IOTimerEventSource *timer);
+    void armHousekeeping();
+    uint32_t linkTasks();
+    void armLinkTasks(bool linkUp);
+    void kickWatchdog();
+    void watchdogTick();
+    void amsduFlushAction(IOTimerEventSource *timer);
+    void eventFlushAction(IOTimerEventSource *timer);
+    void powerSaveTick();
+    void kickPowerSave();
+    void commandAction(IOInterruptEventSource *sender, int count);
+    void queueLinkState(IO80211LinkState state, unsigned int reason);
+    void queueMessage(int code);
+    void deliverEvents();
+    void roamTick();
+    void roamHousekeeping();
+    void roamScanDone();
+    void roamTo(struct ieee80211_node *ni);
+    bool roamPending(uint64_t *elapsedMS);
+    void applyPmksa(struct ieee80211_node *ni);
+    void setPMKSA(struct apple80211_key *key);
+    void updateAmsduPeer();
+    void updateLinkSpeed();
+    uint32_t currentTxRate();
+    const IONetworkMedium *mediumForRate(uint32_t rate);
+    bool enqueueTxPackets(struct _ifnet *ifp, mbuf_t m);
     bool initPCIPowerManagment(IOPCIDevice *provider);
     static IOReturn tsleepHandler(OSObject* owner, void* arg0 = 0, void* arg1 = 0, void* arg2 = 0, void* arg3 = 0);
     static void eventHandler(struct ieee80211com *, int, void *);
@@ -122,6 +196,7 @@ public:
     virtual SInt32 disableVirtualInterface(IO80211VirtualInterface *interface) override;
     virtual IO80211VirtualInterface* createVirtualInterface(ether_addr *eth,uint role) override;
     virtual SInt32 apple80211VirtualRequest(uint request_type, int request_number,IO80211VirtualInterface *interface,void *data) override;
+    SInt32 dispatchIoctl(unsigned int request_type, int request_number, OSObject *interface, void *data, bool isVirtual);
     virtual SInt32 stopDMA() override;
     virtual UInt32 hardwareOutputQueueDepth(IO80211Interface* interface) override;
     virtual SInt32 performCountryCodeOperation(IO80211Interface* interface, IO80211CountryCodeOp op) override;
@@ -150,7 +225,7 @@ public:
     FUNC_IOCTL_GET(OP_MODE, apple80211_opmode_data)
     FUNC_IOCTL_GET(RSSI, apple80211_rssi_data)
     FUNC_IOCTL_GET(NOISE, apple80211_noise_data)
-    FUNC_IOCTL_GET(INT_MIT, apple80211_intmit_data)
+    FUNC_IOCTL(INT_MIT, apple80211_intmit_data)
     FUNC_IOCTL(POWER, apple80211_power_data)
     FUNC_IOCTL_SET(ASSOCIATE, apple80211_assoc_data)
     FUNC_IOCTL_GET(ASSOCIATE_RESULT, apple80211_assoc_result_data)
@@ -176,7 +251,7 @@ public:
     FUNC_IOCTL_SET(VIRTUAL_IF_CREATE, apple80211_virt_if_create_data)
     FUNC_IOCTL_SET(VIRTUAL_IF_DELETE, apple80211_virt_if_delete_data)
     FUNC_IOCTL_GET(ROAM_THRESH, apple80211_roam_threshold_data)
-    FUNC_IOCTL_GET(POWERSAVE, apple80211_powersave_data)
+    FUNC_IOCTL(POWERSAVE, apple80211_powersave_data)
     FUNC_IOCTL_SET(CIPHER_KEY, apple80211_key)
     FUNC_IOCTL_SET(SCANCACHE_CLEAR, apple80211req)
     FUNC_IOCTL(TX_NSS, apple80211_tx_nss_data)
@@ -225,30 +300,64 @@ public:
     virtual IOReturn setWakeOnMagicPacket( bool active ) override;
     void setPowerStateOff(void);
     void setPowerStateOn(void);
+    void armWowlan();
+    void reportWake();
+    void resumePrepare(void);
     void unregistPM();
+    void restorePCIState();
+    void pinResumeTarget();
+    void unpinResumeTarget();
     
     bool createMediumTables(const IONetworkMedium **primary);
     virtual IOReturn getPacketFilters(const OSSymbol *group, UInt32 *filters) const override;
     virtual IOReturn selectMedium(const IONetworkMedium *medium) override;
     virtual UInt32 getFeatures() const override;
+    virtual IOReturn getChecksumSupport(UInt32 *checksumMask, UInt32 checksumFamily, bool isOutput) override;
+    virtual IOReturn setProperties(OSObject *properties) override;
+    virtual bool serializeProperties(OSSerialize *serialize) const override;
+    virtual IOReturn callPlatformFunction(const OSSymbol *functionName, bool waitForFunction,
+                                          void *param1, void *param2, void *param3, void *param4) override;
     
 public:
     IOInterruptEventSource* fInterrupt;
-    IOTimerEventSource *watchdogTimer;
+    IOTimerEventSource *housekeepingTimer;
+    ItlHousekeeping fHousekeeping;
+    volatile bool watchdogArmed;    /* hint for the output path, the wheel is authoritative */
+    uint64_t watchdogOutput;        /* outputPackets at the last fire */
+    struct ItlWatchdogStats watchdogStats;
     IOPCIDevice *pciNub;
     IONetworkStats *fpNetStats;
     BCMWLANFirmware_HashstoreInterface *fNetIf;
-    IOWorkLoop *fWatchdogWorkLoop;
+    bool rxLro;
     ItlHalService *fHalService;
     
+    //tx aggregation
+    ItlAmsdu fAmsdu;
+    ItlIoctlStats fIoctlStats;
+    IOTimerEventSource *amsduTimer;
+    ItlEventCoalescer fEvents;
+    IOTimerEventSource *eventTimer;
+    uint32_t eventWindowMS;
+    ItlCommandQueue fCommands;
+    IOInterruptEventSource *commandSource;
+    ItlPowerSave fPowerSave;
+    
     //pm
     thread_call_t powerOnThreadCall;
     thread_call_t powerOffThreadCall;
     UInt32 pmPowerState;
     IOService *pmPolicyMaker;
     UInt8 pmPCICapPtr;
+    UInt16 pmPCICommand;
+    thread_call_t resumePrepareThreadCall;
+    IOLock *resumeLock;
+    bool resumePreparing;
+    uint64_t resumeStart;
+    struct ItlResumeStats resumeStats;
+    struct ItlResumeTarget resumeTarget;
     bool magicPacketEnabled;
     bool magicPacketSupported;
+    ItlWowlan fWowlan;
     
     //IO80211
     uint8_t power_state;
@@ -261,6 +370,10 @@ public:
     UInt64 currentSpeed;
     UInt32 currentStatus;
     bool disassocIsVoluntary;
+    struct ItlRoamStats roamStats;
+    ItlRoamEngine fRoam;
+    ItlPmksaCache fPmksa;
+    uint64_t roamStart;
     
     IO80211P2PInterface *fP2PDISCInterface;
     IO80211P2PInterface *fP2PGOInterface;
@@ -275,6 +388,5 @@ public:
     uint32_t awdlPresenceMode;
     uint16_t awdlMasterChannel;
     uint16_t awdlSecondaryMasterChannel;
-    uint8_t *roamProfile;
     bool awdlSyncEnable;
 };
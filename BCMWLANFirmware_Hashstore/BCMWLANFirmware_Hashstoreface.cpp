@@ -11,41 +11,142 @@
 #define super IO80211Interface
 OSDefineMetaClassAndStructors(BCMWLANFirmware_HashstoreInterface, IO80211Interface);
 
-const char* hexdump(uint8_t *buf, size_t len)
+uint32_t itlwm_debug_flags = APPLE80211_DEBUG_FLAG_ERROR;
+
+const char *hexdump(char *out, size_t outLen, const uint8_t *buf, size_t len)
 {
-    ssize_t str_len = len * 3 + 1;
-    char *str = (char*)IOMalloc(str_len);
-    if (!str)
-        return nullptr;
-    for (size_t i = 0; i < len; i++)
-    snprintf(str + 3 * i, (len - i) * 3, "%02x ", buf[i]);
-    str[MAX(str_len - 2, 0)] = 0;
-    return str;
+    static const char digits[] = "0123456789abcdef";
+    size_t pos = 0;
+    size_t i;
+
+    if (outLen == 0)
+        return out;
+    for (i = 0; i < len && i < HEXDUMP_MAX_BYTES && pos + 4 <= outLen; i++) {
+        out[pos++] = digits[buf[i] >> 4];
+        out[pos++] = digits[buf[i] & 0xf];
+        out[pos++] = ' ';
+    }
+    if (i < len && pos + 4 <= outLen) {
+        out[pos++] = '.';
+        out[pos++] = '.';
+        out[pos++] = '.';
+    } else if (pos > 0) {
+        pos--;
+    }
+    out[pos] = 0;
+    return out;
 }
 
 bool BCMWLANFirmware_HashstoreInterface::
-init(IO80211Controller *controller, ItlHalService *halService)
+init(IO80211Controller *controller, ItlHalService *halService, bool lro)
 {
     if (!super::init(controller)) {
         return false;
     }
     this->fHalService = halService;
+    this->fRxHead = this->fRxTail = NULL;
+    this->fRxParam = NULL;
+    this->fLro.init(lro);
     return true;
 }
 
+bool BCMWLANFirmware_HashstoreInterface::
+isEapolPacket(mbuf_t packet)
+{
+    ether_header_t *eh = (ether_header_t *)mbuf_data(packet);
+    return mbuf_len(packet) >= sizeof(ether_header_t) && eh->ether_type == htons(ETHERTYPE_PAE);
+}
+
 UInt32 BCMWLANFirmware_HashstoreInterface::
-inputPacket(mbuf_t packet, UInt32 length, IOOptionBits options, void *param)
+inputEapolPacket(mbuf_t packet, void *param)
 {
-    ether_header_t *eh;
     size_t len = mbuf_len(packet);
-    
-    eh = (ether_header_t *)mbuf_data(packet);
-    if (len >= sizeof(ether_header_t) && eh->ether_type == htons(ETHERTYPE_PAE)) { // EAPOL packet
-        const char* dump = hexdump((uint8_t*)mbuf_data(packet), len);
-        IOLog("itlwm: input EAPOL packet, len: %zu, data: %s\n", len, dump ? dump : "Failed to allocate memory");
-        if (dump)
-            IOFree((void*)dump, 3 * len + 1);
-        return IO80211Interface::inputPacket(packet, (UInt32)len, 0, param);
+    if (itlwm_debug_flags & APPLE80211_DEBUG_FLAG_RSN) {
+        char dump[HEXDUMP_BUF_LEN];
+        IOLog("itlwm: input EAPOL packet, len: %zu, data: %s\n", len, hexdump(dump, sizeof(dump), (uint8_t*)mbuf_data(packet), len));
+    }
+    return IO80211Interface::inputPacket(packet, (UInt32)len, 0, param);
+}
+
+UInt32 BCMWLANFirmware_HashstoreInterface::
+inputPacket(mbuf_t packet, UInt32 length, IOOptionBits options, void *param)
+{
+    if (options & kInputOptionQueuePacket) {
+        // same length rule as IONetworkInterface, which only applies it to single buffers
+        if (length && mbuf_next(packet) == NULL) {
+            mbuf_setlen(packet, length);
+            mbuf_pkthdr_setlen(packet, length);
+        }
+        mbuf_setnextpkt(packet, NULL);
+        if (this->fRxTail) {
+            mbuf_setnextpkt(this->fRxTail, packet);
+        } else {
+            this->fRxHead = packet;
+        }
+        this->fRxTail = packet;
+        this->fRxParam = param;
+        return 0;
+    }
+    if (isEapolPacket(packet)) { // EAPOL packet
+        return inputEapolPacket(packet, param);
     }
     return IOEthernetInterface::inputPacket(packet, length, options, param);
 }
+
+UInt32 BCMWLANFirmware_HashstoreInterface::
+flushInputQueue()
+{
+    mbuf_t chain = this->fRxHead;
+    
+    if (chain == NULL) {
+        return super::flushInputQueue();
+    }
+    this->fRxHead = this->fRxTail = NULL;
+    return inputPacketChain(chain, this->fRxParam);
+}
+
+UInt32 BCMWLANFirmware_HashstoreInterface::
+clearInputQueue()
+{
+    UInt32 count = 0;
+    
+    if (this->fRxHead) {
+        for (mbuf_t packet = this->fRxHead; packet != NULL; packet = mbuf_nextpkt(packet)) {
+            count++;
+        }
+        mbuf_freem_list(this->fRxHead);
+        this->fRxHead = this->fRxTail = NULL;
+    }
+    return count + super::clearInputQueue();
+}
+
+UInt32 BCMWLANFirmware_HashstoreInterface::
+inputPacketChain(mbuf_t chain, void *param)
+{
+    UInt32 count = 0;
+    UInt32 queued = 0;
+    mbuf_t next;
+    
+    if (this->fLro.isEnabled()) {
+        chain = this->fLro.coalesce(chain);
+    }
+    for (mbuf_t packet = chain; packet != NULL; packet = next) {
+        next = mbuf_nextpkt(packet);
+        mbuf_setnextpkt(packet, NULL);
+        if (isEapolPacket(packet)) {
+            // deliver what came before the handshake frame first to keep ordering
+            if (queued) {
+                count += super::flushInputQueue();
+                queued = 0;
+            }
+            count += inputEapolPacket(packet, param);
+            continue;
+        }
+        IOEthernetInterface::inputPacket(packet, 0, kInputOptionQueuePacket, param);
+        queued++;
+    }
+    if (queued) {
+        count += super::flushInputQueue();
+    }
+    return count;
+}
@@ -15,6 +15,23 @@
 #include <sys/kernel_types.h>
 #include <HAL/ItlHalService.hpp>
 
+#include "ItlLro.hpp"
+
+/*
+ * APPLE80211_DEBUG_FLAG_* bits, initialised from the itlwm_debug boot-arg
+ * and changeable at runtime through the controller's DebugFlags property.
+ */
+extern uint32_t itlwm_debug_flags;
+
+#define HEXDUMP_MAX_BYTES   64
+#define HEXDUMP_BUF_LEN     (HEXDUMP_MAX_BYTES * 3 + 4)
+
+/*
+ * Formats at most HEXDUMP_MAX_BYTES of buf into out without allocating,
+ * longer buffers end with "...". Returns out.
+ */
+const char *hexdump(char *out, size_t outLen, const uint8_t *buf, size_t len);
+
 class BCMWLANFirmware_HashstoreInterface : public IO80211Interface {
     OSDeclareDefaultStructors(BCMWLANFirmware_HashstoreInterface)
     
@@ -25,10 +42,39 @@ public:
                                  IOOptionBits    options = 0,
                                  void *          param   = 0 ) override;
 
-    bool init(IO80211Controller *controller, ItlHalService *halService);
+    /*
+     * Packets input with kInputOptionQueuePacket, which is how if_input()
+     * hands up each mbuf_list from the HAL, are held here and go through
+     * inputPacketChain() when the list is flushed.
+     */
+    virtual UInt32 flushInputQueue() override;
+
+    virtual UInt32 clearInputQueue() override;
+
+    /*
+     * Batched receive: packets are linked through mbuf_nextpkt. EAPOL frames
+     * still go through IO80211Interface one by one, everything else is
+     * queued and handed to the stack with a single flush. Returns the number
+     * of packets accepted by the stack. In order TCP segments are coalesced
+     * first when LRO is enabled.
+     */
+    UInt32 inputPacketChain(mbuf_t chain, void *param = 0);
+
+    bool init(IO80211Controller *controller, ItlHalService *halService, bool lro);
+
+    void getLroStats(struct ItlLroStats *out) const { fLro.getStats(out); }
+
+private:
+    static bool isEapolPacket(mbuf_t packet);
+
+    UInt32 inputEapolPacket(mbuf_t packet, void *param);
 
 private:
     ItlHalService *fHalService;
+    ItlLro fLro;
+    mbuf_t fRxHead;
+    mbuf_t fRxTail;
+    void *fRxParam;
 };
 
 #endif /* BCMWLANFirmware_HashstoreInterface_hpp */
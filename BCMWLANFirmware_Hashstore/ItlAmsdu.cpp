@@ -0,0 +1,291 @@
+//
+//  ItlAmsdu.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Tx A-MSDU builder sitting between outputPacket and the HAL send queue.
+//
+
+#include "ItlAmsdu.hpp"
+
+#include <libkern/OSByteOrder.h>
+#include <kern/clock.h>
+
+static const uint8_t amsduPad[4] = { 0, 0, 0, 0 };
+
+bool ItlAmsdu::
+init(uint32_t maxLength, uint32_t smallFrame, uint32_t budgetUS)
+{
+    this->lock = IOSimpleLockAlloc();
+    if (this->lock == NULL) {
+        return false;
+    }
+    if (mbuf_tag_id_find(kItlAmsduTagName, &this->tagId) != 0) {
+        IOSimpleLockFree(this->lock);
+        this->lock = NULL;
+        return false;
+    }
+    this->maxLength = maxLength;
+    this->smallFrame = smallFrame;
+    this->peerMaxLength = 0;
+    nanoseconds_to_absolutetime((uint64_t)budgetUS * 1000, &this->budget);
+    this->pendingHead = this->pendingTail = NULL;
+    this->pendingCount = 0;
+    this->pendingLength = 0;
+    this->pendingDeadline = 0;
+    bzero(&this->stats, sizeof(this->stats));
+    return true;
+}
+
+void ItlAmsdu::
+free()
+{
+    if (this->lock == NULL) {
+        return;
+    }
+    IOSimpleLockLock(this->lock);
+    dropPendingLocked();
+    IOSimpleLockUnlock(this->lock);
+    IOSimpleLockFree(this->lock);
+    this->lock = NULL;
+}
+
+void ItlAmsdu::
+setPeer(const uint8_t *ra, uint32_t peerMaxLength)
+{
+    if (this->lock == NULL) {
+        return;
+    }
+    IOSimpleLockLock(this->lock);
+    if (ra) {
+        memcpy(this->ra, ra, ETHER_ADDR_LEN);
+    }
+    this->peerMaxLength = ra ? min(this->maxLength, peerMaxLength) : 0;
+    IOSimpleLockUnlock(this->lock);
+}
+
+bool ItlAmsdu::
+canAggregate(mbuf_t m, size_t len, uint8_t tid, struct ether_header *eh)
+{
+    if (!isEnabled() || tid != 0 || len <= ETHER_HDR_LEN || len > this->smallFrame ||
+        itlAmsduSubframeLength((uint32_t)len) > this->peerMaxLength) {
+        return false;
+    }
+    if (mbuf_copydata(m, 0, ETHER_HDR_LEN, eh) != 0) {
+        return false;
+    }
+    // keep the 4-way handshake out of aggregates, some APs drop A-MSDU EAPOL
+    return eh->ether_type != htons(ETHERTYPE_PAE);
+}
+
+static mbuf_t appendPacket(mbuf_t head, mbuf_t m)
+{
+    mbuf_t tail;
+
+    if (m == NULL) {
+        return head;
+    }
+    if (head == NULL) {
+        return m;
+    }
+    for (tail = head; mbuf_nextpkt(tail) != NULL; tail = mbuf_nextpkt(tail));
+    mbuf_setnextpkt(tail, m);
+    return head;
+}
+
+mbuf_t ItlAmsdu::
+enqueue(mbuf_t m, uint8_t tid)
+{
+    struct ether_header eh;
+    mbuf_t out = NULL;
+    size_t len = mbuf_pkthdr_len(m);
+    uint32_t newLength;
+
+    IOSimpleLockLock(this->lock);
+    if (!canAggregate(m, len, tid, &eh)) {
+        // anything queued before this frame has to leave first
+        out = appendPacket(closeLocked(), m);
+        this->stats.bypassed++;
+        IOSimpleLockUnlock(this->lock);
+        return out;
+    }
+    newLength = itlAmsduAppendLength(this->pendingLength, (uint32_t)len);
+    if (this->pendingCount > 0) {
+        if (tid != this->pendingTid || newLength > this->peerMaxLength ||
+            memcmp(this->pendingSrc, eh.ether_shost, ETHER_ADDR_LEN) != 0) {
+            out = closeLocked();
+            newLength = itlAmsduAppendLength(0, (uint32_t)len);
+        }
+    }
+    if (this->pendingCount == 0) {
+        this->pendingTid = tid;
+        memcpy(this->pendingSrc, eh.ether_shost, ETHER_ADDR_LEN);
+        this->pendingDeadline = mach_absolute_time() + this->budget;
+        this->pendingHead = this->pendingTail = m;
+    } else {
+        mbuf_setnextpkt(this->pendingTail, m);
+        this->pendingTail = m;
+    }
+    this->pendingCount++;
+    this->pendingLength = newLength;
+    if (this->pendingCount == kItlAmsduMaxSubframes) {
+        out = appendPacket(out, closeLocked());
+    }
+    IOSimpleLockUnlock(this->lock);
+    return out;
+}
+
+mbuf_t ItlAmsdu::
+flush()
+{
+    mbuf_t out;
+
+    if (this->lock == NULL) {
+        return NULL;
+    }
+    IOSimpleLockLock(this->lock);
+    out = closeLocked();
+    IOSimpleLockUnlock(this->lock);
+    return out;
+}
+
+mbuf_t ItlAmsdu::
+flushExpired(uint64_t now)
+{
+    mbuf_t out = NULL;
+
+    if (this->lock == NULL) {
+        return NULL;
+    }
+    IOSimpleLockLock(this->lock);
+    if (this->pendingCount > 0 && now >= this->pendingDeadline) {
+        this->stats.timerFlushes++;
+        out = closeLocked();
+    }
+    IOSimpleLockUnlock(this->lock);
+    return out;
+}
+
+mbuf_t ItlAmsdu::
+closeLocked()
+{
+    mbuf_t out;
+
+    if (this->pendingCount == 0) {
+        return NULL;
+    }
+    if (this->pendingCount == 1) {
+        out = this->pendingHead;
+        this->stats.bypassed++;
+    } else if ((out = buildLocked()) != NULL) {
+        mbuf_freem_list(this->pendingHead);
+        this->stats.aggregates++;
+        this->stats.subframes += this->pendingCount;
+    } else {
+        // no memory for the aggregate, the frames still go out one by one
+        out = this->pendingHead;
+        this->stats.allocFailures++;
+        this->stats.bypassed += this->pendingCount;
+    }
+    this->pendingHead = this->pendingTail = NULL;
+    this->pendingCount = 0;
+    this->pendingLength = 0;
+    this->pendingDeadline = 0;
+    return out;
+}
+
+/*
+ * Layout of the packet handed to the HAL:
+ *
+ *   | RA | SA | 0 |                                   Ethernet header for encap
+ *   | DA | SA | len | AA AA 03 00 00 00 | type | payload | pad to 4 |   subframe 1
+ *   ...
+ *   | DA | SA | len | AA AA 03 00 00 00 | type | payload |             last subframe
+ */
+mbuf_t ItlAmsdu::
+buildLocked()
+{
+    mbuf_t agg;
+    mbuf_t f;
+    mbuf_t n;
+    struct ether_header eh;
+    uint8_t hdr[kItlAmsduSubframeHdrLen];
+    size_t off = 0;
+    size_t skip;
+    size_t flen;
+    size_t pad;
+    uint8_t *count;
+
+    if (mbuf_gethdr(MBUF_DONTWAIT, MBUF_TYPE_DATA, &agg) != 0) {
+        return NULL;
+    }
+    memcpy(eh.ether_dhost, this->ra, ETHER_ADDR_LEN);
+    memcpy(eh.ether_shost, this->pendingSrc, ETHER_ADDR_LEN);
+    eh.ether_type = 0;
+    if (mbuf_copyback(agg, off, ETHER_HDR_LEN, &eh, MBUF_DONTWAIT) != 0) {
+        goto fail;
+    }
+    off += ETHER_HDR_LEN;
+    for (f = this->pendingHead; f != NULL; f = mbuf_nextpkt(f)) {
+        flen = mbuf_pkthdr_len(f);
+        mbuf_copydata(f, 0, ETHER_HDR_LEN, &eh);
+        itlAmsduSubframeHeader(hdr, (const uint8_t *)&eh, (uint32_t)flen);
+        if (mbuf_copyback(agg, off, sizeof(hdr), hdr, MBUF_DONTWAIT) != 0) {
+            goto fail;
+        }
+        off += sizeof(hdr);
+        skip = ETHER_HDR_LEN;
+        for (n = f; n != NULL; n = mbuf_next(n)) {
+            size_t nlen = mbuf_len(n);
+            if (nlen <= skip) {
+                skip -= nlen;
+                continue;
+            }
+            if (mbuf_copyback(agg, off, nlen - skip, (uint8_t *)mbuf_data(n) + skip, MBUF_DONTWAIT) != 0) {
+                goto fail;
+            }
+            off += nlen - skip;
+            skip = 0;
+        }
+        // subframes are aligned relative to the A-MSDU, not to our leading header
+        pad = itlAmsduPad((uint32_t)(off - ETHER_HDR_LEN));
+        if (mbuf_nextpkt(f) != NULL && pad != 0) {
+            if (mbuf_copyback(agg, off, pad, amsduPad, MBUF_DONTWAIT) != 0) {
+                goto fail;
+            }
+            off += pad;
+        }
+    }
+    if (mbuf_tag_allocate(agg, this->tagId, kItlAmsduTagType, sizeof(*count), MBUF_DONTWAIT, (void **)&count) != 0) {
+        goto fail;
+    }
+    *count = (uint8_t)this->pendingCount;
+    mbuf_set_traffic_class(agg, mbuf_get_traffic_class(this->pendingHead));
+    return agg;
+
+fail:
+    mbuf_freem(agg);
+    return NULL;
+}
+
+void ItlAmsdu::
+drop()
+{
+    if (this->lock == NULL) {
+        return;
+    }
+    IOSimpleLockLock(this->lock);
+    dropPendingLocked();
+    IOSimpleLockUnlock(this->lock);
+}
+
+void ItlAmsdu::
+dropPendingLocked()
+{
+    if (this->pendingHead) {
+        mbuf_freem_list(this->pendingHead);
+    }
+    this->pendingHead = this->pendingTail = NULL;
+    this->pendingCount = 0;
+    this->pendingLength = 0;
+    this->pendingDeadline = 0;
+}
@@ -0,0 +1,102 @@
+//
+//  ItlAmsdu.hpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Tx A-MSDU builder sitting between outputPacket and the HAL send queue.
+//
+
+#ifndef ItlAmsdu_hpp
+#define ItlAmsdu_hpp
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <sys/kpi_mbuf.h>
+#include <net/ethernet.h>
+#include "HAL/ItlHalService.hpp"
+#include "ItlAmsduLayout.hpp"
+
+#define kItlAmsduDefaultMaxLength   3839    /* smallest A-MSDU every HT peer must accept */
+#define kItlAmsduDefaultSmallFrame  400     /* only frames up to this length are coalesced */
+#define kItlAmsduDefaultBudgetUS    250     /* max time a frame may wait for company */
+#define kItlAmsduMaxSubframes       8
+
+struct ItlAmsduStats {
+    uint64_t aggregates;    /* A-MSDUs handed to the HAL */
+    uint64_t subframes;     /* frames carried inside those A-MSDUs */
+    uint64_t bypassed;      /* frames sent as plain MSDUs */
+    uint64_t timerFlushes;  /* aggregates closed by the time budget */
+    uint64_t allocFailures;
+};
+
+class ItlAmsdu {
+
+public:
+
+    bool init(uint32_t maxLength, uint32_t smallFrame, uint32_t budgetUS);
+
+    void free();
+
+    /*
+     * Receiver address and its A-MSDU length limit (already clamped to what
+     * the HAL can send). A zero limit turns aggregation off.
+     */
+    void setPeer(const uint8_t *ra, uint32_t peerMaxLength);
+
+    bool isEnabled() const { return peerMaxLength != 0; }
+
+    /*
+     * Offer an Ethernet frame with traffic identifier tid, as classified by
+     * ieee80211_classify(). Only best effort frames are aggregated:
+     * ieee80211_encap() classifies the aggregate by its leading header, which
+     * carries no ethertype, and always puts it on TID 0. Returns the
+     * packets (linked through mbuf_nextpkt) that have to be sent now in
+     * order, or NULL when the frame is held in the pending aggregate.
+     */
+    mbuf_t enqueue(mbuf_t m, uint8_t tid);
+
+    /* Close the pending aggregate regardless of the time budget. */
+    mbuf_t flush();
+
+    /* Close the pending aggregate if its time budget expired. */
+    mbuf_t flushExpired(uint64_t now);
+
+    /* Free whatever is pending, used when the link goes down. */
+    void drop();
+
+    /* Absolute deadline of the pending aggregate, 0 when nothing is held. */
+    uint64_t getDeadline() const { return pendingDeadline; }
+
+    void getStats(struct ItlAmsduStats *out) const { *out = stats; }
+
+private:
+
+    bool canAggregate(mbuf_t m, size_t len, uint8_t tid, struct ether_header *eh);
+
+    mbuf_t closeLocked();
+
+    mbuf_t buildLocked();
+
+    void dropPendingLocked();
+
+private:
+    IOSimpleLock *lock;
+    mbuf_tag_id_t tagId;    /* kItlAmsduTagName, see ItlHalService::getTxAmsdu() */
+
+    uint32_t maxLength;
+    uint32_t peerMaxLength;
+    uint32_t smallFrame;
+    uint64_t budget;
+
+    mbuf_t pendingHead;
+    mbuf_t pendingTail;
+    uint32_t pendingCount;
+    uint32_t pendingLength;
+    uint64_t pendingDeadline;
+    uint8_t pendingTid;
+    uint8_t pendingSrc[ETHER_ADDR_LEN];
+    uint8_t ra[ETHER_ADDR_LEN];
+
+    struct ItlAmsduStats stats;
+};
+
+#endif /* ItlAmsdu_hpp */
@@ -0,0 +1,65 @@
+//
+//  ItlAmsduLayout.hpp
+//  BCMWLANFirmware_Hashstore
+//
+//  A-MSDU subframe layout arithmetic shared by ItlAmsdu and the host test in
+//  tools/test. Plain C++, no kernel headers.
+//
+
+#ifndef ItlAmsduLayout_hpp
+#define ItlAmsduLayout_hpp
+
+#include <stdint.h>
+
+#define kItlAmsduLLCLen             8       /* AA AA 03 00 00 00 + ethertype */
+#define kItlAmsduEtherHdrLen        14      /* DA + SA + type/length */
+#define kItlAmsduSubframeHdrLen     (kItlAmsduEtherHdrLen + kItlAmsduLLCLen)
+
+/* Subframes start on a 4 byte boundary relative to the start of the A-MSDU. */
+static inline uint32_t
+itlAmsduPad(uint32_t off)
+{
+    return ((off + 3) & ~3U) - off;
+}
+
+/* Bytes an Ethernet frame of frameLen takes as a subframe, padding excluded. */
+static inline uint32_t
+itlAmsduSubframeLength(uint32_t frameLen)
+{
+    return frameLen + kItlAmsduLLCLen;
+}
+
+/* A-MSDU length after appending a frame of frameLen to one of amsduLen, 0 when empty. */
+static inline uint32_t
+itlAmsduAppendLength(uint32_t amsduLen, uint32_t frameLen)
+{
+    return amsduLen + itlAmsduPad(amsduLen) + itlAmsduSubframeLength(frameLen);
+}
+
+/*
+ * Subframe header for the Ethernet frame starting with eh:
+ *
+ *   | DA | SA | length, big endian | AA AA 03 00 00 00 | type |
+ *
+ * length counts the LLC/SNAP header and the payload.
+ */
+static inline void
+itlAmsduSubframeHeader(uint8_t *hdr, const uint8_t *eh, uint32_t frameLen)
+{
+    uint32_t len = frameLen - kItlAmsduEtherHdrLen + kItlAmsduLLCLen;
+    int i;
+
+    for (i = 0; i < 12; i++) {
+        hdr[i] = eh[i];
+    }
+    hdr[12] = (uint8_t)(len >> 8);
+    hdr[13] = (uint8_t)len;
+    hdr[14] = 0xaa;
+    hdr[15] = 0xaa;
+    hdr[16] = 0x03;
+    hdr[17] = hdr[18] = hdr[19] = 0;
+    hdr[20] = eh[12];
+    hdr[21] = eh[13];
+}
+
+#endif /* ItlAmsduLayout_hpp */
@@ -0,0 +1,106 @@
+//
+//  ItlCommandQueue.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Set requests deferred from the ioctl caller to the controller workloop.
+//
+
+#include "ItlCommandQueue.hpp"
+
+bool ItlCommandQueue::
+init()
+{
+    this->head = this->tail = NULL;
+    bzero(&this->stats, sizeof(this->stats));
+    this->lock = IOLockAlloc();
+    return this->lock != NULL;
+}
+
+void ItlCommandQueue::
+free()
+{
+    struct ItlCommand *cmd;
+
+    if (this->lock == NULL) {
+        return;
+    }
+    while ((cmd = dequeue()) != NULL) {
+        release(cmd);
+    }
+    IOLockFree(this->lock);
+    this->lock = NULL;
+}
+
+bool ItlCommandQueue::
+enqueue(int request, OSObject *object, const void *data, uint32_t size, bool coalesce)
+{
+    struct ItlCommand *cmd = (struct ItlCommand *)IOMalloc(sizeof(*cmd) + size);
+    struct ItlCommand *old = NULL;
+    struct ItlCommand *prev = NULL;
+
+    if (cmd == NULL) {
+        return false;
+    }
+    cmd->next = NULL;
+    cmd->request = request;
+    cmd->object = object;
+    cmd->size = size;
+    memcpy(cmd->data, data, size);
+    if (object) {
+        object->retain();
+    }
+    IOLockLock(this->lock);
+    for (old = coalesce ? this->head : NULL; old != NULL; prev = old, old = old->next) {
+        if (old->request == request) {
+            if (prev) {
+                prev->next = old->next;
+            } else {
+                this->head = old->next;
+            }
+            if (this->tail == old) {
+                this->tail = prev;
+            }
+            this->stats.replaced++;
+            break;
+        }
+    }
+    if (this->tail) {
+        this->tail->next = cmd;
+    } else {
+        this->head = cmd;
+    }
+    this->tail = cmd;
+    this->stats.queued++;
+    IOLockUnlock(this->lock);
+    if (old) {
+        release(old);
+    }
+    return true;
+}
+
+struct ItlCommand *ItlCommandQueue::
+dequeue()
+{
+    struct ItlCommand *cmd;
+
+    IOLockLock(this->lock);
+    cmd = this->head;
+    if (cmd) {
+        this->head = cmd->next;
+        if (this->head == NULL) {
+            this->tail = NULL;
+        }
+        cmd->next = NULL;
+    }
+    IOLockUnlock(this->lock);
+    return cmd;
+}
+
+void ItlCommandQueue::
+release(struct ItlCommand *cmd)
+{
+    if (cmd->object) {
+        cmd->object->release();
+    }
+    IOFree(cmd, sizeof(*cmd) + cmd->size);
+}
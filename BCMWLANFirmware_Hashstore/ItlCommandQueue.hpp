@@ -0,0 +1,58 @@
+//
+//  ItlCommandQueue.hpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Set requests deferred from the ioctl caller to the controller workloop.
+//
+
+#ifndef ItlCommandQueue_hpp
+#define ItlCommandQueue_hpp
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <libkern/c++/OSObject.h>
+
+struct ItlCommand {
+    struct ItlCommand *next;
+    int request;
+    OSObject *object;       /* interface the request came in on, retained */
+    uint32_t size;
+    uint8_t data[0] __attribute__((aligned(8)));
+};
+
+struct ItlCommandStats {
+    uint64_t queued;
+    uint64_t replaced;      /* coalesced, superseded by a newer request of the same kind before running */
+};
+
+/*
+ * Callers copy the request in and return at once; the workloop drains the
+ * queue in arrival order. A coalesced request drops the queued one of the
+ * same kind and goes to the tail, so it still runs after everything that
+ * came in before it.
+ */
+class ItlCommandQueue {
+
+public:
+
+    bool init();
+
+    void free();
+
+    bool enqueue(int request, OSObject *object, const void *data, uint32_t size, bool coalesce);
+
+    /* NULL when empty. Hand the command back with release(). */
+    struct ItlCommand *dequeue();
+
+    static void release(struct ItlCommand *cmd);
+
+    void getStats(struct ItlCommandStats *out) const { *out = stats; }
+
+private:
+    IOLock *lock;
+    struct ItlCommand *head;
+    struct ItlCommand *tail;
+    struct ItlCommandStats stats;
+};
+
+#endif /* ItlCommandQueue_hpp */
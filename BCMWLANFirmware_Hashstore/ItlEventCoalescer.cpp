@@ -0,0 +1,104 @@
+//
+//  ItlEventCoalescer.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Batches link state changes and apple80211 messages for the interfaces.
+//
+
+#include "ItlEventCoalescer.hpp"
+
+void ItlEventCoalescer::
+init()
+{
+    this->count = 0;
+    this->deliveredState = 0;
+    bzero(&this->stats, sizeof(this->stats));
+}
+
+bool ItlEventCoalescer::
+append(const struct ItlEvent *event)
+{
+    if (this->count >= kItlEventMaxPending) {
+        return false;
+    }
+    this->stats.posted++;
+    this->events[this->count++] = *event;
+    return true;
+}
+
+bool ItlEventCoalescer::
+isStateMessage(int code)
+{
+    switch (code) {
+        case APPLE80211_M_POWER_CHANGED:
+        case APPLE80211_M_SSID_CHANGED:
+        case APPLE80211_M_BSSID_CHANGED:
+        case APPLE80211_M_LINK_CHANGED:
+        case APPLE80211_M_INT_MIT_CHANGED:
+        case APPLE80211_M_COUNTRY_CODE_CHANGED:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void ItlEventCoalescer::
+drop(int code)
+{
+    for (int i = 0; i < this->count; i++) {
+        if (this->events[i].code == code) {
+            memmove(&this->events[i], &this->events[i + 1], (this->count - i - 1) * sizeof(this->events[0]));
+            this->count--;
+            this->stats.suppressed++;
+            return;
+        }
+    }
+}
+
+bool ItlEventCoalescer::
+postLinkState(uint32_t state, uint32_t reason)
+{
+    struct ItlEvent event = { kItlEventLinkState, state, reason };
+
+    drop(kItlEventLinkState);
+    return append(&event);
+}
+
+bool ItlEventCoalescer::
+postMessage(int code)
+{
+    struct ItlEvent event = { code, 0, 0 };
+
+    if (isStateMessage(code)) {
+        drop(code);
+    } else if (this->count > 0 && this->events[this->count - 1].code == code) {
+        this->stats.posted++;
+        this->stats.suppressed++;
+        return true;
+    }
+    return append(&event);
+}
+
+int ItlEventCoalescer::
+take(struct ItlEvent *events, int max)
+{
+    int taken = min(this->count, max);
+    int n = 0;
+
+    for (int i = 0; i < taken; i++) {
+        if (this->events[i].code == kItlEventLinkState) {
+            if (this->events[i].state == this->deliveredState) {
+                this->stats.suppressed++;
+                continue;
+            }
+            this->deliveredState = this->events[i].state;
+        }
+        events[n++] = this->events[i];
+    }
+    if (taken < this->count) {
+        memmove(this->events, this->events + taken, (this->count - taken) * sizeof(this->events[0]));
+    }
+    this->count -= taken;
+    this->stats.delivered += n;
+    return n;
+}
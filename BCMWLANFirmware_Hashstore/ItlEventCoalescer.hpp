@@ -0,0 +1,85 @@
+//
+//  ItlEventCoalescer.hpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Batches link state changes and apple80211 messages for the interfaces.
+//
+
+#ifndef ItlEventCoalescer_hpp
+#define ItlEventCoalescer_hpp
+
+#include <IOKit/IOLib.h>
+
+#include "Airport/apple80211_var.h"
+
+#define kItlEventDefaultWindowMS    20      /* 0 delivers every event immediately */
+#define kItlEventMaxPending         8
+
+#define kItlEventLinkState          -1      /* ItlEvent.code of a link state change */
+
+struct ItlEventStats {
+    uint64_t posted;        /* link states and messages offered */
+    uint64_t delivered;
+    uint64_t suppressed;    /* replaced by a later event or already delivered */
+};
+
+struct ItlEvent {
+    int code;               /* apple80211 message or kItlEventLinkState */
+    uint32_t state;
+    uint32_t reason;
+};
+
+/*
+ * Holds what is pending until the controller's window timer fires and
+ * hands it back in arrival order. Not locked, every call has to be made
+ * behind the controller's command gate.
+ */
+class ItlEventCoalescer {
+
+public:
+
+    void init();
+
+    /*
+     * Only the last link state of a window is kept, it takes the place of
+     * the newest one. Returns false when the queue is full; the caller has
+     * to deliver what is pending and post again.
+     */
+    bool postLinkState(uint32_t state, uint32_t reason);
+
+    /*
+     * A message that only tells userspace to re-read some state, such as
+     * LINK_CHANGED or COUNTRY_CODE_CHANGED, replaces its pending copy and
+     * takes the newest position like a link state. Any other message only
+     * drops a repeat right before it. False when full as above.
+     */
+    bool postMessage(int code);
+
+    bool hasPending() const { return count != 0; }
+
+    /*
+     * Pending events in posting order, returns their number. A link state
+     * that was already delivered, a flap that ended where it started, is
+     * left out.
+     */
+    int take(struct ItlEvent *events, int max);
+
+    void getStats(struct ItlEventStats *out) const { *out = stats; }
+
+private:
+
+    static bool isStateMessage(int code);
+    
+    /* Removes the pending event with code, if any, and counts it suppressed. */
+    void drop(int code);
+    
+    bool append(const struct ItlEvent *event);
+
+private:
+    struct ItlEvent events[kItlEventMaxPending];
+    int count;
+    uint32_t deliveredState;
+    struct ItlEventStats stats;
+};
+
+#endif /* ItlEventCoalescer_hpp */
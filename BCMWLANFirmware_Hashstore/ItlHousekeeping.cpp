@@ -0,0 +1,101 @@
+//
+//  ItlHousekeeping.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Periodic housekeeping tasks sharing one coalesced timer on the main workloop.
+//
+
+#include "ItlHousekeeping.hpp"
+
+void ItlHousekeeping::
+init()
+{
+    bzero(this->periodMS, sizeof(this->periodMS));
+    bzero(this->deadlineMS, sizeof(this->deadlineMS));
+    bzero(&this->stats, sizeof(this->stats));
+}
+
+void ItlHousekeeping::
+setPeriod(int task, uint32_t periodMS)
+{
+    this->periodMS[task] = periodMS;
+    if (periodMS == 0) {
+        this->deadlineMS[task] = 0;
+    }
+}
+
+void ItlHousekeeping::
+start(uint64_t nowMS, uint32_t mask)
+{
+    for (int i = 0; i < kItlHkTaskCount; i++) {
+        this->deadlineMS[i] = 0;
+        if (mask & (1 << i)) {
+            arm(i, nowMS);
+        }
+    }
+}
+
+bool ItlHousekeeping::
+arm(int task, uint64_t nowMS)
+{
+    if (this->deadlineMS[task] || this->periodMS[task] == 0) {
+        return false;
+    }
+    this->deadlineMS[task] = nowMS + this->periodMS[task];
+    return true;
+}
+
+uint32_t ItlHousekeeping::
+due(uint64_t nowMS)
+{
+    uint32_t mask = 0;
+
+    this->stats.fires++;
+    for (int i = 0; i < kItlHkTaskCount; i++) {
+        uint64_t deadline = this->deadlineMS[i];
+
+        if (deadline == 0 || this->periodMS[i] == 0) {
+            continue;
+        }
+        if (nowMS < deadline) {
+            // close enough, run it now rather than wake up again for it
+            if (deadline - nowMS > (this->periodMS[i] >> kItlHkLeewayShift)) {
+                continue;
+            }
+            this->stats.coalesced++;
+        }
+        mask |= 1 << i;
+        this->stats.runs++;
+        // keep the phase, but do not replay ticks missed while held off
+        deadline += this->periodMS[i];
+        this->deadlineMS[i] = deadline > nowMS ? deadline : nowMS + this->periodMS[i];
+    }
+    return mask;
+}
+
+bool ItlHousekeeping::
+next(uint64_t nowMS, uint32_t *delayMS, uint32_t *leewayMS) const
+{
+    uint64_t earliest = 0;
+    uint32_t leeway = UINT32_MAX;
+
+    for (int i = 0; i < kItlHkTaskCount; i++) {
+        if (this->deadlineMS[i] && (earliest == 0 || this->deadlineMS[i] < earliest)) {
+            earliest = this->deadlineMS[i];
+        }
+    }
+    if (earliest == 0) {
+        return false;
+    }
+    // the wakeup must not push any task it serves past its own leeway
+    for (int i = 0; i < kItlHkTaskCount; i++) {
+        uint32_t slack = this->periodMS[i] >> kItlHkLeewayShift;
+
+        if (this->deadlineMS[i] && this->deadlineMS[i] <= earliest + slack) {
+            leeway = min(leeway, (uint32_t)(this->deadlineMS[i] + slack - earliest));
+        }
+    }
+    *delayMS = earliest > nowMS ? (uint32_t)(earliest - nowMS) : 0;
+    *leewayMS = leeway;
+    return true;
+}
@@ -0,0 +1,76 @@
+//
+//  ItlHousekeeping.hpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Periodic housekeeping tasks sharing one coalesced timer on the main workloop.
+//
+
+#ifndef ItlHousekeeping_hpp
+#define ItlHousekeeping_hpp
+
+#include <IOKit/IOLib.h>
+
+enum ItlHousekeepingTask {
+    kItlHkWatchdog,         /* if_watchdog: Tx timeouts, net80211 management timers, armed on demand */
+    kItlHkStaInfo,          /* rate control and RSSI the driver did not report */
+    kItlHkRoam,             /* roamTick */
+    kItlHkLinkSpeed,        /* setLinkStatus with the current Tx rate */
+    kItlHkIntrMod,          /* interrupt rate sample for the coalescing delay */
+    kItlHkPowerSave,        /* power save level, kicked on link up and mode changes, periodic while dynamic */
+    kItlHkTaskCount
+};
+
+/* Tasks that only have work while associated, armed on link up and disarmed on link down. */
+#define kItlHkLinkTasks         ((1 << kItlHkStaInfo) | (1 << kItlHkRoam) | (1 << kItlHkLinkSpeed) | (1 << kItlHkIntrMod))
+
+#define kItlHkLeewayShift       3       /* a task may run up to 1/8 of its period late */
+
+struct ItlHousekeepingStats {
+    uint32_t fires;         /* timer wakeups */
+    uint32_t runs;          /* tasks run */
+    uint32_t coalesced;     /* tasks run early to share a wakeup */
+};
+
+/*
+ * Each task has a period and a deadline. A wakeup runs every task that is
+ * due, plus the ones due within their own leeway, then the timer is set to
+ * the earliest remaining deadline with the smallest leeway of the tasks it
+ * could serve, so the timer layer can line it up with other wakeups.
+ */
+class ItlHousekeeping {
+
+public:
+
+    void init();
+
+    /* 0 disables the task. Takes effect at the next start() or run. */
+    void setPeriod(int task, uint32_t periodMS);
+
+    /* The tasks in mask are first due one period from now, the others wait for arm(). */
+    void start(uint64_t nowMS, uint32_t mask);
+
+    /* Schedule a task one period from now, false if it already was. */
+    bool arm(int task, uint64_t nowMS);
+
+    void disarm(int task) { deadlineMS[task] = 0; }
+
+    /* Make a task due now, armed or not, it keeps its period afterwards. */
+    void kick(int task, uint64_t nowMS) { deadlineMS[task] = nowMS; }
+
+    bool isArmed(int task) const { return deadlineMS[task] != 0; }
+
+    /* Bitmask of the tasks to run now, they are rescheduled by a period. */
+    uint32_t due(uint64_t nowMS);
+
+    /* Earliest deadline as a delay from now and its leeway, false when idle. */
+    bool next(uint64_t nowMS, uint32_t *delayMS, uint32_t *leewayMS) const;
+
+    void getStats(struct ItlHousekeepingStats *out) const { *out = stats; }
+
+private:
+    uint32_t periodMS[kItlHkTaskCount];
+    uint64_t deadlineMS[kItlHkTaskCount];   /* 0 when not scheduled */
+    struct ItlHousekeepingStats stats;
+};
+
+#endif /* ItlHousekeeping_hpp */
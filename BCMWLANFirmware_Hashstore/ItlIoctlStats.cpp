@@ -0,0 +1,166 @@
+//
+//  ItlIoctlStats.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Call counts and latency histograms of the apple80211 ioctls.
+//
+
+#include "ItlIoctlStats.hpp"
+#include <libkern/c++/OSArray.h>
+#include <libkern/c++/OSNumber.h>
+#include "Airport/debug.h"
+
+static uint32_t statCalls(const struct ioctl_apple80211_stat *s)
+{
+    return s->gets + s->sets + s->unhandled;
+}
+
+static void setNumber(OSDictionary *dict, const char *key, uint64_t value)
+{
+    OSNumber *num = OSNumber::withNumber(value, 64);
+
+    if (num) {
+        dict->setObject(key, num);
+        num->release();
+    }
+}
+
+void ItlIoctlStats::
+init()
+{
+    bzero(this->counters, sizeof(this->counters));
+    this->unhandledOther = 0;
+}
+
+void ItlIoctlStats::
+record(int request, bool isGet, IOReturn ret, uint64_t elapsed)
+{
+    struct ItlIoctlCounter *c;
+    uint64_t ns;
+    uint32_t us;
+    int bucket;
+
+    if (request < 0 || request >= kItlIoctlCount) {
+        return;
+    }
+    c = &this->counters[request];
+    absolutetime_to_nanoseconds(elapsed, &ns);
+    us = (uint32_t)min(ns / 1000, (uint64_t)UINT32_MAX);
+    bucket = us ? min(32 - __builtin_clz(us), ITL_IOCTL_STATS_HIST - 1) : 0;
+
+    OSIncrementAtomic(isGet ? &c->gets : &c->sets);
+    if (ret != kIOReturnSuccess) {
+        OSIncrementAtomic(&c->errors);
+    }
+    OSAddAtomic64(us, &c->totalUS);
+    OSIncrementAtomic(&c->hist[bucket]);
+    for (UInt32 old = c->maxUS; us > old; old = c->maxUS) {
+        if (OSCompareAndSwap(old, us, &c->maxUS)) {
+            break;
+        }
+    }
+}
+
+void ItlIoctlStats::
+recordUnhandled(int request)
+{
+    if (request < 0 || request >= kItlIoctlCount) {
+        OSIncrementAtomic(&this->unhandledOther);
+        return;
+    }
+    OSIncrementAtomic(&this->counters[request].unhandled);
+}
+
+void ItlIoctlStats::
+snapshot(struct ioctl_apple80211_stats *out)
+{
+    struct ioctl_apple80211_stat *s;
+    uint32_t n;
+    uint32_t pos;
+
+    bzero(out, sizeof(*out));
+    out->version = IOCTL_VERSION;
+    out->unhandled_other = this->unhandledOther;
+    for (int i = 0; i < kItlIoctlCount; i++) {
+        const struct ItlIoctlCounter *c = &this->counters[i];
+
+        if ((n = calls(c)) == 0) {
+            continue;
+        }
+        out->active++;
+        // insertion keeps the table sorted by calls, the quietest entry falls off the end
+        for (pos = out->count; pos > 0 && statCalls(&out->stats[pos - 1]) < n; pos--);
+        if (pos >= ITL_IOCTL_STATS_MAX) {
+            continue;
+        }
+        memmove(&out->stats[pos + 1], &out->stats[pos],
+                (min(out->count, ITL_IOCTL_STATS_MAX - 1) - pos) * sizeof(out->stats[0]));
+        if (out->count < ITL_IOCTL_STATS_MAX) {
+            out->count++;
+        }
+        s = &out->stats[pos];
+        s->request = i;
+        s->gets = c->gets;
+        s->sets = c->sets;
+        s->errors = c->errors;
+        s->unhandled = c->unhandled;
+        s->max_us = c->maxUS;
+        s->total_us = c->totalUS;
+        for (int b = 0; b < ITL_IOCTL_STATS_HIST; b++) {
+            s->hist[b] = c->hist[b];
+        }
+    }
+}
+
+OSDictionary *ItlIoctlStats::
+copyDictionary()
+{
+    OSDictionary *dict = OSDictionary::withCapacity(16);
+    OSDictionary *entry;
+    OSArray *hist;
+    OSNumber *num;
+    char name[16];
+    const char *key;
+
+    if (dict == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < kItlIoctlCount; i++) {
+        const struct ItlIoctlCounter *c = &this->counters[i];
+
+        if (calls(c) == 0) {
+            continue;
+        }
+        entry = OSDictionary::withCapacity(7);
+        hist = OSArray::withCapacity(ITL_IOCTL_STATS_HIST);
+        if (entry == NULL || hist == NULL) {
+            OSSafeReleaseNULL(entry);
+            OSSafeReleaseNULL(hist);
+            continue;
+        }
+        setNumber(entry, "Get", (uint32_t)c->gets);
+        setNumber(entry, "Set", (uint32_t)c->sets);
+        setNumber(entry, "Errors", (uint32_t)c->errors);
+        setNumber(entry, "Unhandled", (uint32_t)c->unhandled);
+        setNumber(entry, "MaxUS", c->maxUS);
+        setNumber(entry, "TotalUS", (uint64_t)c->totalUS);
+        for (int b = 0; b < ITL_IOCTL_STATS_HIST; b++) {
+            if ((num = OSNumber::withNumber((uint32_t)c->hist[b], 32)) != NULL) {
+                hist->setObject(num);
+                num->release();
+            }
+        }
+        entry->setObject("LatencyUS", hist);
+        hist->release();
+        if (i < sizeof(IOCTL_NAMES) / sizeof(IOCTL_NAMES[0]) && IOCTL_NAMES[i] != NULL) {
+            key = IOCTL_NAMES[i];
+        } else {
+            snprintf(name, sizeof(name), "%d", i);
+            key = name;
+        }
+        dict->setObject(key, entry);
+        entry->release();
+    }
+    setNumber(dict, "UnhandledOther", (uint32_t)this->unhandledOther);
+    return dict;
+}
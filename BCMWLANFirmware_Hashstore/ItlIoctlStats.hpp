@@ -0,0 +1,63 @@
+//
+//  ItlIoctlStats.hpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Call counts and latency histograms of the apple80211 ioctls.
+//
+
+#ifndef ItlIoctlStats_hpp
+#define ItlIoctlStats_hpp
+
+#include <IOKit/IOLib.h>
+#include <libkern/OSAtomic.h>
+#include <libkern/c++/OSDictionary.h>
+#include <net/ethernet.h>
+#include <ClientKit/Common.h>
+#include "Airport/apple80211_ioctl.h"
+
+/* Request numbers 0..APPLE80211_IOC_NSS, see AirportIOCTL.cpp */
+#define kItlIoctlCount              (APPLE80211_IOC_NSS + 1)
+
+#define kItlIoctlStatsKey           "Apple80211Stats"
+
+struct ItlIoctlCounter {
+    volatile SInt32 gets;
+    volatile SInt32 sets;
+    volatile SInt32 errors;
+    volatile SInt32 unhandled;
+    volatile UInt32 maxUS;
+    volatile SInt64 totalUS;
+    volatile SInt32 hist[ITL_IOCTL_STATS_HIST];
+};
+
+/*
+ * Updated with atomic adds only, so the dispatch path never takes a lock
+ * and may run at interrupt context. Snapshots are not taken atomically
+ * across counters.
+ */
+class ItlIoctlStats {
+
+public:
+
+    void init();
+
+    void record(int request, bool isGet, IOReturn ret, uint64_t elapsed);
+
+    void recordUnhandled(int request);
+
+    /* Busiest requests first, at most ITL_IOCTL_STATS_MAX of them. */
+    void snapshot(struct ioctl_apple80211_stats *out);
+
+    /* Registry form: request name -> counters, only requests seen so far. */
+    OSDictionary *copyDictionary();
+
+private:
+
+    static uint32_t calls(const struct ItlIoctlCounter *c) { return c->gets + c->sets + c->unhandled; }
+
+private:
+    struct ItlIoctlCounter counters[kItlIoctlCount];
+    volatile SInt32 unhandledOther;
+};
+
+#endif /* ItlIoctlStats_hpp */
@@ -0,0 +1,278 @@
+//
+//  ItlLro.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Software receive coalescing of in-order TCP segments.
+//
+
+#include "ItlLro.hpp"
+
+#define kItlLroCsumVerified (MBUF_CSUM_DID_IP | MBUF_CSUM_IP_GOOD | MBUF_CSUM_DID_DATA | MBUF_CSUM_PSEUDO_HDR)
+
+#define SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
+
+static uint16_t ipHeaderChecksum(const struct ip *ip)
+{
+    const uint16_t *w = (const uint16_t *)ip;
+    uint32_t sum = 0;
+
+    for (size_t i = 0; i < sizeof(struct ip) / sizeof(uint16_t); i++) {
+        sum += w[i];
+    }
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += sum >> 16;
+    return (uint16_t)~sum;
+}
+
+void ItlLro::
+init(bool enabled)
+{
+    this->enabled = enabled;
+    bzero(&this->stats, sizeof(this->stats));
+}
+
+bool ItlLro::
+parse(mbuf_t m, struct ItlLroSegment *seg)
+{
+    struct ether_header *eh;
+    uint32_t iphlen;
+    uint16_t iplen;
+    uint8_t *opt;
+
+    seg->th = NULL;
+    seg->flush = false;
+    if (mbuf_len(m) < ETHER_HDR_LEN + sizeof(struct ip)) {
+        // too short to tell whose it is
+        seg->flush = true;
+        return false;
+    }
+    eh = (struct ether_header *)mbuf_data(m);
+    if (eh->ether_type != htons(ETHERTYPE_IP)) {
+        return false;
+    }
+    seg->ip = (struct ip *)(eh + 1);
+    if (seg->ip->ip_v != IPVERSION || seg->ip->ip_p != IPPROTO_TCP) {
+        return false;
+    }
+    // from here on the frame belongs to a TCP flow, coalesced or not
+    seg->flush = true;
+    iphlen = seg->ip->ip_hl << 2;
+    if ((seg->ip->ip_off & htons(IP_OFFMASK)) != 0 || iphlen < sizeof(struct ip) ||
+        mbuf_len(m) < ETHER_HDR_LEN + iphlen + sizeof(struct tcphdr)) {
+        return false;
+    }
+    seg->th = (struct tcphdr *)((uint8_t *)seg->ip + iphlen);
+    if (iphlen != sizeof(struct ip) || (seg->ip->ip_off & htons(IP_MF)) != 0 ||
+        (seg->ip->ip_tos & IPTOS_ECN_MASK) == IPTOS_ECN_CE) {
+        return false;
+    }
+    iplen = ntohs(seg->ip->ip_len);
+    // padded runts and truncated frames are left to the stack
+    if (ETHER_HDR_LEN + iplen != mbuf_pkthdr_len(m)) {
+        return false;
+    }
+    seg->thlen = seg->th->th_off << 2;
+    if (seg->thlen < sizeof(struct tcphdr) ||
+        mbuf_len(m) < ETHER_HDR_LEN + sizeof(struct ip) + seg->thlen ||
+        iplen <= sizeof(struct ip) + seg->thlen) {
+        return false;
+    }
+    // plain data segments only, every other flag changes connection state
+    if ((seg->th->th_flags & ~TH_PUSH) != TH_ACK) {
+        return false;
+    }
+    seg->payload = iplen - sizeof(struct ip) - seg->thlen;
+    seg->ts = NULL;
+    if (seg->thlen != sizeof(struct tcphdr)) {
+        opt = (uint8_t *)(seg->th + 1);
+        if (seg->thlen != sizeof(struct tcphdr) + TCPOLEN_TSTAMP_APPA ||
+            opt[0] != TCPOPT_NOP || opt[1] != TCPOPT_NOP ||
+            opt[2] != TCPOPT_TIMESTAMP || opt[3] != TCPOLEN_TIMESTAMP) {
+            return false;
+        }
+        seg->ts = opt + 4;
+    }
+    // last, only segments that can be merged are worth checksumming here
+    if (!checksumVerified(m, seg->ip, iplen)) {
+        return false;
+    }
+    seg->flush = false;
+    return true;
+}
+
+bool ItlLro::
+checksumVerified(mbuf_t m, struct ip *ip, uint16_t iplen)
+{
+    mbuf_csum_performed_flags_t flags;
+    uint32_t value;
+    uint8_t *data;
+    size_t len;
+    size_t pktlen;
+    uint16_t sum = 0xffff;
+    errno_t err;
+    
+    if (mbuf_get_csum_performed(m, &flags, &value) == 0 &&
+        (flags & kItlLroCsumVerified) == kItlLroCsumVerified && value == 0xffff) {
+        return true;
+    }
+    if (ipHeaderChecksum(ip) != 0) {
+        return false;
+    }
+    // mbuf_inet_cksum() wants the IP header at the data pointer
+    data = (uint8_t *)mbuf_data(m);
+    len = mbuf_len(m);
+    pktlen = mbuf_pkthdr_len(m);
+    mbuf_setdata(m, data + ETHER_HDR_LEN, len - ETHER_HDR_LEN);
+    mbuf_pkthdr_setlen(m, pktlen - ETHER_HDR_LEN);
+    err = mbuf_inet_cksum(m, IPPROTO_TCP, sizeof(struct ip), iplen - sizeof(struct ip), &sum);
+    mbuf_setdata(m, data, len);
+    mbuf_pkthdr_setlen(m, pktlen);
+    if (err != 0 || sum != 0) {
+        return false;
+    }
+    mbuf_set_csum_performed(m, kItlLroCsumVerified, 0xffff);
+    this->stats.swChecksums++;
+    return true;
+}
+
+void ItlLro::
+start(struct ItlLroFlow *flow, mbuf_t m, struct ItlLroSegment *seg)
+{
+    uint32_t tsval;
+
+    flow->head = m;
+    flow->src = seg->ip->ip_src;
+    flow->dst = seg->ip->ip_dst;
+    flow->sport = seg->th->th_sport;
+    flow->dport = seg->th->th_dport;
+    flow->nextSeq = ntohl(seg->th->th_seq) + seg->payload;
+    flow->ack = ntohl(seg->th->th_ack);
+    if (seg->ts) {
+        memcpy(&tsval, seg->ts, sizeof(tsval));
+        flow->tsval = ntohl(tsval);
+    }
+    flow->segments = 1;
+    flow->thlen = seg->thlen;
+}
+
+/*
+ * The payload is copied onto the tail of the first segment rather than
+ * linked: the mbuf KPI has no way to demote the packet header of the
+ * absorbed segment.
+ */
+bool ItlLro::
+merge(struct ItlLroFlow *flow, mbuf_t m, struct ItlLroSegment *seg)
+{
+    struct ip *ip = (struct ip *)((uint8_t *)mbuf_data(flow->head) + ETHER_HDR_LEN);
+    struct tcphdr *th = (struct tcphdr *)(ip + 1);
+    size_t origLen = mbuf_pkthdr_len(flow->head);
+    size_t off = origLen;
+    size_t skip = ETHER_HDR_LEN + sizeof(struct ip) + seg->thlen;
+    uint32_t ack = ntohl(seg->th->th_ack);
+    uint32_t tsval = 0;
+
+    if (seg->thlen != flow->thlen || ntohl(seg->th->th_seq) != flow->nextSeq ||
+        flow->segments >= kItlLroMaxSegments || origLen + seg->payload > kItlLroMaxLength ||
+        (th->th_flags & TH_PUSH) != 0 || !SEQ_GEQ(ack, flow->ack)) {
+        return false;
+    }
+    if (seg->ts) {
+        memcpy(&tsval, seg->ts, sizeof(tsval));
+        tsval = ntohl(tsval);
+        if (!SEQ_GEQ(tsval, flow->tsval)) {
+            return false;
+        }
+    }
+    for (mbuf_t n = m; n != NULL; n = mbuf_next(n)) {
+        size_t nlen = mbuf_len(n);
+        if (nlen <= skip) {
+            skip -= nlen;
+            continue;
+        }
+        if (mbuf_copyback(flow->head, off, nlen - skip, (uint8_t *)mbuf_data(n) + skip, MBUF_DONTWAIT) != 0) {
+            if (mbuf_pkthdr_len(flow->head) > origLen) {
+                mbuf_adj(flow->head, -(int)(mbuf_pkthdr_len(flow->head) - origLen));
+            }
+            return false;
+        }
+        off += nlen - skip;
+        skip = 0;
+    }
+    ip->ip_len = htons(ntohs(ip->ip_len) + seg->payload);
+    ip->ip_sum = 0;
+    ip->ip_sum = ipHeaderChecksum(ip);
+    th->th_ack = seg->th->th_ack;
+    th->th_win = seg->th->th_win;
+    th->th_flags |= seg->th->th_flags & TH_PUSH;
+    if (seg->ts) {
+        memcpy((uint8_t *)(th + 1) + 4, seg->ts, 2 * sizeof(uint32_t));
+        flow->tsval = tsval;
+    }
+    flow->nextSeq += seg->payload;
+    flow->ack = ack;
+    if (flow->segments++ == 1) {
+        this->stats.aggregates++;
+    }
+    this->stats.merged++;
+    mbuf_freem(m);
+    return true;
+}
+
+struct ItlLro::ItlLroFlow *ItlLro::
+lookup(struct ItlLroFlow *flows, int used, struct ItlLroSegment *seg)
+{
+    for (int i = 0; i < used; i++) {
+        if (flows[i].sport == seg->th->th_sport && flows[i].dport == seg->th->th_dport &&
+            flows[i].src.s_addr == seg->ip->ip_src.s_addr &&
+            flows[i].dst.s_addr == seg->ip->ip_dst.s_addr) {
+            return &flows[i];
+        }
+    }
+    return NULL;
+}
+
+mbuf_t ItlLro::
+coalesce(mbuf_t chain)
+{
+    struct ItlLroFlow flows[kItlLroMaxFlows];
+    struct ItlLroFlow *flow;
+    struct ItlLroSegment seg;
+    mbuf_t head = NULL;
+    mbuf_t tail = NULL;
+    mbuf_t next;
+    int used = 0;
+    int victim = 0;
+
+    for (mbuf_t m = chain; m != NULL; m = next) {
+        next = mbuf_nextpkt(m);
+        mbuf_setnextpkt(m, NULL);
+        if (parse(m, &seg)) {
+            flow = lookup(flows, used, &seg);
+            if (flow && merge(flow, m, &seg)) {
+                continue;
+            }
+            if (flow == NULL) {
+                // the evicted head already sits in the output list, it is just not extended any more
+                flow = used < kItlLroMaxFlows ? &flows[used++] : &flows[victim++ % kItlLroMaxFlows];
+            }
+            start(flow, m, &seg);
+        } else {
+            // later segments must not be merged into a head queued before this one
+            if (seg.flush && seg.th == NULL) {
+                for (int i = 0; i < used; i++) {
+                    flows[i].segments = kItlLroMaxSegments;
+                }
+            } else if (seg.flush && (flow = lookup(flows, used, &seg)) != NULL) {
+                flow->segments = kItlLroMaxSegments;
+            }
+            this->stats.bypassed++;
+        }
+        if (tail) {
+            mbuf_setnextpkt(tail, m);
+        } else {
+            head = m;
+        }
+        tail = m;
+    }
+    return head;
+}
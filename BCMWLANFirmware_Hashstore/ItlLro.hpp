@@ -0,0 +1,96 @@
+//
+//  ItlLro.hpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Software receive coalescing of in-order TCP segments.
+//
+
+#ifndef ItlLro_hpp
+#define ItlLro_hpp
+
+#include <IOKit/IOLib.h>
+#include <sys/kpi_mbuf.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+#define kItlLroMaxFlows         8
+#define kItlLroMaxSegments      16
+#define kItlLroMaxLength        (ETHER_HDR_LEN + IP_MAXPACKET)
+
+struct ItlLroStats {
+    uint64_t aggregates;    /* packets that absorbed at least one segment */
+    uint64_t merged;        /* segments absorbed into an earlier one */
+    uint64_t bypassed;      /* frames passed through untouched */
+    uint64_t swChecksums;   /* segments whose checksums were verified here */
+};
+
+/*
+ * Works on one receive batch at a time, nothing is held across calls.
+ * Only IPv4 TCP segments with verified checksums are coalesced. Segments
+ * the hardware did not verify are checked here, once they qualify
+ * otherwise, and marked verified. The merged packet keeps the verified
+ * checksum state and the stack does not touch the payload again.
+ */
+class ItlLro {
+
+public:
+
+    void init(bool enabled);
+
+    bool isEnabled() const { return enabled; }
+
+    /*
+     * Coalesce a batch linked through mbuf_nextpkt. Returns the batch with
+     * absorbed segments freed; per flow ordering is preserved.
+     */
+    mbuf_t coalesce(mbuf_t chain);
+
+    void getStats(struct ItlLroStats *out) const { *out = stats; }
+
+private:
+
+    struct ItlLroFlow {
+        mbuf_t head;
+        struct in_addr src;
+        struct in_addr dst;
+        uint16_t sport;
+        uint16_t dport;
+        uint32_t nextSeq;
+        uint32_t ack;
+        uint32_t tsval;
+        uint16_t segments;
+        uint8_t thlen;
+    };
+
+    struct ItlLroSegment {
+        struct ip *ip;
+        struct tcphdr *th;
+        uint8_t thlen;
+        uint32_t payload;
+        uint8_t *ts;        /* TSval/TSecr pair, NULL without timestamps */
+        bool flush;         /* may be part of a tracked flow: th names it, NULL for any */
+    };
+
+    /*
+     * Fills seg and returns true for a segment that can be coalesced. Any
+     * other frame that is or may be IPv4 TCP sets seg->flush so the
+     * aggregate of its flow ends before it and nothing overtakes it.
+     */
+    bool parse(mbuf_t m, struct ItlLroSegment *seg);
+
+    bool checksumVerified(mbuf_t m, struct ip *ip, uint16_t iplen);
+
+    struct ItlLroFlow *lookup(struct ItlLroFlow *flows, int used, struct ItlLroSegment *seg);
+
+    bool merge(struct ItlLroFlow *flow, mbuf_t m, struct ItlLroSegment *seg);
+
+    void start(struct ItlLroFlow *flow, mbuf_t m, struct ItlLroSegment *seg);
+
+private:
+    bool enabled;
+    struct ItlLroStats stats;
+};
+
+#endif /* ItlLro_hpp */
@@ -0,0 +1,225 @@
+//
+//  ItlPmksaCache.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  PMK security associations set by the supplicant, kept for fast reassociation.
+//
+
+#include "ItlPmksaCache.hpp"
+
+#define RSN_ELEMID      48
+#define RSN_SELECTOR_LEN 4
+
+static uint16_t le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+void ItlPmksaCache::
+init(uint32_t lifetimeS)
+{
+    this->lifetimeMS = (uint64_t)lifetimeS * 1000;
+    bzero(&this->stats, sizeof(this->stats));
+    flush();
+}
+
+void ItlPmksaCache::
+flush()
+{
+    // the PMKs are secrets, do not leave them behind
+    bzero(this->entries, sizeof(this->entries));
+}
+
+void ItlPmksaCache::
+remove(const uint8_t *bssid)
+{
+    struct ItlPmksa *e = find(bssid);
+
+    if (e) {
+        bzero(e, sizeof(*e));
+    }
+}
+
+struct ItlPmksa *ItlPmksaCache::
+find(const uint8_t *bssid)
+{
+    for (int i = 0; i < kItlPmksaMax; i++) {
+        if (this->entries[i].valid && memcmp(this->entries[i].bssid, bssid, ETHER_ADDR_LEN) == 0) {
+            return &this->entries[i];
+        }
+    }
+    return NULL;
+}
+
+bool ItlPmksaCache::
+expire(struct ItlPmksa *e, uint64_t nowMS)
+{
+    if (!e->valid || nowMS < e->expiresMS) {
+        return false;
+    }
+    bzero(e, sizeof(*e));
+    this->stats.expired++;
+    return true;
+}
+
+/* Existing entry of the BSSID, else a free slot, else the LRU one. */
+struct ItlPmksa *ItlPmksaCache::
+alloc(const uint8_t *bssid, const uint8_t *essid, uint8_t esslen, uint64_t nowMS)
+{
+    struct ItlPmksa *e = find(bssid);
+    struct ItlPmksa *lru = NULL;
+
+    if (e == NULL) {
+        for (int i = 0; i < kItlPmksaMax; i++) {
+            expire(&this->entries[i], nowMS);
+            if (!this->entries[i].valid) {
+                e = &this->entries[i];
+                break;
+            }
+            if (lru == NULL || this->entries[i].usedMS < lru->usedMS) {
+                lru = &this->entries[i];
+            }
+        }
+        if (e == NULL) {
+            e = lru;
+            this->stats.evictions++;
+        }
+        bzero(e, sizeof(*e));
+        memcpy(e->bssid, bssid, ETHER_ADDR_LEN);
+        e->valid = true;
+    }
+    e->esslen = esslen > APPLE80211_MAX_SSID_LEN ? APPLE80211_MAX_SSID_LEN : esslen;
+    memcpy(e->essid, essid, e->esslen);
+    e->expiresMS = nowMS + this->lifetimeMS;
+    e->usedMS = nowMS;
+    return e;
+}
+
+void ItlPmksaCache::
+addPmkid(const uint8_t *bssid, const uint8_t *essid, uint8_t esslen,
+         const uint8_t *pmkid, uint64_t nowMS)
+{
+    struct ItlPmksa *e = alloc(bssid, essid, esslen, nowMS);
+
+    memcpy(e->pmkid, pmkid, kItlPmkidLen);
+    e->hasPmkid = true;
+}
+
+void ItlPmksaCache::
+addPmk(const uint8_t *bssid, const uint8_t *essid, uint8_t esslen,
+       const uint8_t *pmk, uint32_t len, uint64_t nowMS)
+{
+    struct ItlPmksa *e = alloc(bssid, essid, esslen, nowMS);
+
+    e->pmkLen = len > kItlPmkMaxLen ? kItlPmkMaxLen : len;
+    memcpy(e->pmk, pmk, e->pmkLen);
+}
+
+const struct ItlPmksa *ItlPmksaCache::
+lookup(const uint8_t *bssid, uint64_t nowMS)
+{
+    struct ItlPmksa *e = find(bssid);
+
+    if (e == NULL || expire(e, nowMS) || !e->hasPmkid) {
+        this->stats.misses++;
+        return NULL;
+    }
+    e->usedMS = nowMS;
+    this->stats.hits++;
+    return e;
+}
+
+const struct ItlPmksa *ItlPmksaCache::
+lookupEss(const uint8_t *essid, uint8_t esslen, uint64_t nowMS)
+{
+    struct ItlPmksa *best = NULL;
+
+    for (int i = 0; i < kItlPmksaMax; i++) {
+        struct ItlPmksa *e = &this->entries[i];
+
+        if (expire(e, nowMS) || !e->valid || e->pmkLen == 0 ||
+            e->esslen != esslen || memcmp(e->essid, essid, esslen) != 0) {
+            continue;
+        }
+        if (best == NULL || e->usedMS > best->usedMS) {
+            best = e;
+        }
+    }
+    return best;
+}
+
+uint32_t ItlPmksaCache::
+getCount() const
+{
+    uint32_t count = 0;
+
+    for (int i = 0; i < kItlPmksaMax; i++) {
+        if (this->entries[i].valid) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ * 802.11-2016 9.4.2.25: version, group cipher, pairwise and AKM suite
+ * lists, capabilities, PMKID list, group management cipher. Everything
+ * after the version may be cut off, the PMKID list needs the fields in
+ * front of it so capabilities are added when missing.
+ */
+bool ItlPmksaCache::
+setRsnPmkid(uint8_t *ie, size_t size, const uint8_t *pmkid)
+{
+    size_t off = 4;
+    size_t end;
+    size_t listLen = 0;
+    size_t newListLen;
+    size_t tail;
+
+    if (size < 4 || ie[0] != RSN_ELEMID || (end = 2 + ie[1]) > size || end < off) {
+        return false;
+    }
+    for (int i = 0; i < 3; i++) {
+        // group cipher, then the two counted suite lists
+        if (off + (i ? 2 : RSN_SELECTOR_LEN) > end) {
+            return pmkid == NULL && off == end;
+        }
+        off += i ? 2 + le16(&ie[off]) * RSN_SELECTOR_LEN : RSN_SELECTOR_LEN;
+        if (off > end) {
+            return false;
+        }
+    }
+    if (off + 2 > end) {
+        if (pmkid == NULL) {
+            return true;
+        }
+        if (off != end || off + 2 > size) {
+            return false;
+        }
+        ie[off] = ie[off + 1] = 0;
+        end = off + 2;
+    }
+    off += 2;
+    if (off + 2 <= end) {
+        listLen = 2 + le16(&ie[off]) * kItlPmkidLen;
+        if (off + listLen > end) {
+            return false;
+        }
+    }
+    tail = end - off - listLen;
+    // the count stays when the group management cipher follows
+    newListLen = pmkid ? 2 + kItlPmkidLen : (tail ? 2 : 0);
+    if (off + newListLen + tail > size || off + newListLen + tail - 2 > 255) {
+        return false;
+    }
+    memmove(&ie[off + newListLen], &ie[off + listLen], tail);
+    if (newListLen) {
+        ie[off] = pmkid ? 1 : 0;
+        ie[off + 1] = 0;
+    }
+    if (pmkid) {
+        memcpy(&ie[off + 2], pmkid, kItlPmkidLen);
+    }
+    ie[1] = (uint8_t)(off + newListLen + tail - 2);
+    return true;
+}
@@ -0,0 +1,95 @@
+//
+//  ItlPmksaCache.hpp
+//  BCMWLANFirmware_Hashstore
+//
+//  PMK security associations set by the supplicant, kept for fast reassociation.
+//
+
+#ifndef ItlPmksaCache_hpp
+#define ItlPmksaCache_hpp
+
+#include <IOKit/IOLib.h>
+#include <net/ethernet.h>
+#include "Airport/apple80211_ioctl.h"
+
+#define kItlPmksaMax                16
+#define kItlPmksaDefaultLifetimeS   43200   /* dot11RSNAConfigPMKLifetime */
+#define kItlPmkidLen                16
+#define kItlPmkMaxLen               APPLE80211_KEY_BUFF_LEN
+
+struct ItlPmksa {
+    uint8_t bssid[ETHER_ADDR_LEN];
+    uint8_t essid[APPLE80211_MAX_SSID_LEN];
+    uint8_t esslen;
+    bool valid;
+    bool hasPmkid;
+    uint8_t pmkid[kItlPmkidLen];
+    uint32_t pmkLen;        /* 0 when only the PMKID is known */
+    uint8_t pmk[kItlPmkMaxLen];
+    uint64_t expiresMS;
+    uint64_t usedMS;        /* LRU stamp */
+};
+
+struct ItlPmksaStats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t derived;       /* PMKIDs computed from a PMK of the same ESS */
+    uint32_t evictions;
+    uint32_t expired;
+};
+
+/*
+ * Bounded, keyed by BSSID. When full the least recently used entry gives
+ * way; entries past their lifetime are dropped on lookup. Only touched
+ * from the ioctl path and the workloop, so there is no locking.
+ */
+class ItlPmksaCache {
+
+public:
+
+    void init(uint32_t lifetimeS);
+
+    void addPmkid(const uint8_t *bssid, const uint8_t *essid, uint8_t esslen,
+                  const uint8_t *pmkid, uint64_t nowMS);
+
+    void addPmk(const uint8_t *bssid, const uint8_t *essid, uint8_t esslen,
+                const uint8_t *pmk, uint32_t len, uint64_t nowMS);
+
+    void remove(const uint8_t *bssid);
+
+    void flush();
+
+    /* Entry with a PMKID for the BSSID, counted as a hit or a miss. */
+    const struct ItlPmksa *lookup(const uint8_t *bssid, uint64_t nowMS);
+
+    /* Most recently used entry of the ESS that still holds its PMK. */
+    const struct ItlPmksa *lookupEss(const uint8_t *essid, uint8_t esslen, uint64_t nowMS);
+
+    void countDerived() { stats.derived++; }
+
+    void getStats(struct ItlPmksaStats *out) const { *out = stats; }
+
+    uint32_t getCount() const;
+
+    /*
+     * Rewrite the PMKID list of an RSN IE in place to carry only the given
+     * PMKID, or none when pmkid is NULL. Returns false when the IE can not
+     * be parsed or would not fit into size bytes.
+     */
+    static bool setRsnPmkid(uint8_t *ie, size_t size, const uint8_t *pmkid);
+
+private:
+
+    struct ItlPmksa *find(const uint8_t *bssid);
+
+    struct ItlPmksa *alloc(const uint8_t *bssid, const uint8_t *essid, uint8_t esslen, uint64_t nowMS);
+
+    bool expire(struct ItlPmksa *e, uint64_t nowMS);
+
+private:
+    struct ItlPmksa entries[kItlPmksaMax];
+    uint64_t lifetimeMS;
+    struct ItlPmksaStats stats;
+};
+
+#endif /* ItlPmksaCache_hpp */
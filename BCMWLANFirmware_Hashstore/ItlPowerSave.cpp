@@ -0,0 +1,104 @@
+//
+//  ItlPowerSave.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  APPLE80211_IOC_POWERSAVE modes and the traffic idle policy behind them.
+//
+
+#include "ItlPowerSave.hpp"
+
+void ItlPowerSave::
+init(uint32_t idleMS, UInt32 supported)
+{
+    this->idleMS = max(idleMS, (uint32_t)kItlPsSamplesPerIdle);
+    this->supported = supported | (1 << kItlPowerSaveCAM);
+    bzero(&this->stats, sizeof(this->stats));
+    // doze when idle out of the box if the driver can
+    if (!setMode(APPLE80211_POWERSAVE_MODE_VENDOR)) {
+        setMode(APPLE80211_POWERSAVE_MODE_DISABLED);
+    }
+    reset(0, 0);
+}
+
+int ItlPowerSave::
+deepestLevel() const
+{
+    for (int level = kItlPowerSaveLevelCount - 1; level > kItlPowerSaveCAM; level--) {
+        if (this->supported & (1 << level)) {
+            return level;
+        }
+    }
+    return kItlPowerSaveCAM;
+}
+
+bool ItlPowerSave::
+setMode(uint32_t mode)
+{
+    int level;
+    bool dynamic = false;
+
+    switch (mode) {
+        case APPLE80211_POWERSAVE_MODE_DISABLED:
+        case APPLE80211_POWERSAVE_MODE_MAX_THROUGHPUT:
+            level = kItlPowerSaveCAM;
+            break;
+        case APPLE80211_POWERSAVE_MODE_80211:
+            level = kItlPowerSavePSPoll;
+            break;
+        case APPLE80211_POWERSAVE_MODE_VENDOR:
+            level = deepestLevel();
+            dynamic = true;
+            break;
+        case APPLE80211_POWERSAVE_MODE_MAX_POWERSAVE:
+            level = deepestLevel();
+            break;
+
+        default:
+            return false;
+    }
+    if (mode != APPLE80211_POWERSAVE_MODE_DISABLED && mode != APPLE80211_POWERSAVE_MODE_MAX_THROUGHPUT &&
+        (level == kItlPowerSaveCAM || !(this->supported & (1 << level)))) {
+        return false;
+    }
+    this->mode = mode;
+    this->idleLevel = level;
+    this->dynamic = dynamic;
+    return true;
+}
+
+uint16_t ItlPowerSave::
+listenInterval() const
+{
+    return this->mode == APPLE80211_POWERSAVE_MODE_MAX_POWERSAVE ? kItlPsMaxListenInterval : 0;
+}
+
+void ItlPowerSave::
+reset(uint64_t packets, uint64_t nowMS)
+{
+    this->awake = true;
+    this->lastPackets = packets;
+    this->lastBusyMS = nowMS;
+}
+
+int ItlPowerSave::
+sample(uint64_t packets, uint64_t nowMS)
+{
+    uint64_t delta = packets - this->lastPackets;
+
+    this->lastPackets = packets;
+    if (!this->dynamic) {
+        return this->idleLevel;
+    }
+    if (delta >= kItlPsBusyPackets) {
+        // wake at once, latency matters more than the next few ms of power
+        if (!this->awake) {
+            this->awake = true;
+            this->stats.loadWakes++;
+        }
+        this->lastBusyMS = nowMS;
+    } else if (this->awake && nowMS - this->lastBusyMS >= this->idleMS) {
+        this->awake = false;
+        this->stats.idleDozes++;
+    }
+    return this->awake ? kItlPowerSaveCAM : this->idleLevel;
+}
@@ -0,0 +1,73 @@
+//
+//  ItlPowerSave.hpp
+//  BCMWLANFirmware_Hashstore
+//
+//  APPLE80211_IOC_POWERSAVE modes and the traffic idle policy behind them.
+//
+
+#ifndef ItlPowerSave_hpp
+#define ItlPowerSave_hpp
+
+#include <IOKit/IOLib.h>
+#include "Airport/apple80211_ioctl.h"
+#include "HAL/ItlHalService.hpp"
+
+#define kItlPsDefaultIdleMS         200     /* quiet time before dozing */
+#define kItlPsSamplesPerIdle        2       /* traffic samples per idle window */
+#define kItlPsBusyPackets           8       /* per sample, fewer is background chatter */
+#define kItlPsMaxListenInterval     3       /* beacons, APPLE80211_POWERSAVE_MODE_MAX_POWERSAVE only */
+
+struct ItlPowerSavePolicyStats {
+    uint32_t loadWakes;     /* dynamic mode woke up for traffic */
+    uint32_t idleDozes;     /* dynamic mode went back to dozing */
+};
+
+/*
+ * DISABLED and MAX_THROUGHPUT keep the radio awake, 80211 dozes with
+ * PS-Poll all the time and MAX_POWERSAVE dozes at the deepest level the
+ * driver has with a longer listen interval. VENDOR is dynamic: awake while
+ * the packet rate says the link is busy, dozing again after idleMS of
+ * quiet, so bursts see CAM latency and idle periods cost little power.
+ */
+class ItlPowerSave {
+
+public:
+
+    void init(uint32_t idleMS, UInt32 supported);
+
+    /* false when the mode is not one of the above or the driver lacks the level. */
+    bool setMode(uint32_t mode);
+
+    uint32_t getMode() const { return mode; }
+
+    bool isDynamic() const { return dynamic; }
+
+    uint32_t samplePeriodMS() const { return idleMS / kItlPsSamplesPerIdle; }
+
+    uint16_t listenInterval() const;
+
+    /* Start over from an awake radio, on association. */
+    void reset(uint64_t packets, uint64_t nowMS);
+
+    /* Feed the Tx+Rx packet count, returns the ItlPowerSaveLevel to run at. */
+    int sample(uint64_t packets, uint64_t nowMS);
+
+    void getStats(struct ItlPowerSavePolicyStats *out) const { *out = stats; }
+
+private:
+
+    int deepestLevel() const;
+
+private:
+    uint32_t mode;
+    UInt32 supported;       /* ItlDriverInfo::getPowerSaveSupport() */
+    int idleLevel;
+    bool dynamic;
+    bool awake;
+    uint32_t idleMS;
+    uint64_t lastPackets;
+    uint64_t lastBusyMS;
+    struct ItlPowerSavePolicyStats stats;
+};
+
+#endif /* ItlPowerSave_hpp */
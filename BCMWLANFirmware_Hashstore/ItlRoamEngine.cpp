@@ -0,0 +1,204 @@
+//
+//  ItlRoamEngine.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  RSSI threshold roaming driven by the APPLE80211_IOC_ROAM_PROFILE profile.
+//
+
+#include "ItlRoamEngine.hpp"
+
+void ItlRoamEngine::
+init()
+{
+    bzero(&this->profile, sizeof(this->profile));
+    this->profileValid = false;
+    this->triggerCount = 0;
+    reset();
+}
+
+void ItlRoamEngine::
+reset()
+{
+    bzero(this->bss, sizeof(this->bss));
+    this->currentRssi = 0;
+    this->triggered = false;
+    this->scanPeriodS = 0;
+    this->nextScanMS = 0;
+    this->lastScanMS = 0;
+}
+
+void ItlRoamEngine::
+setProfile(const struct apple80211_roam_profile_band_data *data)
+{
+    this->profile = *data;
+    if (this->profile.profile_cnt > kItlRoamMaxProfiles) {
+        this->profile.profile_cnt = kItlRoamMaxProfiles;
+    }
+    this->profileValid = this->profile.profile_cnt > 0;
+    // new thresholds apply from the next tick
+    this->triggered = false;
+    this->nextScanMS = 0;
+}
+
+bool ItlRoamEngine::
+getProfile(struct apple80211_roam_profile_band_data *data) const
+{
+    if (!this->profileValid) {
+        return false;
+    }
+    *data = this->profile;
+    return true;
+}
+
+/*
+ * Entries are ordered by descending trigger; the first one whose lower
+ * bound is below the RSSI is in charge.
+ */
+const struct apple80211_roam_profile *ItlRoamEngine::
+activeProfile(int rssi) const
+{
+    if (!this->profileValid) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < this->profile.profile_cnt; i++) {
+        if (rssi > (int8_t)this->profile.profiles[i].unk3) {
+            return &this->profile.profiles[i];
+        }
+    }
+    return &this->profile.profiles[this->profile.profile_cnt - 1];
+}
+
+struct ItlRoamBss *ItlRoamEngine::
+lookup(const uint8_t *bssid) const
+{
+    for (int i = 0; i < kItlRoamMaxBss; i++) {
+        if (this->bss[i].valid && memcmp(this->bss[i].bssid, bssid, ETHER_ADDR_LEN) == 0) {
+            return (struct ItlRoamBss *)&this->bss[i];
+        }
+    }
+    return NULL;
+}
+
+int ItlRoamEngine::
+sample(const uint8_t *bssid, int rssi, uint64_t nowMS)
+{
+    struct ItlRoamBss *b = lookup(bssid);
+
+    if (b == NULL) {
+        // take a free slot or the one heard from longest ago
+        b = &this->bss[0];
+        for (int i = 0; i < kItlRoamMaxBss && b->valid; i++) {
+            if (!this->bss[i].valid || this->bss[i].lastMS < b->lastMS) {
+                b = &this->bss[i];
+            }
+        }
+        memcpy(b->bssid, bssid, ETHER_ADDR_LEN);
+        b->valid = true;
+        b->rssi = rssi * (1 << kItlRoamEwmaShift);
+    } else {
+        b->rssi += rssi - b->rssi / (1 << kItlRoamEwmaShift);
+    }
+    b->lastMS = nowMS;
+    return b->rssi / (1 << kItlRoamEwmaShift);
+}
+
+void ItlRoamEngine::
+scanDone(uint64_t nowMS)
+{
+    this->lastScanMS = nowMS;
+}
+
+void ItlRoamEngine::
+sampleScan(const uint8_t *bssid, int rssi, uint32_t stamp, uint64_t nowMS)
+{
+    struct ItlRoamBss *b = lookup(bssid);
+
+    if (b != NULL && b->stamp == stamp) {
+        return;
+    }
+    sample(bssid, rssi, nowMS);
+    lookup(bssid)->stamp = stamp;
+}
+
+int ItlRoamEngine::
+smoothed(const uint8_t *bssid, int fallback) const
+{
+    struct ItlRoamBss *b = lookup(bssid);
+
+    return b ? b->rssi / (1 << kItlRoamEwmaShift) : fallback;
+}
+
+bool ItlRoamEngine::
+candidate(const uint8_t *bssid, int *rssi) const
+{
+    struct ItlRoamBss *b = lookup(bssid);
+
+    if (b == NULL || this->lastScanMS == 0 || b->lastMS < this->lastScanMS) {
+        return false;
+    }
+    *rssi = b->rssi / (1 << kItlRoamEwmaShift);
+    return true;
+}
+
+int ItlRoamEngine::
+getTrigger() const
+{
+    const struct apple80211_roam_profile *p = activeProfile(this->currentRssi);
+
+    return p ? (int8_t)p->unk2 : kItlRoamDefaultTrigger;
+}
+
+bool ItlRoamEngine::
+scanDue(int rssi, uint64_t nowMS)
+{
+    const struct apple80211_roam_profile *p;
+    uint32_t maxS;
+
+    this->currentRssi = rssi;
+    if (rssi >= getTrigger()) {
+        this->triggered = false;
+        return false;
+    }
+    p = activeProfile(rssi);
+    if (!this->triggered) {
+        this->triggered = true;
+        this->triggerCount++;
+        this->scanPeriodS = (p && p->unk9) ? p->unk9 : kItlRoamDefaultScanS;
+        this->nextScanMS = nowMS;
+    }
+    if (nowMS < this->nextScanMS) {
+        return false;
+    }
+    this->nextScanMS = nowMS + (uint64_t)this->scanPeriodS * 1000;
+    maxS = (p && p->unk11) ? p->unk11 : kItlRoamDefaultMaxScanS;
+    this->scanPeriodS = min(this->scanPeriodS * ((p && p->unk10) ? p->unk10 : 2), maxS);
+    return true;
+}
+
+int ItlRoamEngine::
+score(int rssi, bool is5GHz) const
+{
+    const struct apple80211_roam_profile *p = activeProfile(this->currentRssi);
+
+    if (p && is5GHz && p->unk6 && rssi > (int8_t)p->unk5) {
+        return rssi + p->unk6;
+    }
+    return rssi;
+}
+
+bool ItlRoamEngine::
+shouldRoam(int current, int candidateScore) const
+{
+    const struct apple80211_roam_profile *p = activeProfile(current);
+    int delta = (p && p->unk4) ? p->unk4 : kItlRoamDefaultDelta;
+
+    return this->triggered && candidateScore >= current + delta;
+}
+
+void ItlRoamEngine::
+roamed()
+{
+    // the new BSS starts from its own samples, the old one may come back as a candidate
+    this->triggered = false;
+    this->nextScanMS = 0;
+}
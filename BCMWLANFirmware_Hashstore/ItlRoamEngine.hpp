@@ -0,0 +1,106 @@
+//
+//  ItlRoamEngine.hpp
+//  BCMWLANFirmware_Hashstore
+//
+//  RSSI threshold roaming driven by the APPLE80211_IOC_ROAM_PROFILE profile.
+//
+
+#ifndef ItlRoamEngine_hpp
+#define ItlRoamEngine_hpp
+
+#include <IOKit/IOLib.h>
+#include <net/ethernet.h>
+#include "Airport/apple80211_ioctl.h"
+
+#define kItlRoamMaxBss              16
+#define kItlRoamEwmaShift           3       /* a new sample weighs 1/8 */
+#define kItlRoamDefaultTrigger      -75     /* dBm, used until a profile is set */
+#define kItlRoamDefaultDelta        10      /* dB a candidate has to be better by */
+#define kItlRoamDefaultScanS        10
+#define kItlRoamDefaultMaxScanS     60
+#define kItlRoamMaxProfiles         4
+
+/*
+ * The profile entries are the firmware's wl_roam_prof_t, field by field:
+ * unk1 flags, unk2 roam trigger (dBm), unk3 lower RSSI bound of the entry,
+ * unk4 roam delta (dB), unk5/unk6 5 GHz boost threshold and delta,
+ * unk7 nfscan, unk8 full scan period, unk9 initial scan period,
+ * unk10 scan backoff multiplier, unk11 max scan period (seconds).
+ */
+struct ItlRoamBss {
+    uint8_t bssid[ETHER_ADDR_LEN];
+    bool valid;
+    int32_t rssi;           /* smoothed dBm, << kItlRoamEwmaShift */
+    uint64_t lastMS;
+    uint32_t stamp;         /* node rx stamp and raw RSSI at the last scan sample */
+};
+
+class ItlRoamEngine {
+
+public:
+
+    void init();
+
+    void setProfile(const struct apple80211_roam_profile_band_data *data);
+
+    bool getProfile(struct apple80211_roam_profile_band_data *data) const;
+
+    /* Forget samples and scan backoff, on association changes. */
+    void reset();
+
+    /* Feed a raw RSSI sample of a BSS and return its smoothed value. */
+    int sample(const uint8_t *bssid, int rssi, uint64_t nowMS);
+
+    /* Smoothed dBm of a BSS, fallback when it was never sampled. */
+    int smoothed(const uint8_t *bssid, int fallback) const;
+
+    /* A scan finished, neighbours not sampled from now on are stale. */
+    void scanDone(uint64_t nowMS);
+
+    /*
+     * Feed the RSSI of a neighbour found in the scan cache. stamp changes
+     * whenever a frame of the BSS was received, an unchanged one means the
+     * scan did not hear it and the sample is dropped.
+     */
+    void sampleScan(const uint8_t *bssid, int rssi, uint32_t stamp, uint64_t nowMS);
+
+    /* Smoothed dBm of a neighbour heard in the last scan. */
+    bool candidate(const uint8_t *bssid, int *rssi) const;
+
+    /*
+     * Called every tick with the smoothed RSSI of the current BSS. Returns
+     * true when a background scan for candidates is due; while the RSSI
+     * stays under the trigger the period backs off up to the max.
+     */
+    bool scanDue(int rssi, uint64_t nowMS);
+
+    /* Candidate RSSI with the 5 GHz boost of the active profile applied. */
+    int score(int rssi, bool is5GHz) const;
+
+    bool shouldRoam(int current, int candidateScore) const;
+
+    void roamed();
+
+    int getTrigger() const;
+
+    uint32_t getTriggerCount() const { return triggerCount; }
+
+private:
+
+    const struct apple80211_roam_profile *activeProfile(int rssi) const;
+
+    struct ItlRoamBss *lookup(const uint8_t *bssid) const;
+
+private:
+    struct apple80211_roam_profile_band_data profile;
+    bool profileValid;
+    struct ItlRoamBss bss[kItlRoamMaxBss];
+    int currentRssi;
+    bool triggered;
+    uint32_t triggerCount;  /* times the current BSS fell under the trigger */
+    uint32_t scanPeriodS;
+    uint64_t nextScanMS;
+    uint64_t lastScanMS;
+};
+
+#endif /* ItlRoamEngine_hpp */
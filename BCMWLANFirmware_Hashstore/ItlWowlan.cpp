@@ -0,0 +1,168 @@
+//
+//  ItlWowlan.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Wake on wireless settings from APPLE80211_IOC_WOW_PARAMETERS and the wake reason at resume.
+//
+
+#include "ItlWowlan.hpp"
+#include <sys/systm.h>
+
+#define WAKE_COND(map, cond) ((map)[(cond) / NBBY] & (1 << ((cond) % NBBY)))
+
+void ItlWowlan::
+init()
+{
+    bzero(this->wakeConds, sizeof(this->wakeConds));
+    this->beaconLossMS = 0;
+    this->patternCount = 0;
+    this->magic = false;
+    this->inWowlan = false;
+    clearRekeyKeys();
+    bzero(&this->stats, sizeof(this->stats));
+}
+
+IOReturn ItlWowlan::
+setParameters(const struct apple80211_wow_parameter_data *data)
+{
+    uint32_t count = 0;
+
+    if (data->pattern_count > APPLE80211_MAX_WOW_PATTERNS) {
+        return kIOReturnBadArgument;
+    }
+    for (uint32_t i = 0; i < data->pattern_count; i++) {
+        const struct apple80211_wow_pattern *p = &data->patterns[i];
+        struct ItlWowPattern *dst = &this->patterns[count];
+
+        // the bytes are airportd's, the ioctl only copied the pointers in
+        if (p->len == 0 || p->len > kItlWowMaxPatternLen || p->pattern == NULL ||
+            copyin(CAST_USER_ADDR_T(p->pattern), dst->bytes, p->len) != 0) {
+            this->stats.droppedPatterns++;
+            continue;
+        }
+        dst->len = (uint32_t)p->len;
+        count++;
+    }
+    this->patternCount = count;
+    memcpy(this->wakeConds, data->wake_cond_map, sizeof(this->wakeConds));
+    this->beaconLossMS = data->beacon_loss_time;
+    return kIOReturnSuccess;
+}
+
+void ItlWowlan::
+getParameters(struct apple80211_wow_parameter_data *data) const
+{
+    memcpy(data->wake_cond_map, this->wakeConds, sizeof(this->wakeConds));
+    data->beacon_loss_time = this->beaconLossMS;
+    data->pattern_count = this->patternCount;
+    bzero(data->patterns, sizeof(data->patterns));
+    for (uint32_t i = 0; i < this->patternCount; i++) {
+        data->patterns[i].len = this->patterns[i].len;
+    }
+}
+
+void ItlWowlan::
+setRekeyKeys(const uint8_t *kck, uint32_t kckLen, const uint8_t *kek, uint32_t kekLen)
+{
+    if (kckLen != kItlWowKckLen || kekLen < 16 || kekLen > kItlWowKekLen) {
+        clearRekeyKeys();
+        return;
+    }
+    bzero(this->kek, sizeof(this->kek));
+    memcpy(this->kck, kck, kckLen);
+    memcpy(this->kek, kek, kekLen);
+    this->hasRekeyKeys = true;
+}
+
+void ItlWowlan::
+clearRekeyKeys()
+{
+    bzero(this->kck, sizeof(this->kck));
+    bzero(this->kek, sizeof(this->kek));
+    this->hasRekeyKeys = false;
+}
+
+bool ItlWowlan::
+buildConfig(struct ItlWowConfig *config, UInt32 supported, uint64_t replayCounter) const
+{
+    uint32_t triggers = 0;
+
+    bzero(config, sizeof(*config));
+    if (this->magic || WAKE_COND(this->wakeConds, APPLE80211_WAKE_COND_MAGIC_PATTERN)) {
+        triggers |= kItlWakeOnMagic;
+    }
+    if (this->patternCount && WAKE_COND(this->wakeConds, APPLE80211_WAKE_COND_NET_PATTERN)) {
+        triggers |= kItlWakeOnPattern;
+    }
+    if (WAKE_COND(this->wakeConds, APPLE80211_WAKE_COND_DISASSOCIATED) ||
+        WAKE_COND(this->wakeConds, APPLE80211_WAKE_COND_DEAUTHED)) {
+        triggers |= kItlWakeOnDisconnect;
+    }
+    if (this->beaconLossMS && WAKE_COND(this->wakeConds, APPLE80211_WAKE_COND_BEACON_LOSS)) {
+        triggers |= kItlWakeOnBeaconLoss;
+    }
+    // nothing asked to wake us, keep the old full power down
+    if ((triggers & supported) == 0) {
+        return false;
+    }
+    // a failed rekey leaves the link unusable, as good as a disconnect
+    if (this->hasRekeyKeys) {
+        config->rekey = true;
+        memcpy(config->kck, this->kck, sizeof(config->kck));
+        memcpy(config->kek, this->kek, sizeof(config->kek));
+        config->replayCounter = replayCounter;
+        if (triggers & kItlWakeOnDisconnect) {
+            triggers |= kItlWakeOnGtkRekeyFailure;
+        }
+    }
+    config->triggers = triggers & supported;
+    config->beaconLossMS = this->beaconLossMS;
+    if (config->triggers & kItlWakeOnPattern) {
+        config->patternCount = this->patternCount;
+        memcpy(config->patterns, this->patterns, sizeof(config->patterns[0]) * this->patternCount);
+    }
+    return true;
+}
+
+void ItlWowlan::
+armed(bool ok)
+{
+    this->inWowlan = ok;
+    if (ok) {
+        this->stats.armed++;
+    } else {
+        this->stats.armFailures++;
+    }
+}
+
+void ItlWowlan::
+recordWake(int reason)
+{
+    if (reason < kItlWakeReasonNone || reason >= kItlWakeReasonCount) {
+        reason = kItlWakeReasonOther;
+    }
+    this->stats.wakes[reason]++;
+    this->stats.lastReason = reason;
+    this->inWowlan = false;
+}
+
+const char *ItlWowlan::
+reasonName(int reason)
+{
+    switch (reason) {
+        case kItlWakeReasonNone:
+            return "none";
+        case kItlWakeReasonMagic:
+            return "magic packet";
+        case kItlWakeReasonPattern:
+            return "pattern";
+        case kItlWakeReasonDisconnect:
+            return "disconnect";
+        case kItlWakeReasonBeaconLoss:
+            return "beacon loss";
+        case kItlWakeReasonGtkRekeyFailure:
+            return "GTK rekey failure";
+        default:
+            return "other";
+    }
+}
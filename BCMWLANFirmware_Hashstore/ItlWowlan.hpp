@@ -0,0 +1,78 @@
+//
+//  ItlWowlan.hpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Wake on wireless settings from APPLE80211_IOC_WOW_PARAMETERS and the wake reason at resume.
+//
+
+#ifndef ItlWowlan_hpp
+#define ItlWowlan_hpp
+
+#include <IOKit/IOLib.h>
+#include "Airport/apple80211_ioctl.h"
+#include "HAL/ItlHalService.hpp"
+
+static_assert(kItlWowMaxPatterns == APPLE80211_MAX_WOW_PATTERNS,
+              "ItlWowConfig has to hold every pattern APPLE80211_IOC_WOW_PARAMETERS can carry");
+
+struct ItlWowlanStats {
+    uint32_t armed;         /* suspends with triggers programmed */
+    uint32_t armFailures;
+    uint32_t droppedPatterns;   /* too long or unreadable */
+    uint32_t wakes[kItlWakeReasonCount];
+    int lastReason;
+};
+
+/*
+ * Keeps what airportd asked for (wake conditions, patterns), the magic
+ * packet filter of IOEthernetController and the KCK/KEK of the current
+ * PTK, and turns them into the ItlWowConfig handed to the driver at
+ * suspend. The rekey keys are secrets and go away with the association.
+ */
+class ItlWowlan {
+
+public:
+
+    void init();
+
+    IOReturn setParameters(const struct apple80211_wow_parameter_data *data);
+
+    /* Pattern bytes stay in the kernel, only their lengths are reported. */
+    void getParameters(struct apple80211_wow_parameter_data *data) const;
+
+    void setMagicPacket(bool enable) { magic = enable; }
+
+    void setRekeyKeys(const uint8_t *kck, uint32_t kckLen, const uint8_t *kek, uint32_t kekLen);
+
+    void clearRekeyKeys();
+
+    /*
+     * Fill config for an associated suspend with the triggers the driver
+     * supports. Returns false when there is nothing to wake on.
+     */
+    bool buildConfig(struct ItlWowConfig *config, UInt32 supported, uint64_t replayCounter) const;
+
+    void armed(bool ok);
+
+    void recordWake(int reason);
+
+    bool wasArmed() const { return inWowlan; }
+
+    void getStats(struct ItlWowlanStats *out) const { *out = stats; }
+
+    static const char *reasonName(int reason);
+
+private:
+    uint8_t wakeConds[APPLE80211_MAP_SIZE(APPLE80211_MAX_WAKE_COND + 1)];
+    uint32_t beaconLossMS;
+    uint32_t patternCount;
+    struct ItlWowPattern patterns[kItlWowMaxPatterns];
+    bool magic;
+    bool hasRekeyKeys;
+    uint8_t kck[kItlWowKckLen];
+    uint8_t kek[kItlWowKekLen];
+    bool inWowlan;          /* triggers programmed for the current sleep */
+    struct ItlWowlanStats stats;
+};
+
+#endif /* ItlWowlan_hpp */
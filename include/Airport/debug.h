@@ -9,7 +9,7 @@
 #ifndef debug_h
 #define debug_h
 
-static const char* IOCTL_NAMES[] = {
+static constexpr const char* IOCTL_NAMES[] = {
      "UNKNOWN",
      "SSID",
      "AUTH_TYPE",
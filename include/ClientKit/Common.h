@@ -114,6 +114,29 @@ struct ioctl_tx_power {
     unsigned int version;
 };
 
+#define ITL_IOCTL_STATS_HIST    16  //bucket i counts calls of [2^(i-1), 2^i) us, the last one is open ended
+#define ITL_IOCTL_STATS_MAX     40
+#define ITL_IOCTL_STATS_FUNCTION    "ItlApple80211Stats"    //callPlatformFunction name on the HAL's controller
+
+struct ioctl_apple80211_stat {
+    uint32_t request;   //APPLE80211_IOC_*
+    uint32_t gets;
+    uint32_t sets;
+    uint32_t errors;
+    uint32_t unhandled;
+    uint32_t max_us;
+    uint64_t total_us;
+    uint32_t hist[ITL_IOCTL_STATS_HIST];
+};
+
+struct ioctl_apple80211_stats {
+    unsigned int version;
+    uint32_t active;    //request numbers seen so far, may exceed count
+    uint32_t count;     //busiest entries filled in below
+    uint32_t unhandled_other;   //request numbers beyond the driver's table
+    struct ioctl_apple80211_stat stats[ITL_IOCTL_STATS_MAX];
+};
+
 /*
  * 802.11 ciphers.
  */
@@ -149,6 +172,30 @@ enum itl80211_akm {
     ITL80211_AKM_SHA256_PSK    = 0x00000008    /* 11w */
 };
 
+#define ITL_INT_MODERATION_FUNCTION "ItlInterruptModeration"    //callPlatformFunction name on the HAL's controller
+
+enum itl_int_moderation_mode {
+    ITL_INT_MODERATION_OFF,
+    ITL_INT_MODERATION_ADAPTIVE,
+    ITL_INT_MODERATION_FIXED
+};
+
+struct ioctl_int_moderation {
+    unsigned int version;
+    uint32_t mode;          //itl_int_moderation_mode
+    uint32_t low_delay_us;  //adaptive, below low_pps
+    uint32_t high_delay_us; //adaptive from high_pps on, fixed always
+    uint32_t low_pps;
+    uint32_t high_pps;
+    //read only
+    uint32_t delay_us;      //in effect
+    uint32_t intr_per_sec;
+    uint32_t pkts_per_intr; //in 1/100
+    uint32_t switches;
+    uint64_t interrupts;
+    uint64_t packets;
+};
+
 struct ioctl_network_info {
     unsigned char ssid[NWID_LEN];
     int16_t noise;
@@ -28,6 +28,8 @@ enum IOCTL_IDS {
     IOCTL_80211_SCAN,
     IOCTL_80211_SCAN_RESULT,
     IOCTL_80211_TX_POWER_LEVEL,
+    IOCTL_80211_APPLE80211_STATS,
+    IOCTL_80211_INT_MODERATION,
     
     IOCTL_ID_MAX
 };
@@ -0,0 +1,325 @@
+/*
+* Copyright (C) 2020  钟先耀
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include "FwData.h"
+#include <IOKit/IOLib.h>
+#include <kern/thread_call.h>
+#include <sys/sysctl.h>
+
+#define kFwCacheSlots           4       /* firmware, NVRAM, CLM blob and a spare */
+#define kFwCacheChunk           (32 * 1024)
+#define kFwCacheMaxImage        (16 * 1024 * 1024)
+#define kFwCachePollS           10
+#define kFwCacheLowMemoryLevel  15      /* kern.memorystatus_level, percent available */
+
+struct FwCacheEntry {
+    const char *name;       /* fwList storage */
+    OSData *data;
+    uint64_t lastUseMS;
+};
+
+static IOLock *fwCacheLock;
+static thread_call_t fwCacheCall;
+static uint32_t fwCacheLifetimeS;
+static struct FwCacheEntry fwCache[kFwCacheSlots];
+static struct FwCacheStats fwCacheStats;
+
+/* mach time, so the lifetime does not run out while the machine sleeps */
+static uint64_t fwCacheNowMS()
+{
+    uint64_t ns;
+
+    absolutetime_to_nanoseconds(mach_absolute_time(), &ns);
+    return ns / 1000000;
+}
+
+static const struct FwDesc *findFWDesc(const char *name)
+{
+    for (int i = 0; i < fwNumber; i++) {
+        if (strcmp(fwList[i].name, name) == 0) {
+            return &fwList[i];
+        }
+    }
+    return NULL;
+}
+
+/* The blobs do not carry their inflated size, so grow the result chunk by chunk. */
+static OSData *inflateFirmware(const struct FwDesc *desc)
+{
+    z_stream stream;
+    OSData *out;
+    unsigned char *chunk;
+    int err = Z_DATA_ERROR;
+
+    out = OSData::withCapacity(desc->size * 4);
+    chunk = (unsigned char *)IOMalloc(kFwCacheChunk);
+    if (out == NULL || chunk == NULL) {
+        OSSafeReleaseNULL(out);
+        if (chunk) {
+            IOFree(chunk, kFwCacheChunk);
+        }
+        return NULL;
+    }
+    bzero(&stream, sizeof(stream));
+    stream.next_in = (Bytef *)desc->var;
+    stream.avail_in = desc->size;
+    stream.zalloc = zcalloc;
+    stream.zfree = zcfree;
+    if (inflateInit(&stream) == Z_OK) {
+        do {
+            stream.next_out = chunk;
+            stream.avail_out = kFwCacheChunk;
+            err = inflate(&stream, Z_NO_FLUSH);
+            if (err != Z_OK && err != Z_STREAM_END) {
+                break;
+            }
+            if (!out->appendBytes(chunk, kFwCacheChunk - stream.avail_out) || out->getLength() > kFwCacheMaxImage) {
+                err = Z_MEM_ERROR;
+                break;
+            }
+        } while (err != Z_STREAM_END);
+        inflateEnd(&stream);
+    }
+    IOFree(chunk, kFwCacheChunk);
+    if (err != Z_STREAM_END) {
+        IOLog("itlwm: %s %s: inflate failed %d\n", __FUNCTION__, desc->name, err);
+        out->release();
+        return NULL;
+    }
+    return out;
+}
+
+static bool lowMemory()
+{
+    int level = 100;
+    size_t len = sizeof(level);
+
+    if (sysctlbyname("kern.memorystatus_level", &level, &len, NULL, 0) != 0) {
+        return false;
+    }
+    return level < kFwCacheLowMemoryLevel;
+}
+
+/* Lock held. */
+static void fwCacheArm()
+{
+    uint64_t deadline;
+
+    clock_interval_to_deadline(kFwCachePollS, kSecondScale, &deadline);
+    thread_call_enter_delayed(fwCacheCall, deadline);
+}
+
+/* Lock held. */
+static void dropEntry(struct FwCacheEntry *e)
+{
+    fwCacheStats.images--;
+    fwCacheStats.bytes -= e->data->getLength();
+    e->data->release();
+    bzero(e, sizeof(*e));
+}
+
+static void fwCachePoll(thread_call_param_t param0, thread_call_param_t param1)
+{
+    uint64_t nowMS = fwCacheNowMS();
+    bool pressure = lowMemory();
+
+    IOLockLock(fwCacheLock);
+    for (int i = 0; i < kFwCacheSlots; i++) {
+        struct FwCacheEntry *e = &fwCache[i];
+
+        if (e->data == NULL) {
+            continue;
+        }
+        if (pressure) {
+            fwCacheStats.pressureDrops++;
+            dropEntry(e);
+        } else if (nowMS - e->lastUseMS >= (uint64_t)fwCacheLifetimeS * 1000) {
+            fwCacheStats.expired++;
+            dropEntry(e);
+        }
+    }
+    if (fwCacheStats.images) {
+        fwCacheArm();
+    }
+    IOLockUnlock(fwCacheLock);
+}
+
+bool fwCacheInit(uint32_t lifetimeS)
+{
+    if (fwCacheLock) {
+        return true;
+    }
+    if (lifetimeS == 0) {
+        return false;
+    }
+    fwCacheLock = IOLockAlloc();
+    fwCacheCall = thread_call_allocate(fwCachePoll, NULL);
+    if (fwCacheLock == NULL || fwCacheCall == NULL) {
+        fwCacheFree();
+        return false;
+    }
+    fwCacheLifetimeS = lifetimeS;
+    bzero(fwCache, sizeof(fwCache));
+    bzero(&fwCacheStats, sizeof(fwCacheStats));
+    return true;
+}
+
+void fwCacheFree()
+{
+    if (fwCacheCall) {
+        thread_call_cancel_wait(fwCacheCall);
+        thread_call_free(fwCacheCall);
+        fwCacheCall = NULL;
+    }
+    if (fwCacheLock) {
+        for (int i = 0; i < kFwCacheSlots; i++) {
+            if (fwCache[i].data) {
+                dropEntry(&fwCache[i]);
+            }
+        }
+        IOLockFree(fwCacheLock);
+        fwCacheLock = NULL;
+    }
+}
+
+OSData *getFWCached(const char *name)
+{
+    const struct FwDesc *desc = findFWDesc(name);
+    struct FwCacheEntry *e;
+    struct FwCacheEntry *slot = NULL;
+    OSData *data;
+
+    if (desc == NULL) {
+        return NULL;
+    }
+    if (fwCacheLock == NULL) {
+        return inflateFirmware(desc);
+    }
+    IOLockLock(fwCacheLock);
+    for (int i = 0; i < kFwCacheSlots; i++) {
+        if (fwCache[i].data && fwCache[i].name == desc->name) {
+            fwCache[i].lastUseMS = fwCacheNowMS();
+            fwCacheStats.hits++;
+            data = fwCache[i].data;
+            data->retain();
+            IOLockUnlock(fwCacheLock);
+            return data;
+        }
+    }
+    fwCacheStats.misses++;
+    IOLockUnlock(fwCacheLock);
+
+    // inflate without the lock, a racing caller just inflates once more
+    if ((data = inflateFirmware(desc)) == NULL) {
+        return NULL;
+    }
+    IOLockLock(fwCacheLock);
+    for (int i = 0; i < kFwCacheSlots; i++) {
+        e = &fwCache[i];
+        if (e->data && e->name == desc->name) {
+            // a racing caller got there first, keep its copy
+            slot = NULL;
+            break;
+        }
+        // a free slot, else the least recently used one
+        if (slot == NULL || (slot->data && (e->data == NULL || e->lastUseMS < slot->lastUseMS))) {
+            slot = e;
+        }
+    }
+    if (slot) {
+        if (slot->data) {
+            dropEntry(slot);
+        }
+        slot->name = desc->name;
+        slot->data = data;
+        slot->lastUseMS = fwCacheNowMS();
+        data->retain();
+        fwCacheStats.images++;
+        fwCacheStats.bytes += data->getLength();
+        fwCacheArm();
+    }
+    IOLockUnlock(fwCacheLock);
+    return data;
+}
+
+OSData *getFWDescByName(const char *name)
+{
+    const struct FwDesc *desc = findFWDesc(name);
+
+    if (desc == NULL) {
+        return NULL;
+    }
+    return OSData::withBytesNoCopy((void *)desc->var, desc->size);
+}
+
+/* Callers may have copied the blob, so match the bytes when the pointer differs. */
+static const struct FwDesc *findFWDescByBlob(const unsigned char *source, uint sourceLen)
+{
+    for (int i = 0; i < fwNumber; i++) {
+        if ((uint)fwList[i].size == sourceLen &&
+            (fwList[i].var == source || memcmp(fwList[i].var, source, sourceLen) == 0)) {
+            return &fwList[i];
+        }
+    }
+    return NULL;
+}
+
+bool uncompressFirmware(unsigned char *dest, uint *destLen, unsigned char *source, uint sourceLen)
+{
+    const struct FwDesc *desc = findFWDescByBlob(source, sourceLen);
+    z_stream stream;
+    OSData *data;
+    bool ok;
+    int err;
+
+    if (desc && (data = getFWCached(desc->name)) != NULL) {
+        ok = data->getLength() <= *destLen;
+        if (ok) {
+            memcpy(dest, data->getBytesNoCopy(), data->getLength());
+            *destLen = data->getLength();
+        }
+        data->release();
+        return ok;
+    }
+    stream.next_in = source;
+    stream.avail_in = sourceLen;
+    stream.next_out = dest;
+    stream.avail_out = *destLen;
+    stream.zalloc = zcalloc;
+    stream.zfree = zcfree;
+    err = inflateInit(&stream);
+    if (err != Z_OK) {
+        return false;
+    }
+    err = inflate(&stream, Z_FINISH);
+    if (err != Z_STREAM_END) {
+        inflateEnd(&stream);
+        return false;
+    }
+    *destLen = (uint)stream.total_out;
+
+    err = inflateEnd(&stream);
+    return err == Z_OK;
+}
+
+void fwCacheGetStats(struct FwCacheStats *out)
+{
+    if (fwCacheLock == NULL) {
+        bzero(out, sizeof(*out));
+        return;
+    }
+    IOLockLock(fwCacheLock);
+    *out = fwCacheStats;
+    IOLockUnlock(fwCacheLock);
+}
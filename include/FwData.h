@@ -33,40 +33,39 @@ struct FwDesc {
 extern const struct FwDesc fwList[];
 extern const int fwNumber;
 
-static inline OSData *getFWDescByName(const char* name) {
-    for (int i = 0; i < fwNumber; i++) {
-        if (strcmp(fwList[i].name, name) == 0) {
-            FwDesc desc = fwList[i];
-            return OSData::withBytes(desc.var, desc.size);
-        }
-    }
-    return NULL;
-}
+/*
+ * Decompressed images, kept resident for lifetimeS seconds of awake time
+ * after their last use so a re-init after sleep or a radio off/on skips
+ * the inflate. Everything is dropped early when the system runs low on
+ * memory. Without fwCacheInit() every call inflates afresh.
+ */
+struct FwCacheStats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t expired;       /* dropped after the lifetime */
+    uint32_t pressureDrops; /* images dropped for memory pressure */
+    uint32_t images;        /* resident now */
+    uint64_t bytes;         /* resident now */
+};
+
+#define kFwCacheDefaultLifetimeS    900
+
+bool fwCacheInit(uint32_t lifetimeS);
 
-static inline bool uncompressFirmware(unsigned char *dest, uint *destLen, unsigned char *source, uint sourceLen)
-{
-    z_stream stream;
-    int err;
-    
-    stream.next_in = source;
-    stream.avail_in = sourceLen;
-    stream.next_out = dest;
-    stream.avail_out = *destLen;
-    stream.zalloc = zcalloc;
-    stream.zfree = zcfree;
-    err = inflateInit(&stream);
-    if (err != Z_OK) {
-        return false;
-    }
-    err = inflate(&stream, Z_FINISH);
-    if (err != Z_STREAM_END) {
-        inflateEnd(&stream);
-        return false;
-    }
-    *destLen = (uint)stream.total_out;
+void fwCacheFree();
+
+/* Decompressed image of a fwList entry, retained for the caller. NULL if unknown. */
+OSData *getFWCached(const char *name);
+
+void fwCacheGetStats(struct FwCacheStats *out);
+
+/*
+ * Compressed blob of a fwList entry, not copied. Handing its bytes to
+ * uncompressFirmware() takes the image from the cache above.
+ */
+OSData *getFWDescByName(const char *name);
 
-    err = inflateEnd(&stream);
-    return err == Z_OK;
-}
+/* Inflates source into dest, from the cache when source is a fwList blob. */
+bool uncompressFirmware(unsigned char *dest, uint *destLen, unsigned char *source, uint sourceLen);
 
 #endif /* FwData_h */
@@ -0,0 +1,56 @@
+/*
+* Copyright (C) 2020  钟先耀
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef ItlDeadline_hpp
+#define ItlDeadline_hpp
+
+#include <stdint.h>
+
+/* Deadline that never passes; as a timeout it is OpenBSD's INFSLP. */
+#define kItlWaitForever         UINT64_MAX
+
+/*
+ * Absolute mach time deadline nsec after now, for the timebase numer/denom
+ * (ns = ticks * numer / denom). A 0 timeout is already due, the wait only
+ * polls. A deadline past the end of the clock saturates to kItlWaitForever
+ * instead of wrapping into the past.
+ */
+static constexpr uint64_t
+itlDeadline(uint64_t now, uint64_t nsec, uint32_t numer, uint32_t denom)
+{
+    if (nsec == kItlWaitForever || nsec / numer > kItlWaitForever / denom) {
+        return kItlWaitForever;
+    }
+    // split so nsec * denom does not overflow, then the sum of the halves must not either
+    uint64_t whole = nsec / numer * denom;
+    uint64_t part = nsec % numer * denom / numer;
+
+    if (part > kItlWaitForever - whole) {
+        return kItlWaitForever;
+    }
+    uint64_t interval = whole + part;
+
+    return interval >= kItlWaitForever - now ? kItlWaitForever : now + interval;
+}
+
+// x86 counts in ns, Apple silicon runs a 24 MHz timebase of 125/3
+static_assert(itlDeadline(1000, 0, 1, 1) == 1000, "a zero timeout is due at once");
+static_assert(itlDeadline(1000, 3000000000ULL, 1, 1) == 3000001000ULL, "3 s keeps its seconds");
+static_assert(itlDeadline(0, 1000000000ULL, 125, 3) == 24000000, "1 s is 24M ticks at 24 MHz");
+static_assert(itlDeadline(0, 1000, 125, 3) == 24, "1 us is 24 ticks at 24 MHz");
+static_assert(itlDeadline(0, 1041, 125, 3) == 24, "partial ticks round down");
+static_assert(itlDeadline(5, kItlWaitForever, 1, 1) == kItlWaitForever, "INFSLP waits forever");
+static_assert(itlDeadline(UINT64_MAX - 10, 1000, 1, 1) == kItlWaitForever, "saturates at the end of the clock");
+
+#endif /* ItlDeadline_hpp */
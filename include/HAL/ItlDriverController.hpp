@@ -15,6 +15,69 @@
 #ifndef ItlDriverController_h
 #define ItlDriverController_h
 
+/*
+ * Firmware power save levels, from the highest power draw down. Drivers
+ * report the ones they implement with ItlDriverInfo::getPowerSaveSupport().
+ */
+enum ItlPowerSaveLevel {
+    kItlPowerSaveCAM,       /* constantly awake */
+    kItlPowerSavePSPoll,    /* doze between beacons, buffered frames are fetched with PS-Poll */
+    kItlPowerSaveUapsd,     /* doze, the AP delivers on trigger frames of the U-APSD ACs */
+    kItlPowerSaveLevelCount
+};
+
+/* Wake on wireless triggers, ItlWowConfig::triggers bits. */
+enum ItlWakeTrigger {
+    kItlWakeOnMagic             = 1 << 0,   /* magic packet to our address */
+    kItlWakeOnPattern           = 1 << 1,   /* ItlWowConfig::patterns */
+    kItlWakeOnDisconnect        = 1 << 2,   /* deauth or disassoc from the AP */
+    kItlWakeOnBeaconLoss        = 1 << 3,   /* no beacons for beaconLossMS */
+    kItlWakeOnGtkRekeyFailure   = 1 << 4,   /* the offloaded group rekey failed */
+};
+
+/* What woke the host, as reported by ItlDriverController::getWakeReason(). */
+enum ItlWakeReason {
+    kItlWakeReasonNone,     /* not a wireless wake, or the firmware does not tell */
+    kItlWakeReasonMagic,
+    kItlWakeReasonPattern,
+    kItlWakeReasonDisconnect,
+    kItlWakeReasonBeaconLoss,
+    kItlWakeReasonGtkRekeyFailure,
+    kItlWakeReasonOther,
+    kItlWakeReasonCount
+};
+
+/* Interrupt causes that get an MSI-X vector each, see ItlHalService::attachMsixInterrupts(). */
+enum ItlIntrQueue {
+    kItlIntrQueueRx,        /* Rx frames */
+    kItlIntrQueueTx,        /* Tx completions */
+    kItlIntrQueueCmd,       /* command responses, firmware notifications, errors */
+    kItlIntrQueueCount
+};
+
+#define kItlWowMaxPatterns      12
+#define kItlWowMaxPatternLen    128
+#define kItlWowKckLen           16
+#define kItlWowKekLen           24
+
+/* Matched from the start of the 802.3 frame, every byte significant. */
+struct ItlWowPattern {
+    uint32_t len;
+    uint8_t bytes[kItlWowMaxPatternLen];
+};
+
+struct ItlWowConfig {
+    uint32_t triggers;                  /* ItlWakeTrigger bits */
+    uint32_t beaconLossMS;
+    uint32_t patternCount;
+    struct ItlWowPattern patterns[kItlWowMaxPatterns];
+    /* GTK rekey offload, only valid when rekey is set */
+    bool rekey;
+    uint8_t kck[kItlWowKckLen];
+    uint8_t kek[kItlWowKekLen];
+    uint64_t replayCounter;
+};
+
 class ItlDriverController {
     
 public:
@@ -22,6 +85,59 @@ public:
     virtual void clearScanningFlags() = 0;
     
     virtual IOReturn setMulticastList(IOEthernetAddress *addr, int count) = 0;
+
+    /*
+     * Program the firmware power table. listenInterval is in beacon
+     * intervals, 0 leaves it to the firmware. May sleep, call it from the
+     * main workloop with the gate held.
+     */
+    virtual IOReturn setPowerSave(int level, uint16_t listenInterval) { return kIOReturnUnsupported; }
+
+    /*
+     * Get the firmware image ready without touching the device, e.g.
+     * decompress it. Runs on a thread of its own at resume, alongside the
+     * PCI restore and without the command gate; enable() is only called
+     * once it returned.
+     */
+    virtual void prepareFirmware() {}
+
+    /*
+     * Program the wake triggers right before the adapter is disabled for
+     * system sleep; the disable that follows has to leave the firmware
+     * running in its wake on wireless state instead of powering it off.
+     * NULL clears them again at resume. Called with the gate held.
+     */
+    virtual IOReturn setWoWLAN(const struct ItlWowConfig *config) { return kIOReturnUnsupported; }
+
+    /* ItlWakeReason of the last wake, read at resume before enable(). */
+    virtual int getWakeReason() { return kItlWakeReasonNone; }
+
+    /*
+     * Program the interrupt coalescing timer: the device holds an
+     * interrupt for up to delayUS after the first event, 0 raises it at
+     * once. Called from the main workloop, see ItlHalService::sampleInterruptModeration().
+     */
+    virtual IOReturn setInterruptModeration(uint32_t delayUS) { return kIOReturnUnsupported; }
+
+    /*
+     * Route the causes of each ItlIntrQueue to MSI-X table entry
+     * vectors[queue]. Called from attachMsixInterrupts() before the
+     * vectors are enabled; failing it falls back to MSI.
+     */
+    virtual IOReturn setMsixVectors(const uint8_t *vectors) { return kIOReturnUnsupported; }
+
+    /* One MSI-X vector fired, on the main workloop. */
+    virtual void handleQueueInterrupt(int queue) {}
+
+    /* Mask or unmask the Rx interrupt causes only, see ItlHalService::scheduleRxPoll(). */
+    virtual void setRxInterrupt(bool enable) {}
+
+    /*
+     * Pass at most budget received frames up, on the Rx poll thread with
+     * the main command gate held. Returns how many were handled; fewer
+     * than budget means the ring is drained.
+     */
+    virtual int pollRx(int budget) { return 0; }
 };
 
 #endif /* ItlDriverController_h */
@@ -34,6 +34,36 @@ public:
     virtual const char *getFirmwareCountryCode() = 0;
 
     virtual uint32_t getTxQueueSize() = 0;
+
+    /*
+     * Largest A-MSDU the firmware can transmit, 0 if it cannot. A-MSDUs,
+     * see ItlHalService::getTxAmsdu(), are only handed down when this is
+     * non zero, and the start routine then has to encapsulate with
+     * ItlHalService::encapTx() instead of ieee80211_encap().
+     */
+    virtual uint32_t getTxAmsduMaxLength() { return 0; }
+
+    /*
+     * kChecksumIP/kChecksumTCP/kChecksumUDP bits the firmware verifies on
+     * receive. Per frame results are reported with
+     * ItlHalService::setRxChecksumResult().
+     */
+    virtual UInt32 getRxChecksumSupport() { return 0; }
+
+    /* (1 << ItlPowerSaveLevel) bits, CAM is always there. */
+    virtual UInt32 getPowerSaveSupport() { return 1 << kItlPowerSaveCAM; }
+
+    /* ItlWakeTrigger bits the firmware can wake on, 0 without WoWLAN. */
+    virtual UInt32 getWoWLANSupport() { return 0; }
+
+    /* The firmware has an interrupt coalescing timer, see ItlDriverController::setInterruptModeration(). */
+    virtual bool supportsInterruptModeration() { return false; }
+
+    /* The device can steer each ItlIntrQueue to an MSI-X vector of its own. */
+    virtual bool supportsMsix() { return false; }
+
+    /* Rx can be masked on its own and drained by ItlDriverController::pollRx(). */
+    virtual bool supportsRxPoll() { return false; }
 };
 
 #endif /* ItlDriverInfo_h */
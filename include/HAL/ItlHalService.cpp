@@ -13,6 +13,54 @@
 */
 
 #include "ItlHalService.hpp"
+#include "ItlPhyRate.hpp"
+#include "ItlPciMsi.hpp"
+
+/* LLC/SNAP header ieee80211_encap() prepends to the payload */
+#define kItlLlcSnapLen 8
+
+/*
+ * The PHY rate table against the net80211 rate sets it replaced, indexed
+ * the way getRATE used to. Those are not constexpr, so this runs once at
+ * init. Returns the number of mismatches, each one is logged.
+ */
+static int
+checkPhyRates()
+{
+    int mismatches = 0;
+    
+    for (int width = kItlPhyWidth20; width <= kItlPhyWidth40; width++) {
+        for (int sgi = 0; sgi < 2; sgi++) {
+            for (int nss = 1; nss <= kItlPhyMaxNss; nss++) {
+                int index = (width == kItlPhyWidth40 ? IEEE80211_HT_RATESET_MIMO4_SGI + 1 : 0) + 2 * (nss - 1) + sgi;
+                const struct ieee80211_ht_rateset *rs = &ieee80211_std_ratesets_11n[index];
+                for (int mcs = 0; mcs < 8; mcs++) {
+                    uint32_t rate = itlPhyRate(kItlPhyModeHT, width, sgi ? kItlPhyGuardShort : kItlPhyGuardLong, nss, mcs);
+                    if (index >= IEEE80211_HT_NUM_RATESETS || mcs >= rs->nrates || rs->rates[mcs] != rate) {
+                        XYLog("%s HT width %d sgi %d nss %d mcs %d: %u\n", __FUNCTION__, width, sgi, nss, mcs, rate);
+                        mismatches++;
+                    }
+                }
+            }
+        }
+    }
+    for (int width = kItlPhyWidth20; width < kItlPhyWidthCount; width++) {
+        for (int sgi = 0; sgi < 2; sgi++) {
+            // the rate sets stop at two streams
+            for (int nss = 1; nss <= 2; nss++) {
+                const struct ieee80211_vht_rateset *rs = &ieee80211_std_ratesets_11ac[4 * width + 2 * (nss - 1) + sgi];
+                for (int mcs = 0; mcs < 10; mcs++) {
+                    uint32_t rate = itlPhyRate(kItlPhyModeVHT, width, sgi ? kItlPhyGuardShort : kItlPhyGuardLong, nss, mcs);
+                    if (mcs < rs->nrates ? rs->rates[mcs] != rate : rate != 0) {
+                        XYLog("%s VHT width %d sgi %d nss %d mcs %d: %u\n", __FUNCTION__, width, sgi, nss, mcs, rate);
+                        mismatches++;
+                    }
+                }
+            }
+        }
+    }
+    return mismatches;
+}
 
 #define super OSObject
 OSDefineMetaClassAndAbstractStructors(ItlHalService, OSObject)
@@ -26,10 +74,45 @@ initWithController(IOEthernetController *controller, IOWorkLoop *workloop, IOCom
     this->mainWorkLoop->retain();
     this->mainCommandGate = commandGate;
     this->mainCommandGate->retain();
+    this->amsduTagValid = mbuf_tag_id_find(kItlAmsduTagName, &this->amsduTagId) == 0;
+    if (checkPhyRates() != 0) {
+        XYLog("%s PHY rate table disagrees with the net80211 rate sets\n", __FUNCTION__);
+    }
     this->inner_attr = lck_attr_alloc_init();
     this->inner_gp_attr = lck_grp_attr_alloc_init();
     this->inner_gp = lck_grp_alloc_init("itlwm_tsleep", this->inner_gp_attr);
-    this->inner_lock = lck_mtx_alloc_init(this->inner_gp, this->inner_attr);
+    bzero(this->waitChannels, sizeof(this->waitChannels));
+    for (int i = 0; i < kItlWaitChannels; i++) {
+        this->waitChannels[i].lock = lck_mtx_alloc_init(this->inner_gp, this->inner_attr);
+    }
+    bzero(this->staInfo, sizeof(this->staInfo));
+    this->staInfoGen = 0;
+    this->staInfoPending = 0;
+    this->staInfoSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &ItlHalService::staInfoAction));
+    if (this->staInfoSource) {
+        this->mainWorkLoop->addEventSource(this->staInfoSource);
+        this->staInfoSource->enable();
+    }
+    bzero(&this->psStats, sizeof(this->psStats));
+    this->psStats.level = kItlPowerSaveCAM;
+    this->psSince = mach_absolute_time();
+    this->psListenInterval = 0;
+    this->imParams.mode = kItlIntrModAdaptive;
+    this->imParams.lowDelayUS = kItlIntrModDefaultLowDelayUS;
+    this->imParams.highDelayUS = kItlIntrModDefaultHighDelayUS;
+    this->imParams.lowPps = kItlIntrModDefaultLowPps;
+    this->imParams.highPps = kItlIntrModDefaultHighPps;
+    bzero(&this->imStats, sizeof(this->imStats));
+    this->imInterrupts = 0;
+    this->imSince = mach_absolute_time();
+    this->imDirty = true;
+    this->msixDevice = NULL;
+    bzero(this->msixSources, sizeof(this->msixSources));
+    bzero(this->msixCount, sizeof(this->msixCount));
+    this->rxWorkLoop = NULL;
+    this->rxPollSource = NULL;
+    bzero(&this->rxPollStats, sizeof(this->rxPollStats));
+    this->rxPollStats.budget = kItlRxPollDefaultBudget;
     return true;
 }
 
@@ -51,32 +134,661 @@ getMainWorkLoop()
     return this->mainWorkLoop;
 }
 
+/* idents are mostly driver structures and rings, the low bits carry no information */
+struct ItlWaitChannel *ItlHalService::
+waitChannel(void *ident)
+{
+    uintptr_t h = (uintptr_t)ident >> 4;
+    
+    h ^= h >> 8;
+    h ^= h >> 16;
+    return &this->waitChannels[h & (kItlWaitChannels - 1)];
+}
+
 void ItlHalService::
 wakeupOn(void *ident)
 {
 //    XYLog("%s\n", __FUNCTION__);
-    wakeup(ident);
+    struct ItlWaitChannel *ch = waitChannel(ident);
+    
+    // sleepers count themselves before they queue up, so a zero here means
+    // nobody is queued and wakeup() would have found no one either; the
+    // barrier orders the caller's condition update before the read
+    OSMemoryBarrier();
+    if (ch->sleepers) {
+        OSIncrementAtomic64(&ch->wakeups);
+        wakeup(ident);
+    } else {
+        OSIncrementAtomic64(&ch->idleWakeups);
+    }
+}
+
+void ItlHalService::
+getWaitStats(struct ItlWaitStats *out)
+{
+    bzero(out, sizeof(*out));
+    for (int i = 0; i < kItlWaitChannels; i++) {
+        struct ItlWaitChannel *ch = &this->waitChannels[i];
+        
+        if (ch->lock == NULL) {
+            continue;
+        }
+        lck_mtx_lock(ch->lock);
+        out->sleepers += ch->sleepers;
+        out->sleeps += ch->sleeps;
+        out->wakeups += ch->wakeups;
+        out->idleWakeups += ch->idleWakeups;
+        lck_mtx_unlock(ch->lock);
+    }
+}
+
+bool ItlHalService::
+setRxChecksumResult(mbuf_t m, UInt32 verified)
+{
+    return this->controller->setChecksumResult(m, kChecksumFamilyTCPIP, verified, verified);
+}
+
+bool ItlHalService::
+getTxAmsdu(mbuf_t m, uint8_t *subframes)
+{
+    uint8_t *count;
+    size_t len;
+    
+    if (!this->amsduTagValid ||
+        mbuf_tag_find(m, this->amsduTagId, kItlAmsduTagType, &len, (void **)&count) != 0 || len != sizeof(*count)) {
+        return false;
+    }
+    *subframes = *count;
+    return true;
+}
+
+mbuf_t ItlHalService::
+encapTx(mbuf_t m, struct ieee80211_node **ni)
+{
+    struct ieee80211com *ic = get80211Controller();
+    struct ieee80211_frame *wh;
+    uint8_t hdr[sizeof(struct ieee80211_qosframe_addr4)];
+    uint8_t subframes;
+    u_int hdrlen;
+    bool amsdu = getTxAmsdu(m, &subframes);
+    
+    m = ieee80211_encap(&ic->ic_ac.ac_if, m, ni);
+    if (m == NULL || !amsdu) {
+        return m;
+    }
+    wh = mtod(m, struct ieee80211_frame *);
+    hdrlen = ieee80211_get_hdrlen(wh);
+    if (!ieee80211_has_qos(wh) || hdrlen > sizeof(hdr)) {
+        // the peer lost QoS since the aggregate was built
+        mbuf_freem(m);
+        return NULL;
+    }
+    // drop the LLC/SNAP header encap put in front of the first subframe
+    mbuf_copydata(m, 0, hdrlen, hdr);
+    mbuf_adj(m, kItlLlcSnapLen);
+    // QoS control closes the header, encap adds no HT control field
+    hdr[hdrlen - 2] |= IEEE80211_QOS_AMSDU;
+    mbuf_copyback(m, 0, hdrlen, hdr, MBUF_DONTWAIT);
+    return m;
+}
+
+static uint32_t
+staTxRate(struct ieee80211com *ic, struct ItlStaInfo *info)
+{
+    struct ieee80211_node *ni = ic->ic_bss;
+    int width;
+    
+    switch (info->chw) {
+        case IEEE80211_CHAN_WIDTH_40:
+            width = kItlPhyWidth40;
+            break;
+        case IEEE80211_CHAN_WIDTH_80:
+            width = kItlPhyWidth80;
+            break;
+        case IEEE80211_CHAN_WIDTH_80P80:
+        case IEEE80211_CHAN_WIDTH_160:
+            width = kItlPhyWidth160;
+            break;
+            
+        default:
+            width = kItlPhyWidth20;
+            break;
+    }
+    if (info->mode == IEEE80211_MODE_11AC) {
+        return itlPhyRate(kItlPhyModeVHT, width, info->sgi ? kItlPhyGuardShort : kItlPhyGuardLong, info->nss, info->mcs);
+    } else if (info->mode == IEEE80211_MODE_11N) {
+        return itlPhyRate(kItlPhyModeHT, width, info->sgi ? kItlPhyGuardShort : kItlPhyGuardLong, info->nss, info->mcs % 8);
+    }
+    return ni->ni_rates.rs_rates[ni->ni_txrate] & IEEE80211_RATE_VAL;
+}
+
+void ItlHalService::
+updateStaInfo()
+{
+    struct ieee80211com *ic = get80211Controller();
+    struct ieee80211_node *ni = ic->ic_bss;
+    struct ItlStaInfo *info;
+    int next = (this->staInfoGen + 1) & 1;
+    
+    // readers only ever look at the other slot
+    info = &this->staInfo[next];
+    bzero(info, sizeof(*info));
+    if (ni != NULL && ni->ni_chan != NULL && ic->ic_state == IEEE80211_S_RUN) {
+        info->associated = true;
+        info->mode = ic->ic_curmode;
+        memcpy(info->bssid, ni->ni_bssid, ETHER_ADDR_LEN);
+        info->channel = ieee80211_chan2ieee(ic, ni->ni_chan);
+        info->chanFlags = ni->ni_chan->ic_flags;
+        info->chw = ni->ni_chw;
+        switch (ni->ni_chw) {
+            case IEEE80211_CHAN_WIDTH_40:
+                info->bandwidth = 40;
+                break;
+            case IEEE80211_CHAN_WIDTH_80:
+                info->bandwidth = 80;
+                break;
+            case IEEE80211_CHAN_WIDTH_80P80:
+            case IEEE80211_CHAN_WIDTH_160:
+                info->bandwidth = 160;
+                break;
+                
+            default:
+                info->bandwidth = 20;
+                break;
+        }
+        if (info->mode == IEEE80211_MODE_11N) {
+            info->sgi = info->chw == IEEE80211_CHAN_WIDTH_40 ? ieee80211_node_supports_ht_sgi40(ni) : ieee80211_node_supports_ht_sgi20(ni);
+            info->nss = ni->ni_txmcs / 8 + 1;
+        } else {
+            info->sgi = info->mode >= IEEE80211_MODE_11AC && (ieee80211_node_supports_vht_sgi80(ni) || ieee80211_node_supports_vht_sgi160(ni));
+            info->nss = getDriverInfo()->getTxNSS();
+        }
+        info->mcs = ni->ni_txmcs;
+        info->txRateIndex = ni->ni_txrate;
+        info->txRate = staTxRate(ic, info);
+        info->rssi = kItlMinDbm + ni->ni_rssi;
+        info->noise = getDriverInfo()->getBSSNoise();
+    }
+    OSMemoryBarrier();
+    OSIncrementAtomic(&this->staInfoGen);
+}
+
+bool ItlHalService::
+getStaInfo(struct ItlStaInfo *out)
+{
+    SInt32 gen;
+    
+    // retried only if a whole update completed on another CPU meanwhile
+    do {
+        gen = this->staInfoGen;
+        OSMemoryBarrier();
+        *out = this->staInfo[gen & 1];
+        OSMemoryBarrier();
+    } while (gen != this->staInfoGen);
+    return out->associated;
+}
+
+void ItlHalService::
+checkStaInfo()
+{
+    struct ieee80211com *ic = get80211Controller();
+    struct ieee80211_node *ni = ic->ic_bss;
+    const struct ItlStaInfo *info = &this->staInfo[this->staInfoGen & 1];
+    
+    // a torn read only costs a spurious update
+    if (ni == NULL || ic->ic_state != IEEE80211_S_RUN || !info->associated ||
+        (ni->ni_txmcs == info->mcs && ni->ni_txrate == info->txRateIndex && ni->ni_chw == info->chw)) {
+        return;
+    }
+    if (this->staInfoSource && OSCompareAndSwap(0, 1, &this->staInfoPending)) {
+        this->staInfoSource->interruptOccurred(NULL, NULL, 0);
+    }
+}
+
+void ItlHalService::
+staInfoAction(IOInterruptEventSource *sender, int count)
+{
+    this->staInfoPending = 0;
+    OSMemoryBarrier();
+    updateStaInfo();
+}
+
+IOReturn ItlHalService::
+updateStaInfoGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    // target is the gate's owner, the controller
+    ItlHalService *that = OSDynamicCast(ItlHalService, (OSObject *)arg0);
+    
+    that->updateStaInfo();
+    return kIOReturnSuccess;
+}
+
+bool ItlHalService::
+refreshStaInfo(struct ItlStaInfo *out)
+{
+    if (this->mainWorkLoop->inGate()) {
+        updateStaInfo();
+    } else {
+        this->mainCommandGate->runAction(updateStaInfoGated, this);
+    }
+    return getStaInfo(out);
+}
+
+static uint64_t
+elapsedMS(uint64_t since, uint64_t now)
+{
+    uint64_t ns;
+    
+    absolutetime_to_nanoseconds(now - since, &ns);
+    return ns / 1000000;
+}
+
+void ItlHalService::
+switchPowerSave(int level)
+{
+    uint64_t now = mach_absolute_time();
+    
+    this->psStats.ms[this->psStats.level] += elapsedMS(this->psSince, now);
+    this->psStats.level = level;
+    this->psStats.transitions++;
+    this->psSince = now;
+}
+
+IOReturn ItlHalService::
+setPowerSave(int level, uint16_t listenInterval)
+{
+    IOReturn ret;
+    
+    if (level < 0 || level >= kItlPowerSaveLevelCount ||
+        !(getDriverInfo()->getPowerSaveSupport() & (1 << level))) {
+        return kIOReturnUnsupported;
+    }
+    if (level == this->psStats.level && listenInterval == this->psListenInterval) {
+        return kIOReturnSuccess;
+    }
+    ret = getDriverController()->setPowerSave(level, listenInterval);
+    if (ret != kIOReturnSuccess) {
+        this->psStats.failures++;
+        return ret;
+    }
+    this->psListenInterval = listenInterval;
+    if (level != this->psStats.level) {
+        switchPowerSave(level);
+    }
+    return kIOReturnSuccess;
+}
+
+void ItlHalService::
+resetPowerSave()
+{
+    this->psListenInterval = 0;
+    if (this->psStats.level != kItlPowerSaveCAM) {
+        switchPowerSave(kItlPowerSaveCAM);
+    }
+}
+
+void ItlHalService::
+getPowerSaveStats(struct ItlPowerSaveStats *out)
+{
+    *out = this->psStats;
+    out->ms[out->level] += elapsedMS(this->psSince, mach_absolute_time());
+}
+
+void ItlHalService::
+countInterrupt()
+{
+    OSIncrementAtomic64(&this->imInterrupts);
+}
+
+void ItlHalService::
+setInterruptModeration(const struct ItlIntrModParams *params)
+{
+    this->imParams = *params;
+    if (this->imParams.lowPps > this->imParams.highPps) {
+        this->imParams.lowPps = this->imParams.highPps;
+    }
+    this->imDirty = true;
+}
+
+/*
+ * Low latency while the link is quiet, batched once the packet rate says
+ * interrupts would cost more than the added delay. The gap between lowPps
+ * and highPps keeps a rate sitting on the edge from flapping.
+ */
+bool ItlHalService::
+sampleInterruptModeration()
+{
+    struct _ifnet *ifp = &get80211Controller()->ic_ac.ac_if;
+    uint64_t now = mach_absolute_time();
+    uint64_t ms = elapsedMS(this->imSince, now);
+    uint64_t interrupts = this->imInterrupts;
+    uint64_t packets = ifp->netStat->inputPackets + ifp->netStat->outputPackets;
+    uint64_t dInterrupts = interrupts - this->imStats.interrupts;
+    uint64_t dPackets = packets - this->imStats.packets;
+    uint64_t pps;
+    uint32_t delayUS;
+    IOReturn ret;
+    
+    if (ms == 0) {
+        return false;
+    }
+    this->imSince = now;
+    this->imStats.interrupts = interrupts;
+    this->imStats.packets = packets;
+    this->imStats.intrPerSec = (uint32_t)min(dInterrupts * 1000 / ms, (uint64_t)UINT32_MAX);
+    this->imStats.pktsPerIntr = dInterrupts ? (uint32_t)min(dPackets * 100 / dInterrupts, (uint64_t)UINT32_MAX) : 0;
+    pps = dPackets * 1000 / ms;
+    switch (this->imParams.mode) {
+        case kItlIntrModAdaptive:
+            delayUS = this->imStats.delayUS;
+            if (pps >= this->imParams.highPps) {
+                delayUS = this->imParams.highDelayUS;
+            } else if (pps < this->imParams.lowPps) {
+                delayUS = this->imParams.lowDelayUS;
+            } else if (this->imDirty) {
+                // between the thresholds, stay on the side the old delay was on
+                delayUS = this->imStats.delayUS > this->imParams.lowDelayUS ? this->imParams.highDelayUS : this->imParams.lowDelayUS;
+            }
+            break;
+        case kItlIntrModFixed:
+            delayUS = this->imParams.highDelayUS;
+            break;
+            
+        default:
+            delayUS = 0;
+            break;
+    }
+    if (delayUS == this->imStats.delayUS && !this->imDirty) {
+        return false;
+    }
+    this->imDirty = false;
+    ret = getDriverController()->setInterruptModeration(delayUS);
+    if (ret != kIOReturnSuccess) {
+        // drivers without a coalescing timer simply stay at 0
+        if (ret != kIOReturnUnsupported) {
+            this->imStats.failures++;
+        }
+        return false;
+    }
+    if (delayUS == this->imStats.delayUS) {
+        return false;
+    }
+    this->imStats.delayUS = delayUS;
+    this->imStats.switches++;
+    return true;
+}
+
+void ItlHalService::
+msixInterrupt(IOInterruptEventSource *sender, int count)
+{
+    for (int queue = 0; queue < kItlIntrQueueCount; queue++) {
+        if (this->msixSources[queue] == sender) {
+            this->msixCount[queue]++;
+            countInterrupt();
+            if (queue == kItlIntrQueueRx && scheduleRxPoll()) {
+                return;
+            }
+            getDriverController()->handleQueueInterrupt(queue);
+            return;
+        }
+    }
+}
+
+/*
+ * IOPCIFamily lists the MSI-X table entries as consecutive messaged
+ * interrupt indexes; entry n of the table is the n-th of them. It programs
+ * the table and the MSI-X enable bit itself as the sources are enabled,
+ * so the capability is only read here, never written. Entry 0 is the one
+ * the driver registered its handler on, the queues take the entries after it.
+ */
+bool ItlHalService::
+attachMsixInterrupts(IOPCIDevice *device)
+{
+    UInt8 msixCap = 0;
+    uint8_t vectors[kItlIntrQueueCount];
+    int first = -1;
+    int found = 0;
+    int type;
+    
+    if (!getDriverInfo()->supportsMsix()) {
+        return false;
+    }
+    device->findPCICapability(PCI_CAP_ID_MSIX, &msixCap);
+    if (msixCap == 0 ||
+        (device->configRead16(msixCap + PCI_MSIX_FLAGS) & PCI_MSIX_FLAGS_QSIZE) + 1 < 1 + kItlIntrQueueCount) {
+        XYLog("%s no MSI-X or too few vectors, using MSI\n", __FUNCTION__);
+        return false;
+    }
+    for (int index = 0; device->getInterruptType(index, &type) == kIOReturnSuccess; index++) {
+        if (type & kIOInterruptTypePCIMessaged) {
+            if (first < 0) {
+                first = index;
+            }
+            found++;
+        }
+    }
+    if (first < 0 || found < 1 + kItlIntrQueueCount) {
+        XYLog("%s %d messaged interrupts, using MSI\n", __FUNCTION__, found);
+        return false;
+    }
+    for (int queue = 0; queue < kItlIntrQueueCount; queue++) {
+        vectors[queue] = 1 + queue;
+        this->msixSources[queue] = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &ItlHalService::msixInterrupt), device, first + vectors[queue]);
+        if (this->msixSources[queue] == NULL ||
+            this->mainWorkLoop->addEventSource(this->msixSources[queue]) != kIOReturnSuccess) {
+            OSSafeReleaseNULL(this->msixSources[queue]);
+            break;
+        }
+    }
+    this->msixDevice = device;
+    if (this->msixSources[kItlIntrQueueCount - 1] == NULL ||
+        getDriverController()->setMsixVectors(vectors) != kIOReturnSuccess) {
+        detachMsixInterrupts();
+        XYLog("%s vector setup failed, using MSI\n", __FUNCTION__);
+        return false;
+    }
+    for (int queue = 0; queue < kItlIntrQueueCount; queue++) {
+        this->msixSources[queue]->enable();
+    }
+    XYLog("%s %d MSI-X vectors from interrupt %d\n", __FUNCTION__, kItlIntrQueueCount, first + 1);
+    return true;
+}
+
+/* Disabling the sources hands the vectors back to IOPCIFamily. */
+void ItlHalService::
+detachMsixInterrupts()
+{
+    if (this->msixDevice == NULL) {
+        return;
+    }
+    for (int queue = 0; queue < kItlIntrQueueCount; queue++) {
+        if (this->msixSources[queue]) {
+            this->msixSources[queue]->disable();
+            this->mainWorkLoop->removeEventSource(this->msixSources[queue]);
+            OSSafeReleaseNULL(this->msixSources[queue]);
+        }
+    }
+    this->msixDevice = NULL;
+}
+
+void ItlHalService::
+getMsixStats(uint64_t *out)
+{
+    memcpy(out, this->msixCount, sizeof(this->msixCount));
+}
+
+void ItlHalService::
+setRxPollBudget(uint32_t budget)
+{
+    this->rxPollStats.budget = budget ? budget : kItlRxPollDefaultBudget;
+}
+
+/*
+ * The poll thread is a workloop of its own, so an Rx flood keeps it busy
+ * instead of the main workloop. Each pass still runs under the main
+ * command gate since net80211 is not reentrant, but only for budget
+ * frames: ioctls, Tx completions and timers get the gate between passes.
+ */
+bool ItlHalService::
+attachRxPoll()
+{
+    if (!getDriverInfo()->supportsRxPoll()) {
+        return false;
+    }
+    this->rxWorkLoop = IOWorkLoop::workLoop();
+    if (this->rxWorkLoop == NULL) {
+        return false;
+    }
+    this->rxPollSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &ItlHalService::rxPollAction));
+    if (this->rxPollSource == NULL ||
+        this->rxWorkLoop->addEventSource(this->rxPollSource) != kIOReturnSuccess) {
+        OSSafeReleaseNULL(this->rxPollSource);
+        OSSafeReleaseNULL(this->rxWorkLoop);
+        XYLog("%s no Rx poll thread, Rx stays in the interrupt handler\n", __FUNCTION__);
+        return false;
+    }
+    this->rxPollSource->enable();
+    XYLog("%s budget %u\n", __FUNCTION__, this->rxPollStats.budget);
+    return true;
+}
+
+void ItlHalService::
+detachRxPoll()
+{
+    if (this->rxPollSource == NULL) {
+        return;
+    }
+    this->rxPollSource->disable();
+    this->rxWorkLoop->removeEventSource(this->rxPollSource);
+    OSSafeReleaseNULL(this->rxPollSource);
+    OSSafeReleaseNULL(this->rxWorkLoop);
+}
+
+bool ItlHalService::
+scheduleRxPoll()
+{
+    if (this->rxPollSource == NULL) {
+        return false;
+    }
+    getDriverController()->setRxInterrupt(false);
+    this->rxPollStats.schedules++;
+    this->rxPollSource->interruptOccurred(NULL, NULL, 0);
+    return true;
+}
+
+void ItlHalService::
+rxPollAction(IOInterruptEventSource *sender, int count)
+{
+    this->mainCommandGate->runAction(rxPollGated, this);
+}
+
+IOReturn ItlHalService::
+rxPollGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    // target is the gate's owner, the controller
+    ItlHalService *that = OSDynamicCast(ItlHalService, (OSObject *)arg0);
+    int budget = that->rxPollStats.budget;
+    int done;
+    
+    // detachRxPoll() disabled the source while this pass waited for the gate
+    if (!that->rxPollSource->isEnabled()) {
+        return kIOReturnSuccess;
+    }
+    done = that->getDriverController()->pollRx(budget);
+    that->rxPollStats.passes++;
+    that->rxPollStats.frames += done;
+    if (done < budget) {
+        // frames that arrived since the last look raise the interrupt again
+        that->getDriverController()->setRxInterrupt(true);
+    } else {
+        // more to do, but let the waiters on the gate in first
+        that->rxPollStats.exhausted++;
+        that->rxPollSource->interruptOccurred(NULL, NULL, 0);
+    }
+    return kIOReturnSuccess;
+}
+
+int ItlHalService::
+tsleep_nsec(void *ident, int priority, const char *wmesg, uint64_t timo)
+{
+    return tsleep_deadline(ident, priority, wmesg, itlDeadlineAfterNS(timo));
 }
 
 int ItlHalService::
-tsleep_nsec(void *ident, int priority, const char *wmesg, int timo)
+tsleep_deadline(void *ident, int priority, const char *wmesg, uint64_t deadline)
 {
 //    XYLog("%s %s\n", __FUNCTION__, wmesg);
-    struct timespec ts;
-    int err;
-    memset(&ts, 0, sizeof(struct timespec));
-    ts.tv_nsec = timo;
-    lck_mtx_lock(this->inner_lock);
-    err = msleep(ident, this->inner_lock, priority, wmesg, &ts);
-    lck_mtx_unlock(this->inner_lock);
-    return err;
+    struct ItlWaitChannel *ch = waitChannel(ident);
+    wait_interrupt_t interruptible = (priority & PCATCH) ? THREAD_ABORTSAFE : THREAD_UNINT;
+    wait_result_t res;
+    lck_mtx_lock(ch->lock);
+    OSIncrementAtomic(&ch->sleepers);
+    ch->sleeps++;
+    if (deadline == kItlWaitForever) {
+        res = lck_mtx_sleep(ch->lock, LCK_SLEEP_DEFAULT, (event_t)ident, interruptible);
+    } else {
+        res = lck_mtx_sleep_deadline(ch->lock, LCK_SLEEP_DEFAULT, (event_t)ident, interruptible, deadline);
+    }
+    OSDecrementAtomic(&ch->sleepers);
+    lck_mtx_unlock(ch->lock);
+    switch (res) {
+        case THREAD_AWAKENED:
+            return 0;
+        case THREAD_TIMED_OUT:
+            return EWOULDBLOCK;
+            
+        default:
+            return EINTR;
+    }
+}
+
+IOReturn ItlHalService::
+commandSleepGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    // target is the gate's owner, the controller
+    ItlHalService *that = OSDynamicCast(ItlHalService, (OSObject *)arg0);
+    
+    return that->commandSleepDeadline(arg1, *(uint64_t *)arg2);
+}
+
+IOReturn ItlHalService::
+commandSleepDeadline(void *event, uint64_t deadline)
+{
+    IOReturn ret;
+    
+    if (!this->mainWorkLoop->inGate()) {
+        return this->mainCommandGate->runAction(commandSleepGated, this, event, &deadline);
+    }
+    if (deadline == kItlWaitForever) {
+        ret = this->mainCommandGate->commandSleep(event, THREAD_INTERRUPTIBLE);
+    } else {
+        ret = this->mainCommandGate->commandSleep(event, deadline, THREAD_INTERRUPTIBLE);
+    }
+    switch (ret) {
+        case THREAD_AWAKENED:
+            return kIOReturnSuccess;
+        case THREAD_TIMED_OUT:
+            return kIOReturnTimeout;
+            
+        default:
+            return kIOReturnAborted;
+    }
 }
 
 void ItlHalService::
 free()
 {
     XYLog("%s\n", __PRETTY_FUNCTION__);
+    // the driver's detach normally did this already
     if (this->mainWorkLoop) {
+        detachRxPoll();
+        detachMsixInterrupts();
+        if (this->staInfoSource) {
+            this->staInfoSource->disable();
+            this->mainWorkLoop->removeEventSource(this->staInfoSource);
+            this->staInfoSource->release();
+            this->staInfoSource = NULL;
+        }
         this->mainWorkLoop->release();
     }
     this->mainWorkLoop = NULL;
@@ -87,12 +799,17 @@ free()
     if (this->controller) {
         this->controller->release();
     }
-    if (this->inner_lock) {
+    if (this->inner_gp) {
+        for (int i = 0; i < kItlWaitChannels; i++) {
+            if (this->waitChannels[i].lock) {
+                lck_mtx_free(this->waitChannels[i].lock, this->inner_gp);
+                this->waitChannels[i].lock = NULL;
+            }
+        }
         lck_attr_free(this->inner_attr);
-        lck_mtx_free(this->inner_lock, this->inner_gp);
         lck_grp_free(this->inner_gp);
         lck_grp_attr_free(this->inner_gp_attr);
-        this->inner_lock = NULL;
+        this->inner_gp = NULL;
     }
     this->controller = NULL;
     super::free();
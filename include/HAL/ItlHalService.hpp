@@ -20,15 +20,127 @@
 #include <IOKit/IOService.h>
 #include <IOKit/IOCommandGate.h>
 #include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOInterruptEventSource.h>
 #include <IOKit/pci/IOPCIDevice.h>
 #include <IOKit/network/IOEthernetController.h>
 #include <IOKit/network/IOEthernetInterface.h>
 
-#include "ItlDriverInfo.hpp"
 #include "ItlDriverController.hpp"
+#include "ItlDriverInfo.hpp"
+#include "ItlDeadline.hpp"
 
 #include <net80211/ieee80211_var.h>
 
+/* See itlDeadline(). */
+static inline uint64_t itlDeadlineAfterNS(uint64_t nsec)
+{
+    mach_timebase_info_data_t timebase;
+    
+    clock_timebase_info(&timebase);
+    return itlDeadline(mach_absolute_time(), nsec, timebase.numer, timebase.denom);
+}
+
+/*
+ * Tx A-MSDUs built by the controller carry an mbuf tag of this name and
+ * type, the payload is the subframe count. See getTxAmsdu().
+ */
+#define kItlAmsduTagName        "BCMWLANFirmware_Hashstore.amsdu"
+#define kItlAmsduTagType        1
+
+/* Floor of the drivers' RSSI scale, ni_rssi counts up from it. */
+#define kItlMinDbm              (-100)
+
+/*
+ * What the station is currently doing, as seen by the ioctl getters. Rebuilt
+ * from ic_bss by ItlHalService::updateStaInfo() and read without locks.
+ */
+struct ItlStaInfo {
+    bool associated;
+    u_int mode;             /* ic_curmode */
+    uint8_t bssid[ETHER_ADDR_LEN];
+    u_int channel;
+    u_int chanFlags;        /* ieee80211_channel ic_flags */
+    int chw;                /* IEEE80211_CHAN_WIDTH_* */
+    uint16_t bandwidth;     /* MHz */
+    bool sgi;
+    int nss;
+    int mcs;                /* ni_txmcs */
+    int txRateIndex;        /* ni_txrate */
+    uint32_t txRate;        /* 500 kb/s units */
+    int rssi;               /* dBm */
+    int16_t noise;          /* dBm */
+};
+
+/* Where the radio spent its time, kept by ItlHalService::setPowerSave(). */
+struct ItlPowerSaveStats {
+    int level;                              /* ItlPowerSaveLevel in effect */
+    uint64_t ms[kItlPowerSaveLevelCount];   /* time spent at each level */
+    uint32_t transitions;
+    uint32_t failures;                      /* firmware refused the level */
+};
+
+enum ItlIntrModMode {
+    kItlIntrModOff,         /* interrupt at once */
+    kItlIntrModAdaptive,    /* lowDelayUS under lowPps, highDelayUS from highPps on */
+    kItlIntrModFixed,       /* always highDelayUS */
+};
+
+#define kItlIntrModDefaultLowDelayUS    0
+#define kItlIntrModDefaultHighDelayUS   256
+#define kItlIntrModDefaultLowPps        2000
+#define kItlIntrModDefaultHighPps       8000
+
+struct ItlIntrModParams {
+    uint32_t mode;          /* ItlIntrModMode */
+    uint32_t lowDelayUS;
+    uint32_t highDelayUS;
+    uint32_t lowPps;        /* adaptive drops back to lowDelayUS under this */
+    uint32_t highPps;       /* ... and batches from this packet rate on */
+};
+
+struct ItlIntrModStats {
+    uint32_t delayUS;       /* in effect */
+    uint32_t intrPerSec;    /* over the last sample */
+    uint32_t pktsPerIntr;   /* over the last sample, in 1/100 */
+    uint32_t switches;
+    uint32_t failures;      /* firmware refused the delay */
+    uint64_t interrupts;
+    uint64_t packets;
+};
+
+#define kItlRxPollDefaultBudget         64      /* frames per pass */
+
+#define kItlWaitChannels                16      /* power of 2 */
+
+/*
+ * tsleep_nsec() sleepers whose ident hashes here. The lock is only taken
+ * by sleepers, so waiters on different idents rarely meet; wakeupOn()
+ * reads the sleeper count without it and skips the kernel's wait queue
+ * lookup when nobody sleeps on the channel.
+ */
+struct ItlWaitChannel {
+    lck_mtx_t *lock;
+    volatile SInt32 sleepers;
+    uint64_t sleeps;
+    volatile SInt64 wakeups;        /* that found a sleeper on the channel */
+    volatile SInt64 idleWakeups;    /* that did not */
+};
+
+struct ItlWaitStats {
+    uint32_t sleepers;
+    uint64_t sleeps;
+    uint64_t wakeups;
+    uint64_t idleWakeups;
+};
+
+struct ItlRxPollStats {
+    uint32_t budget;
+    uint64_t schedules;     /* Rx interrupts that started a poll */
+    uint64_t passes;
+    uint64_t exhausted;     /* passes that used up the budget and yielded */
+    uint64_t frames;
+};
+
 class ItlHalService : public OSObject {
     OSDeclareAbstractStructors(ItlHalService)
     
@@ -53,27 +165,214 @@ public:
 public:
     virtual bool initWithController(IOEthernetController *controller, IOWorkLoop *workloop, IOCommandGate *commandGate);
     
+    /* The network controller the driver runs under, which answers the ClientKit platform functions. */
+    IOEthernetController *getController();
+    
+    /*
+     * Recompute the station info snapshot. Call on association changes,
+     * Tx rate changes are caught by checkStaInfo(). Main workloop only:
+     * there is a single writer.
+     */
+    void updateStaInfo();
+    
+    /* Lock free, safe at interrupt context. Returns out->associated. */
+    bool getStaInfo(struct ItlStaInfo *out);
+    
+    /*
+     * Lock free and cheap enough for every Tx frame: when the rate control
+     * moved ic_bss to another rate since the snapshot, schedules
+     * updateStaInfo() on the main workloop.
+     */
+    void checkStaInfo();
+    
+    /*
+     * updateStaInfo() through the main command gate, then getStaInfo(), for
+     * callers outside the workloop whose controller does not keep the
+     * snapshot current itself. May sleep.
+     */
+    bool refreshStaInfo(struct ItlStaInfo *out);
+    
+    /*
+     * Move the firmware to a power save level and account the time spent
+     * at the previous one. Main workloop only, the driver may sleep.
+     */
+    IOReturn setPowerSave(int level, uint16_t listenInterval);
+    
+    /* The firmware drops back to CAM on disassociation and reset. */
+    void resetPowerSave();
+    
+    /* Times include the level currently in effect up to now. */
+    void getPowerSaveStats(struct ItlPowerSaveStats *out);
+    
+    /* Applied at the next sample. */
+    void setInterruptModeration(const struct ItlIntrModParams *params);
+    
+    void getInterruptModeration(struct ItlIntrModParams *out) { *out = this->imParams; }
+    
+    /*
+     * Turn the interrupt and packet counts since the last call into rates
+     * and pick the coalescing delay. Main workloop only, the driver may
+     * sleep; returns true when the delay changed.
+     */
+    bool sampleInterruptModeration();
+    
+    void getInterruptModerationStats(struct ItlIntrModStats *out) { *out = this->imStats; }
+    
+    /*
+     * Take one MSI-X vector per ItlIntrQueue from IOPCIFamily, each bound
+     * to an event source of its own on the main workloop that calls
+     * ItlDriverController::handleQueueInterrupt(). The first messaged
+     * interrupt stays with the driver's own handler, which keeps the
+     * causes that are not steered. Returns false without touching the
+     * device when it or the driver cannot do it; everything then stays on
+     * that single MSI interrupt. The controller calls it after attach().
+     */
+    bool attachMsixInterrupts(IOPCIDevice *device);
+    
+    void detachMsixInterrupts();
+    
+    /* True once attachMsixInterrupts() succeeded. */
+    bool isMsix() const { return this->msixSources[0] != NULL; }
+    
+    /* Interrupts taken per ItlIntrQueue vector, zeros on MSI. */
+    void getMsixStats(uint64_t *out);
+    
+    /*
+     * Start the Rx poll thread. Returns false when the driver cannot mask
+     * Rx on its own or the thread could not be set up; Rx then stays in
+     * the interrupt handler. The controller calls it after attach().
+     */
+    bool attachRxPoll();
+    
+    /* Stops the thread; not from inside the main command gate, a pass may be waiting on it. */
+    void detachRxPoll();
+    
+    /* Frames per poll pass, 0 picks the default. Takes effect at the next pass. */
+    void setRxPollBudget(uint32_t budget);
+    
+    /* True once attachRxPoll() succeeded. */
+    bool isRxPoll() const { return this->rxPollSource != NULL; }
+    
+    void getRxPollStats(struct ItlRxPollStats *out) { *out = this->rxPollStats; }
+    
+    /* Summed over all wait channels. */
+    void getWaitStats(struct ItlWaitStats *out);
+    
+    /*
+     * IOCommandGate::commandSleep() on the main gate until the absolute
+     * deadline, entering the gate first when the caller is outside it.
+     * Returns kIOReturnTimeout when the deadline passed and kIOReturnAborted
+     * when the sleep was interrupted. The controller's tsleepHandler sleeps
+     * through here too.
+     */
+    IOReturn commandSleepDeadline(void *event, uint64_t deadline);
+    
 protected:
     
-    int tsleep_nsec(void *ident, int priority, const char *wmesg, int timo);
+    /* timo in nanoseconds: 0 only polls, INFSLP (kItlWaitForever) waits forever. */
+    int tsleep_nsec(void *ident, int priority, const char *wmesg, uint64_t timo);
     
+    /*
+     * Sleep on ident until wakeupOn() or the absolute deadline, so a wait
+     * split across several sleeps does not restart its timeout each time.
+     * Returns 0, EWOULDBLOCK on timeout or EINTR with PCATCH, as msleep().
+     * kItlWaitForever never times out.
+     */
+    int tsleep_deadline(void *ident, int priority, const char *wmesg, uint64_t deadline);
+    
+    /* Lock free, callable wherever wakeup() is, interrupt context included. */
     void wakeupOn(void* ident);
     
-    IOEthernetController *getController();
+    bool setRxChecksumResult(mbuf_t m, UInt32 verified);
+    
+    /*
+     * True when m is an A-MSDU from the controller, only ever the case if
+     * ItlDriverInfo::getTxAmsduMaxLength() is non zero. Its leading Ethernet
+     * header only carries RA/SA for ieee80211_encap and has to be stripped,
+     * and the A-MSDU present bit set in the QoS control field.
+     */
+    bool getTxAmsdu(mbuf_t m, uint8_t *subframes);
+    
+    /*
+     * ieee80211_encap() for the driver start routines, also turning the
+     * controller's A-MSDUs into 802.11 A-MSDU data frames. Drivers that
+     * report getTxAmsduMaxLength() have to encapsulate through here.
+     */
+    mbuf_t encapTx(mbuf_t m, struct ieee80211_node **ni);
+    
+    /*
+     * Account one interrupt. Lock free; drivers on MSI call it from their
+     * interrupt handler, the MSI-X vectors are counted here. The packet
+     * rate comes from the interface counters.
+     */
+    void countInterrupt();
+    
+    /*
+     * From the interrupt handler when Rx is pending: masks Rx and hands the
+     * ring to the poll thread, which passes budget frames at a time up and
+     * unmasks Rx once it is drained. Returns false without the thread, the
+     * handler then drains the ring itself as before. The MSI-X Rx vector
+     * calls it on its own.
+     */
+    bool scheduleRxPoll();
     
     IOCommandGate *getMainCommandGate();
     
     IOWorkLoop *getMainWorkLoop();
     
+private:
+    
+    void switchPowerSave(int level);
+    
+    void msixInterrupt(IOInterruptEventSource *sender, int count);
+    
+    void rxPollAction(IOInterruptEventSource *sender, int count);
+    
+    static IOReturn rxPollGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+    
+    struct ItlWaitChannel *waitChannel(void *ident);
+    
+    void staInfoAction(IOInterruptEventSource *sender, int count);
+    
+    static IOReturn updateStaInfoGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+    
+    static IOReturn commandSleepGated(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+    
 private:
     IOEthernetController *controller;
     IOCommandGate *mainCommandGate;
     IOWorkLoop *mainWorkLoop;
+    
+    mbuf_tag_id_t amsduTagId;
+    bool amsduTagValid;
+    
+    struct ItlStaInfo staInfo[2];
+    volatile SInt32 staInfoGen;     /* staInfo[staInfoGen & 1] is the current one */
+    IOInterruptEventSource *staInfoSource;
+    volatile UInt32 staInfoPending;
+    
+    struct ItlPowerSaveStats psStats;
+    uint64_t psSince;               /* mach time the current level started */
+    uint16_t psListenInterval;
+    
+    struct ItlIntrModParams imParams;
+    struct ItlIntrModStats imStats;
+    volatile SInt64 imInterrupts;   /* since attach, written at interrupt time */
+    uint64_t imSince;               /* mach time of the last sample */
+    bool imDirty;                   /* params changed since the last sample */
+    
+    IOPCIDevice *msixDevice;
+    IOInterruptEventSource *msixSources[kItlIntrQueueCount];
+    uint64_t msixCount[kItlIntrQueueCount];
+    
+    IOWorkLoop *rxWorkLoop;
+    IOInterruptEventSource *rxPollSource;
+    struct ItlRxPollStats rxPollStats;
 
     lck_grp_t *inner_gp;
     lck_grp_attr_t *inner_gp_attr;
     lck_attr_t *inner_attr;
-    lck_mtx_t *inner_lock;
+    struct ItlWaitChannel waitChannels[kItlWaitChannels];
 };
 
 #endif /* ItlHalService_hpp */
@@ -0,0 +1,54 @@
+/*
+* Copyright (C) 2020  钟先耀
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef ItlPciMsi_hpp
+#define ItlPciMsi_hpp
+
+#include <IOKit/pci/IOPCIDevice.h>
+
+/*
+ * MSI/MSI-X capability bits. probe() sets the initial state by hand, the
+ * HAL only reads the MSI-X table size and leaves enabling to IOPCIFamily.
+ */
+
+#define  PCI_MSI_FLAGS        2    /* Message Control */
+#define  PCI_CAP_ID_MSI        0x05    /* Message Signalled Interrupts */
+#define  PCI_MSIX_FLAGS        2    /* Message Control */
+#define  PCI_CAP_ID_MSIX    0x11    /* MSI-X */
+#define  PCI_MSIX_FLAGS_ENABLE    0x8000    /* MSI-X enable */
+#define  PCI_MSIX_FLAGS_QSIZE    0x07FF    /* Table size - 1 */
+#define  PCI_MSI_FLAGS_ENABLE    0x0001    /* MSI feature enabled */
+
+static inline void pciMsiSetEnable(IOPCIDevice *device, UInt8 msiCap, int enable)
+{
+    UInt16 control;
+    
+    control = device->configRead16(msiCap + PCI_MSI_FLAGS);
+    control &= ~PCI_MSI_FLAGS_ENABLE;
+    if (enable)
+        control |= PCI_MSI_FLAGS_ENABLE;
+    device->configWrite16(msiCap + PCI_MSI_FLAGS, control);
+}
+
+static inline void pciMsiXClearAndSet(IOPCIDevice *device, UInt8 msixCap, UInt16 clear, UInt16 set)
+{
+    UInt16 ctrl;
+    
+    ctrl = device->configRead16(msixCap + PCI_MSIX_FLAGS);
+    ctrl &= ~clear;
+    ctrl |= set;
+    device->configWrite16(msixCap + PCI_MSIX_FLAGS, ctrl);
+}
+
+#endif /* ItlPciMsi_hpp */
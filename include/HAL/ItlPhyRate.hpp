@@ -0,0 +1,250 @@
+/*
+* Copyright (C) 2020  钟先耀
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef ItlPhyRate_hpp
+#define ItlPhyRate_hpp
+
+#include <stdint.h>
+
+/*
+ * HT/VHT/HE PHY rates in 500 kb/s units, the unit of the net80211 rate sets,
+ * generated at compile time from the 802.11 OFDM parameters.
+ */
+
+enum ItlPhyMode {
+    kItlPhyModeHT,
+    kItlPhyModeVHT,
+    kItlPhyModeHE,
+    kItlPhyModeCount
+};
+
+enum ItlPhyWidth {
+    kItlPhyWidth20,
+    kItlPhyWidth40,
+    kItlPhyWidth80,
+    kItlPhyWidth160,      /* also 80+80 */
+    kItlPhyWidthCount
+};
+
+/* HT/VHT use long and short only; HE has 3.2, 0.8 and 1.6 us. */
+enum ItlPhyGuard {
+    kItlPhyGuardLong,       /* 800 ns, HE 3.2 us */
+    kItlPhyGuardShort,      /* 400 ns, HE 0.8 us */
+    kItlPhyGuardHEMedium,   /* HE 1.6 us */
+    kItlPhyGuardCount
+};
+
+#define kItlPhyMaxNss   4
+#define kItlPhyMaxMcs   12
+
+struct ItlPhyRateTable {
+    uint16_t rate[kItlPhyModeCount][kItlPhyWidthCount][kItlPhyGuardCount][kItlPhyMaxNss][kItlPhyMaxMcs];
+};
+
+/* 0 for combinations that do not exist, e.g. VHT20 MCS9 with one stream. */
+static constexpr uint16_t
+itlPhyRateCompute(int mode, int width, int guard, int nss, int mcs)
+{
+    // coded bits per subcarrier and coding rate of MCS 0..11
+    constexpr uint16_t bpscs[kItlPhyMaxMcs] = { 1, 2, 2, 4, 4, 6, 6, 6, 8, 8, 10, 10 };
+    constexpr uint16_t rateNum[kItlPhyMaxMcs] = { 1, 1, 3, 1, 3, 2, 3, 5, 3, 5, 3, 5 };
+    constexpr uint16_t rateDen[kItlPhyMaxMcs] = { 2, 2, 4, 2, 4, 3, 4, 6, 4, 6, 4, 6 };
+    // data subcarriers per width
+    constexpr uint16_t htSd[kItlPhyWidthCount] = { 52, 108, 234, 468 };
+    constexpr uint16_t heSd[kItlPhyWidthCount] = { 234, 468, 980, 1960 };
+    // symbol time in 100 ns units
+    constexpr uint16_t htSym[kItlPhyGuardCount] = { 40, 36, 0 };
+    constexpr uint16_t heSym[kItlPhyGuardCount] = { 160, 136, 144 };
+    uint64_t bits = 0;
+    uint64_t div = 0;
+
+    switch (mode) {
+        case kItlPhyModeHT:
+            if (width > kItlPhyWidth40 || guard > kItlPhyGuardShort || mcs > 7) {
+                return 0;
+            }
+            break;
+        case kItlPhyModeVHT:
+            if (guard > kItlPhyGuardShort || mcs > 9) {
+                return 0;
+            }
+            // Ndbps must split evenly over the encoders, 802.11-2016 21.5
+            if ((width == kItlPhyWidth80 && nss == 3 && mcs == 6) ||
+                (width == kItlPhyWidth160 && nss == 3 && mcs == 9)) {
+                return 0;
+            }
+            break;
+        case kItlPhyModeHE:
+            break;
+        default:
+            return 0;
+    }
+    bits = (uint64_t)(mode == kItlPhyModeHE ? heSd[width] : htSd[width]) * bpscs[mcs] * nss * rateNum[mcs];
+    // VHT needs whole data bits per symbol, HE pads instead
+    if (mode == kItlPhyModeVHT && bits % rateDen[mcs] != 0) {
+        return 0;
+    }
+    // bits per symbol over the symbol time, doubled for 500 kb/s units
+    bits *= 20;
+    div = (uint64_t)rateDen[mcs] * (mode == kItlPhyModeHE ? heSym[guard] : htSym[guard]);
+    return (uint16_t)((bits + div / 2) / div);
+}
+
+static constexpr struct ItlPhyRateTable
+itlPhyRateBuild()
+{
+    struct ItlPhyRateTable table = {};
+
+    for (int mode = 0; mode < kItlPhyModeCount; mode++) {
+        for (int width = 0; width < kItlPhyWidthCount; width++) {
+            for (int guard = 0; guard < kItlPhyGuardCount; guard++) {
+                for (int nss = 1; nss <= kItlPhyMaxNss; nss++) {
+                    for (int mcs = 0; mcs < kItlPhyMaxMcs; mcs++) {
+                        table.rate[mode][width][guard][nss - 1][mcs] = itlPhyRateCompute(mode, width, guard, nss, mcs);
+                    }
+                }
+            }
+        }
+    }
+    return table;
+}
+
+inline constexpr struct ItlPhyRateTable itlPhyRates = itlPhyRateBuild();
+
+/*
+ * For HT pass the per stream MCS (0..7) and the stream count, not the
+ * 0..31 index. Returns 0 for out of range or invalid combinations.
+ */
+static constexpr uint32_t
+itlPhyRate(int mode, int width, int guard, int nss, int mcs)
+{
+    if (mode < 0 || mode >= kItlPhyModeCount || width < 0 || width >= kItlPhyWidthCount ||
+        guard < 0 || guard >= kItlPhyGuardCount || nss < 1 || nss > kItlPhyMaxNss ||
+        mcs < 0 || mcs >= kItlPhyMaxMcs) {
+        return 0;
+    }
+    return itlPhyRates.rate[mode][width][guard][nss - 1][mcs];
+}
+
+// spot checks against the rate tables of 802.11-2016 and 802.11ax
+static_assert(itlPhyRate(kItlPhyModeHT, kItlPhyWidth20, kItlPhyGuardLong, 1, 0) == 13, "HT20 MCS0 6.5 Mb/s");
+static_assert(itlPhyRate(kItlPhyModeHT, kItlPhyWidth40, kItlPhyGuardShort, 4, 7) == 1200, "HT40 MCS31 SGI 600 Mb/s");
+static_assert(itlPhyRate(kItlPhyModeVHT, kItlPhyWidth80, kItlPhyGuardShort, 1, 9) == 867, "VHT80 MCS9 SGI 433.3 Mb/s");
+static_assert(itlPhyRate(kItlPhyModeVHT, kItlPhyWidth160, kItlPhyGuardShort, 2, 9) == 3467, "VHT160 2SS MCS9 SGI 1733.3 Mb/s");
+static_assert(itlPhyRate(kItlPhyModeVHT, kItlPhyWidth20, kItlPhyGuardLong, 1, 9) == 0, "VHT20 1SS MCS9 is not defined");
+static_assert(itlPhyRate(kItlPhyModeHE, kItlPhyWidth80, kItlPhyGuardShort, 2, 11) == 2402, "HE80 2SS MCS11 0.8us 1201 Mb/s");
+static_assert(itlPhyRate(kItlPhyModeHE, kItlPhyWidth20, kItlPhyGuardLong, 1, 0) == 15, "HE20 MCS0 3.2us 7.3 Mb/s");
+
+/*
+ * Where 802.11-2016 21.5 and 802.11ax 27.5 define a rate, written out from
+ * their tables rather than derived like itlPhyRateCompute() does.
+ */
+static constexpr bool
+itlPhyRateDefined(int mode, int width, int guard, int nss, int mcs)
+{
+    switch (mode) {
+        case kItlPhyModeHT:
+            return width <= kItlPhyWidth40 && guard <= kItlPhyGuardShort && mcs <= 7;
+        case kItlPhyModeVHT:
+            if (guard > kItlPhyGuardShort || mcs > 9) {
+                return false;
+            }
+            if (width == kItlPhyWidth20 && mcs == 9) {
+                return nss == 3;
+            }
+            if ((width == kItlPhyWidth80 && mcs == 6) || (width == kItlPhyWidth160 && mcs == 9)) {
+                return nss != 3;
+            }
+            return true;
+        case kItlPhyModeHE:
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Exhaustive over every mode/width/guard/NSS/MCS: the table holds the
+ * computed rate, it is 0 exactly where no rate is defined, and defined
+ * rates grow with the MCS, the width and a shorter guard interval, and
+ * with the stream count up to rounding.
+ */
+static constexpr bool
+itlPhyRateTableValid()
+{
+    // guard intervals from the longest symbol to the shortest
+    constexpr int htGuards[] = { kItlPhyGuardLong, kItlPhyGuardShort };
+    constexpr int heGuards[] = { kItlPhyGuardLong, kItlPhyGuardHEMedium, kItlPhyGuardShort };
+
+    for (int mode = 0; mode < kItlPhyModeCount; mode++) {
+        const int *guards = mode == kItlPhyModeHE ? heGuards : htGuards;
+        int guardCount = mode == kItlPhyModeHE ? 3 : 2;
+
+        for (int width = 0; width < kItlPhyWidthCount; width++) {
+            for (int nss = 1; nss <= kItlPhyMaxNss; nss++) {
+                for (int mcs = 0; mcs < kItlPhyMaxMcs; mcs++) {
+                    for (int guard = 0; guard < kItlPhyGuardCount; guard++) {
+                        uint32_t rate = itlPhyRate(mode, width, guard, nss, mcs);
+                        uint32_t single = itlPhyRate(mode, width, guard, 1, mcs);
+                        uint32_t lower = mcs > 0 ? itlPhyRate(mode, width, guard, nss, mcs - 1) : 0;
+                        uint32_t narrower = width > 0 ? itlPhyRate(mode, width - 1, guard, nss, mcs) : 0;
+                        uint32_t streams = nss * single;
+
+                        if ((rate != 0) != itlPhyRateDefined(mode, width, guard, nss, mcs) ||
+                            rate != itlPhyRateCompute(mode, width, guard, nss, mcs)) {
+                            return false;
+                        }
+                        if (rate == 0) {
+                            continue;
+                        }
+                        if (rate <= lower || rate <= narrower) {
+                            return false;
+                        }
+                        // rate is rounded once, nss * single carries nss roundings
+                        if (single != 0 && 2 * (rate > streams ? rate - streams : streams - rate) > (uint32_t)nss + 1) {
+                            return false;
+                        }
+                    }
+                    for (int g = 1; g < guardCount; g++) {
+                        uint32_t rate = itlPhyRate(mode, width, guards[g], nss, mcs);
+                        if (rate != 0 && rate <= itlPhyRate(mode, width, guards[g - 1], nss, mcs)) {
+                            return false;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static_assert(itlPhyRateTableValid(), "PHY rate table disagrees with 802.11 or itlPhyRateCompute()");
+
+/*
+ * Whole Mb/s of a 500 kb/s rate for interfaces without half megabits.
+ * HT/VHT/HE rates are truncated like getRATE always did. CCK 5.5 Mb/s is
+ * the only legacy rate that is not whole, and no HT/VHT/HE rate is 5.5
+ * Mb/s, so it alone rounds up rather than look like a 5 Mb/s link.
+ */
+static constexpr uint32_t
+itlPhyRateMbps(uint32_t rate)
+{
+    return rate == 11 ? 6 : rate / 2;
+}
+
+static_assert(itlPhyRateMbps(11) == 6, "CCK 5.5 Mb/s is not reported as 5");
+static_assert(itlPhyRateMbps(13) == 6, "HT20 MCS0 6.5 Mb/s");
+static_assert(itlPhyRateMbps(867) == 433, "VHT80 MCS9 SGI 433.3 Mb/s");
+static_assert(itlPhyRateMbps(108) == 54, "OFDM 54 Mb/s");
+
+#endif /* ItlPhyRate_hpp */
@@ -13,11 +13,35 @@
 */
 
 #include "ItlNetworkUserClient.hpp"
+#include "HAL/ItlPhyRate.hpp"
 #include <sys/_netstat.h>
 
 #define super IOUserClient
 OSDefineMetaClassAndStructors( ItlNetworkUserClient, IOUserClient );
 
+/*
+ * Answered by the controller the HAL runs under, which keeps the counters;
+ * the provider is the driver and does not know the function.
+ */
+static IOReturn
+sAPPLE80211_STATS(OSObject* target, void* data, bool isSet)
+{
+    ItlNetworkUserClient *that = OSDynamicCast(ItlNetworkUserClient, target);
+    itlwm *driver = OSDynamicCast(itlwm, that->getProvider());
+    if (isSet) {
+        return kIOReturnUnsupported;
+    }
+    return driver->fHalService->getController()->callPlatformFunction(ITL_IOCTL_STATS_FUNCTION, false, data, NULL, NULL, NULL);
+}
+
+static IOReturn
+sINT_MODERATION(OSObject* target, void* data, bool isSet)
+{
+    ItlNetworkUserClient *that = OSDynamicCast(ItlNetworkUserClient, target);
+    itlwm *driver = OSDynamicCast(itlwm, that->getProvider());
+    return driver->fHalService->getController()->callPlatformFunction(ITL_INT_MODERATION_FUNCTION, false, data, (void *)(uintptr_t)isSet, NULL, NULL);
+}
+
 const IOControlMethodAction ItlNetworkUserClient::sMethods[IOCTL_ID_MAX] {
     sDRIVER_INFO,
     sSTA_INFO,
@@ -31,6 +55,8 @@ const IOControlMethodAction ItlNetworkUserClient::sMethods[IOCTL_ID_MAX] {
     sSCAN,
     sSCAN_RESULT,
     sTX_POWER_LEVEL,
+    sAPPLE80211_STATS,
+    sINT_MODERATION,
 };
 
 bool ItlNetworkUserClient::initWithTask(task_t owningTask, void *securityID, UInt32 type, OSDictionary *properties)
@@ -75,18 +101,36 @@ void ItlNetworkUserClient::stop(IOService *provider)
     super::stop( provider );
 }
 
+/* Selectors that copy a whole struct, 0 for the rest. */
+static size_t
+ioctlStructSize(uint32_t selector)
+{
+    switch (selector) {
+        case IOCTL_80211_APPLE80211_STATS:
+            return sizeof(struct ioctl_apple80211_stats);
+        case IOCTL_80211_INT_MODERATION:
+            return sizeof(struct ioctl_int_moderation);
+            
+        default:
+            return 0;
+    }
+}
+
 IOReturn ItlNetworkUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments * arguments, IOExternalMethodDispatch * dispatch, OSObject * target, void * reference)
 {
     bool isSet = selector & IOCTL_MASK;
     selector &= ~IOCTL_MASK;
 //    IOLog("externalMethod invoke. selector=0x%X isSet=%d\n", selector, isSet);
-    if (selector < 0 || selector > IOCTL_ID_MAX) {
+    if (selector < 0 || selector >= IOCTL_ID_MAX) {
         return super::externalMethod(selector, arguments, NULL, this, NULL);
     }
     void *data = isSet ? (void *)arguments->structureInput : (void *)arguments->structureOutput;
     if (!data) {
         return kIOReturnError;
     }
+    if ((isSet ? arguments->structureInputSize : arguments->structureOutputSize) < ioctlStructSize(selector)) {
+        return kIOReturnBadArgument;
+    }
     return sMethods[selector](this, data, isSet);
 }
 
@@ -109,91 +153,27 @@ sSTA_INFO(OSObject* target, void* data, bool isSet)
     ItlNetworkUserClient *that = OSDynamicCast(ItlNetworkUserClient, target);
     struct ioctl_sta_info *st = (struct ioctl_sta_info *)data;
     struct ieee80211com *ic = that->fDriver->fHalService->get80211Controller();
-    struct ieee80211_node *ic_bss = ic->ic_bss;
-    int nss;
-    int sgi;
-    int index = 0;
+    struct ItlStaInfo info;
     if (isSet) {
         return kIOReturnError;
     }
-    if (ic_bss == NULL) {
-        return kIOReturnError;
-    }
-    if (ic_bss->ni_chan == NULL) {
-        return kIOReturnError;
-    }
-    if (ic->ic_state != IEEE80211_S_RUN) {
+    // the driver alone never rebuilds the snapshot, so do it here
+    if (!that->fDriver->fHalService->refreshStaInfo(&info)) {
         return kIOReturnError;
     }
     st->version = IOCTL_VERSION;
-    st->op_mode = ic->ic_curmode > 0 ? (enum itl_phy_mode)(ic->ic_curmode - 1) : ITL80211_MODE_11A;
-    st->max_mcs = ic_bss->ni_txmcs;
-    st->cur_mcs = ic_bss->ni_txmcs;
-    st->channel = ieee80211_chan2ieee(ic, ic_bss->ni_chan);
-    switch (ic->ic_bss->ni_chw) {
-        case IEEE80211_CHAN_WIDTH_40:
-            st->band_width = 40;
-            break;
-        case IEEE80211_CHAN_WIDTH_80:
-            st->band_width = 80;
-            break;
-        case IEEE80211_CHAN_WIDTH_80P80:
-        case IEEE80211_CHAN_WIDTH_160:
-            st->band_width = 160;
-            break;
-            
-        default:
-            st->band_width = 20;
-            break;
-    }
-    st->rssi = -(0 - IWM_MIN_DBM - ic_bss->ni_rssi);
-    st->noise = that->fDriver->fHalService->getDriverInfo()->getBSSNoise();
-    if (ic->ic_curmode == IEEE80211_MODE_11AC) {
-        sgi = (ieee80211_node_supports_vht_sgi80(ic_bss) || ieee80211_node_supports_vht_sgi160(ic_bss));
-        if (sgi) {
-            index += 1;
-        }
-        nss = that->fDriverInfo->getTxNSS();
-        switch (ic_bss->ni_chw) {
-            case IEEE80211_CHAN_WIDTH_40:
-                index += 4;
-                break;
-            case IEEE80211_CHAN_WIDTH_80:
-                index += 8;
-                break;
-            case IEEE80211_CHAN_WIDTH_80P80:
-            case IEEE80211_CHAN_WIDTH_160:
-                index += 12;
-                break;
-
-            case 0:
-            case 20:    
-            default:
-                break;
-        }
-        index += 2 * (nss - 1);
-        const struct ieee80211_vht_rateset *rs = &ieee80211_std_ratesets_11ac[index];
-        st->rate = rs->rates[ic_bss->ni_txmcs % rs->nrates] / 2;
-    } else if (ic->ic_curmode == IEEE80211_MODE_11N) {
-        int is_40mhz = ic_bss->ni_chw == IEEE80211_CHAN_WIDTH_40;
-        sgi = ((!is_40mhz && ieee80211_node_supports_ht_sgi20(ic_bss)) || (is_40mhz && ieee80211_node_supports_ht_sgi40(ic_bss)));
-        if (sgi) {
-            index += 1;
-        }
-        if (is_40mhz) {
-            index += (IEEE80211_HT_RATESET_MIMO4_SGI + 1);
-        }
-        index += (ic_bss->ni_txmcs / 16);
-        nss = ic_bss->ni_txmcs / 8 + 1;
-        index += 2 * (nss - 1);
-        st->rate = ieee80211_std_ratesets_11n[index].rates[ic_bss->ni_txmcs % 8] / 2;
-    } else {
-        st->rate = ic_bss->ni_rates.rs_rates[ic_bss->ni_txrate];
-    }
+    st->op_mode = info.mode > 0 ? (enum itl_phy_mode)(info.mode - 1) : ITL80211_MODE_11A;
+    st->max_mcs = info.mcs;
+    st->cur_mcs = info.mcs;
+    st->channel = info.channel;
+    st->band_width = info.bandwidth;
+    st->rssi = info.rssi;
+    st->noise = info.noise;
+    st->rate = itlPhyRateMbps(info.txRate);
     memset(st->ssid, 0, sizeof(st->ssid));
     bcopy(ic->ic_des_essid, st->ssid, ic->ic_des_esslen);
     memset(st->bssid, 0, sizeof(st->bssid));
-    bcopy(ic->ic_bss->ni_bssid, st->bssid, ETHER_ADDR_LEN);
+    bcopy(info.bssid, st->bssid, ETHER_ADDR_LEN);
     return kIOReturnSuccess;
 }
 
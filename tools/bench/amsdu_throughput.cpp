@@ -0,0 +1,70 @@
+//
+//  amsdu_throughput.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Airtime model of Tx goodput with and without the A-MSDU stage, for a
+//  saturated stream of equal sized frames. One MPDU per PPDU, CCMP, no
+//  collisions, average backoff at CWmin, BlockAck at 24 Mb/s. Aggregates
+//  are packed with the same layout arithmetic as ItlAmsdu.
+//
+//  c++ -std=c++11 -O2 -Wall -I BCMWLANFirmware_Hashstore -o /tmp/amsdu_throughput tools/bench/amsdu_throughput.cpp && /tmp/amsdu_throughput
+//
+
+#include "ItlAmsduLayout.hpp"
+
+#include <stdio.h>
+
+#define DIFS_US         34.0
+#define BACKOFF_US      (15 * 9 / 2.0)
+#define PREAMBLE_US     40.0    /* L-STF..HT/VHT-LTF, 1-2 streams */
+#define SIFS_US         16.0
+#define BA_US           32.0
+
+#define QOS_HDR_LEN     26
+#define CCMP_LEN        16      /* header + MIC */
+#define FCS_LEN         4
+
+static double
+ppduUS(uint32_t mpduLen, double rateMbps)
+{
+    return DIFS_US + BACKOFF_US + PREAMBLE_US + mpduLen * 8 / rateMbps + SIFS_US + BA_US;
+}
+
+/* Goodput in Mb/s counting the IP payload of each frame, frameLen includes the Ethernet header. */
+static double
+goodput(uint32_t frameLen, uint32_t maxLength, uint32_t maxSubframes, double rateMbps)
+{
+    uint32_t amsduLen = 0;
+    uint32_t count = 0;
+    uint32_t mpduLen;
+
+    while (count < maxSubframes && itlAmsduAppendLength(amsduLen, frameLen) <= maxLength) {
+        amsduLen = itlAmsduAppendLength(amsduLen, frameLen);
+        count++;
+    }
+    if (count <= 1) {
+        count = 1;
+        mpduLen = QOS_HDR_LEN + CCMP_LEN + FCS_LEN + kItlAmsduLLCLen + frameLen - kItlAmsduEtherHdrLen;
+    } else {
+        mpduLen = QOS_HDR_LEN + CCMP_LEN + FCS_LEN + amsduLen;
+    }
+    return count * (frameLen - kItlAmsduEtherHdrLen) * 8 / ppduUS(mpduLen, rateMbps);
+}
+
+int
+main()
+{
+    static const uint32_t frames[] = { 64, 128, 256, 400 };
+    static const double rates[] = { 65.0, 144.4, 433.3, 866.7 };
+    unsigned i, j;
+
+    printf("%-8s %-10s %12s %12s %8s\n", "frame", "PHY Mb/s", "MSDU Mb/s", "A-MSDU Mb/s", "gain");
+    for (i = 0; i < sizeof(frames) / sizeof(frames[0]); i++) {
+        for (j = 0; j < sizeof(rates) / sizeof(rates[0]); j++) {
+            double plain = goodput(frames[i], 0, 1, rates[j]);
+            double agg = goodput(frames[i], 3839, 8, rates[j]);
+            printf("%-8u %-10.1f %12.1f %12.1f %7.2fx\n", frames[i], rates[j], plain, agg, agg / plain);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,196 @@
+//
+//  wait_channels.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  pthread model of ItlHalService's wait channels: command round-trip
+//  latency with several request/response pairs sleeping at once, each
+//  pair on idents of its own. One channel stands for the old single
+//  inner_lock, kItlWaitChannels for the hashed table. A channel's
+//  condition variable plays the kernel wait queue its idents share, so a
+//  wakeup reaches every sleeper on the channel like a hash collision
+//  does. It models the locking, not XNU's scheduler.
+//
+//  c++ -std=c++11 -O2 -Wall -pthread -o /tmp/wait_channels tools/bench/wait_channels.cpp && /tmp/wait_channels [pairs] [round trips]
+//
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+
+#define kItlWaitChannels    16
+#define kMaxPairs           64
+
+struct Channel {
+    pthread_mutex_t lock;
+    pthread_cond_t queue;
+    std::atomic<int> sleepers;
+    std::atomic<uint64_t> wakeups;
+    std::atomic<uint64_t> idleWakeups;
+};
+
+/* One firmware command slot: the host posts seq, the "firmware" answers it. */
+struct alignas(64) Pair {
+    std::atomic<uint32_t> request;
+    char pad0[60];
+    std::atomic<uint32_t> response;
+    char pad1[60];
+    pthread_t host;
+    pthread_t firmware;
+    uint64_t totalNS;
+    uint64_t maxNS;
+};
+
+static Channel channels[kItlWaitChannels];
+static Pair pairs[kMaxPairs];
+static int channelCount;
+static int roundTrips;
+
+static uint64_t
+nowNS()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Same hash as ItlHalService::waitChannel(). */
+static Channel *
+waitChannel(const void *ident)
+{
+    uintptr_t h = (uintptr_t)ident >> 4;
+
+    h ^= h >> 8;
+    h ^= h >> 16;
+    return &channels[h & (channelCount - 1)];
+}
+
+/* tsleep_nsec() plus the caller's loop: sleep on ident until *word reaches want. */
+static void
+sleepUntil(std::atomic<uint32_t> *word, uint32_t want)
+{
+    Channel *ch = waitChannel(word);
+
+    pthread_mutex_lock(&ch->lock);
+    ch->sleepers++;
+    while (word->load() != want) {
+        pthread_cond_wait(&ch->queue, &ch->lock);
+    }
+    ch->sleepers--;
+    pthread_mutex_unlock(&ch->lock);
+}
+
+/* wakeupOn(): skip the wait queue when nobody sleeps on the channel. */
+static void
+wakeupOn(std::atomic<uint32_t> *word)
+{
+    Channel *ch = waitChannel(word);
+
+    if (ch->sleepers.load() == 0) {
+        ch->idleWakeups++;
+        return;
+    }
+    ch->wakeups++;
+    pthread_mutex_lock(&ch->lock);
+    pthread_cond_broadcast(&ch->queue);
+    pthread_mutex_unlock(&ch->lock);
+}
+
+static void *
+firmwareThread(void *arg)
+{
+    Pair *p = (Pair *)arg;
+
+    for (uint32_t seq = 1; seq <= (uint32_t)roundTrips; seq++) {
+        sleepUntil(&p->request, seq);
+        p->response.store(seq);
+        wakeupOn(&p->response);
+    }
+    return NULL;
+}
+
+static void *
+hostThread(void *arg)
+{
+    Pair *p = (Pair *)arg;
+
+    for (uint32_t seq = 1; seq <= (uint32_t)roundTrips; seq++) {
+        uint64_t start = nowNS();
+        uint64_t ns;
+
+        p->request.store(seq);
+        wakeupOn(&p->request);
+        sleepUntil(&p->response, seq);
+        ns = nowNS() - start;
+        p->totalNS += ns;
+        if (ns > p->maxNS) {
+            p->maxNS = ns;
+        }
+    }
+    return NULL;
+}
+
+static void
+run(int count, int pairCount)
+{
+    uint64_t totalNS = 0;
+    uint64_t maxNS = 0;
+    uint64_t wakeups = 0;
+    uint64_t idleWakeups = 0;
+    int i;
+
+    channelCount = count;
+    for (i = 0; i < kItlWaitChannels; i++) {
+        pthread_mutex_init(&channels[i].lock, NULL);
+        pthread_cond_init(&channels[i].queue, NULL);
+        channels[i].sleepers = 0;
+        channels[i].wakeups = 0;
+        channels[i].idleWakeups = 0;
+    }
+    for (i = 0; i < pairCount; i++) {
+        pairs[i].request = 0;
+        pairs[i].response = 0;
+        pairs[i].totalNS = 0;
+        pairs[i].maxNS = 0;
+        pthread_create(&pairs[i].firmware, NULL, firmwareThread, &pairs[i]);
+        pthread_create(&pairs[i].host, NULL, hostThread, &pairs[i]);
+    }
+    for (i = 0; i < pairCount; i++) {
+        pthread_join(pairs[i].host, NULL);
+        pthread_join(pairs[i].firmware, NULL);
+        totalNS += pairs[i].totalNS;
+        if (pairs[i].maxNS > maxNS) {
+            maxNS = pairs[i].maxNS;
+        }
+    }
+    for (i = 0; i < kItlWaitChannels; i++) {
+        wakeups += channels[i].wakeups;
+        idleWakeups += channels[i].idleWakeups;
+        pthread_cond_destroy(&channels[i].queue);
+        pthread_mutex_destroy(&channels[i].lock);
+    }
+    printf("%-9d %-6d %12.1f %12.1f %10llu %10llu\n", count, pairCount,
+           totalNS / 1000.0 / ((uint64_t)pairCount * roundTrips), maxNS / 1000.0,
+           (unsigned long long)wakeups, (unsigned long long)idleWakeups);
+}
+
+int
+main(int argc, char **argv)
+{
+    int pairCount = argc > 1 ? atoi(argv[1]) : 4;
+
+    roundTrips = argc > 2 ? atoi(argv[2]) : 20000;
+    if (pairCount <= 0 || pairCount > kMaxPairs || roundTrips <= 0) {
+        fprintf(stderr, "usage: %s [pairs] [round trips]\n", argv[0]);
+        return 1;
+    }
+    printf("%-9s %-6s %12s %12s %10s %10s\n", "channels", "pairs", "avg RTT us", "max RTT us", "wakeups", "idle");
+    run(1, 1);
+    run(kItlWaitChannels, 1);
+    run(1, pairCount);
+    run(kItlWaitChannels, pairCount);
+    return 0;
+}
@@ -0,0 +1,135 @@
+//
+//  amsdu_layout.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Host test of the A-MSDU layout ItlAmsdu builds, checked byte by byte
+//  against IEEE 802.11-2016 9.3.2.2.2.
+//
+//  c++ -std=c++11 -Wall -I BCMWLANFirmware_Hashstore -o /tmp/amsdu_layout tools/test/amsdu_layout.cpp && /tmp/amsdu_layout
+//
+
+#include "ItlAmsduLayout.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+/* An Ethernet frame of len bytes: DA, SA, ethertype and a payload counting up from seed. */
+static void
+makeFrame(uint8_t *frame, uint32_t len, uint8_t seed)
+{
+    uint32_t i;
+
+    for (i = 0; i < 6; i++) {
+        frame[i] = 0x10 + seed;
+        frame[6 + i] = 0x20;
+    }
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+    for (i = kItlAmsduEtherHdrLen; i < len; i++) {
+        frame[i] = (uint8_t)(seed + i);
+    }
+}
+
+/* Same walk as ItlAmsdu::buildLocked(), minus the leading RA/SA header. */
+static uint32_t
+build(uint8_t *out, uint8_t frames[][2048], const uint32_t *lens, int count)
+{
+    uint32_t off = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        itlAmsduSubframeHeader(out + off, frames[i], lens[i]);
+        off += kItlAmsduSubframeHdrLen;
+        memcpy(out + off, frames[i] + kItlAmsduEtherHdrLen, lens[i] - kItlAmsduEtherHdrLen);
+        off += lens[i] - kItlAmsduEtherHdrLen;
+        if (i + 1 < count) {
+            memset(out + off, 0, itlAmsduPad(off));
+            off += itlAmsduPad(off);
+        }
+    }
+    return off;
+}
+
+static void
+testLayout(const uint32_t *lens, int count)
+{
+    static uint8_t frames[8][2048];
+    static uint8_t out[8 * 2048];
+    uint32_t expected = 0;
+    uint32_t off = 0;
+    uint32_t len;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        makeFrame(frames[i], lens[i], (uint8_t)i);
+        expected = itlAmsduAppendLength(expected, lens[i]);
+    }
+    len = build(out, frames, lens, count);
+    CHECK(len == expected);
+    for (i = 0; i < count; i++) {
+        const uint8_t *sf = out + off;
+        uint32_t msduLen = lens[i] - kItlAmsduEtherHdrLen + kItlAmsduLLCLen;
+
+        CHECK(off % 4 == 0);
+        CHECK(memcmp(sf, frames[i], 12) == 0);
+        CHECK(sf[12] == (msduLen >> 8) && sf[13] == (msduLen & 0xff));
+        CHECK(sf[14] == 0xaa && sf[15] == 0xaa && sf[16] == 0x03);
+        CHECK(sf[17] == 0 && sf[18] == 0 && sf[19] == 0);
+        CHECK(sf[20] == frames[i][12] && sf[21] == frames[i][13]);
+        CHECK(memcmp(sf + kItlAmsduSubframeHdrLen, frames[i] + kItlAmsduEtherHdrLen,
+                     lens[i] - kItlAmsduEtherHdrLen) == 0);
+        off += kItlAmsduEtherHdrLen + msduLen;
+        if (i + 1 < count) {
+            CHECK(off + itlAmsduPad(off) <= len);
+            for (uint32_t p = 0; p < itlAmsduPad(off); p++) {
+                CHECK(out[off + p] == 0);
+            }
+            off += itlAmsduPad(off);
+        }
+    }
+    // no padding after the last subframe
+    CHECK(off == len);
+}
+
+int
+main()
+{
+    static const uint32_t aligned[] = { 62, 62, 62 };
+    static const uint32_t odd[] = { 60, 61, 63, 64, 65 };
+    static const uint32_t mixed[] = { 400, 15, 399, 66, 67, 68, 69, 70 };
+    uint32_t len;
+    int count;
+
+    CHECK(kItlAmsduSubframeHdrLen == 22);
+    CHECK(itlAmsduPad(0) == 0 && itlAmsduPad(1) == 3 && itlAmsduPad(2) == 2 && itlAmsduPad(3) == 1);
+    CHECK(itlAmsduAppendLength(0, 60) == 68);
+    CHECK(itlAmsduAppendLength(68, 61) == 68 + 69);
+    CHECK(itlAmsduAppendLength(69, 60) == 72 + 68);
+
+    testLayout(aligned, 3);
+    testLayout(odd, 5);
+    testLayout(mixed, 8);
+    testLayout(odd, 1);
+
+    // kItlAmsduMaxSubframes default size frames always fit the 3839 byte minimum
+    for (len = 0, count = 0; count < 8; count++) {
+        len = itlAmsduAppendLength(len, 400);
+    }
+    CHECK(len <= 3839);
+
+    if (failures) {
+        printf("amsdu_layout: %d failures\n", failures);
+        return 1;
+    }
+    printf("amsdu_layout: ok\n");
+    return 0;
+}
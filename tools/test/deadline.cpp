@@ -0,0 +1,123 @@
+//
+//  deadline.cpp
+//  BCMWLANFirmware_Hashstore
+//
+//  Host test of itlDeadline(), the timeout to mach time deadline conversion
+//  behind tsleep_nsec() and commandSleepDeadline(), checked against 128 bit
+//  arithmetic for the Intel and Apple silicon timebases and a few odd ones.
+//
+//  c++ -std=c++14 -Wall -I include/HAL -o /tmp/deadline tools/test/deadline.cpp && /tmp/deadline
+//
+
+#include "ItlDeadline.hpp"
+
+#include <stdio.h>
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+struct Timebase {
+    uint32_t numer;
+    uint32_t denom;
+};
+
+/* floor(nsec * denom / numer) ticks after now, saturated at the end of the clock. */
+static uint64_t
+reference(uint64_t now, uint64_t nsec, uint32_t numer, uint32_t denom)
+{
+    unsigned __int128 deadline;
+
+    if (nsec == kItlWaitForever) {
+        return kItlWaitForever;
+    }
+    deadline = (unsigned __int128)now + (unsigned __int128)nsec * denom / numer;
+    return deadline >= kItlWaitForever ? kItlWaitForever : (uint64_t)deadline;
+}
+
+static uint64_t
+next(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void
+check(uint64_t now, uint64_t nsec, const struct Timebase *tb)
+{
+    uint64_t got = itlDeadline(now, nsec, tb->numer, tb->denom);
+    uint64_t want = reference(now, nsec, tb->numer, tb->denom);
+
+    if (got != want) {
+        printf("now %llu nsec %llu timebase %u/%u: %llu, expected %llu\n",
+               (unsigned long long)now, (unsigned long long)nsec, tb->numer, tb->denom,
+               (unsigned long long)got, (unsigned long long)want);
+        failures++;
+    }
+}
+
+int
+main()
+{
+    static const struct Timebase timebases[] = {
+        { 1, 1 },               // x86
+        { 125, 3 },             // Apple silicon, 24 MHz
+        { 3, 125 },
+        { 1000000, 1 },
+        { 1, 1000000 },
+        { 0xffffffff, 0xfffffffe },
+        { 0xfffffffe, 0xffffffff },
+    };
+    static const uint64_t timeouts[] = {
+        0, 1, 999, 1000, 1000000, 999999999, 1000000000, 1000000001,
+        // whole seconds used to overflow a timespec's tv_nsec
+        3000000000ULL, 10000000000ULL, 60000000000ULL, 0x7fffffffULL, 0xffffffffULL,
+        UINT64_MAX / 2, UINT64_MAX - 1,
+    };
+    static const uint64_t nows[] = {
+        0, 1, 123456789, 1ULL << 40, UINT64_MAX / 2, UINT64_MAX - 1000000000ULL, UINT64_MAX - 1,
+    };
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+
+    for (const struct Timebase &tb : timebases) {
+        for (uint64_t now : nows) {
+            for (uint64_t nsec : timeouts) {
+                check(now, nsec, &tb);
+            }
+            CHECK(itlDeadline(now, kItlWaitForever, tb.numer, tb.denom) == kItlWaitForever);
+            CHECK(itlDeadline(now, 0, tb.numer, tb.denom) == now);
+            // the largest whole-unit quotient that passes the overflow check, plus a remainder
+            for (uint64_t r = 0; r < tb.numer && r < 1000; r++) {
+                check(now, kItlWaitForever / tb.denom * tb.numer + r, &tb);
+            }
+        }
+        for (int i = 0; i < 200000; i++) {
+            uint64_t now = next(&state) >> (next(&state) % 64);
+            uint64_t nsec = next(&state) >> (next(&state) % 64);
+
+            check(now, nsec, &tb);
+        }
+    }
+
+    // a later timeout never gives an earlier deadline
+    for (uint64_t nsec = 0; nsec < 100000; nsec++) {
+        CHECK(itlDeadline(1000, nsec, 125, 3) <= itlDeadline(1000, nsec + 1, 125, 3));
+    }
+    // tsleepHandler passes int timeouts through uint32_t
+    CHECK(itlDeadline(0, (uint32_t)2000000000, 1, 1) == 2000000000ULL);
+    CHECK(itlDeadline(0, (uint32_t)2000000000, 125, 3) == 48000000ULL);
+
+    if (failures) {
+        printf("deadline: %d failures\n", failures);
+        return 1;
+    }
+    printf("deadline: ok\n");
+    return 0;
+}